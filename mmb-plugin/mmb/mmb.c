@@ -21,11 +21,19 @@
 #include <vnet/plugin/plugin.h>
 
 #include <vppinfra/random.h>
+#include <vppinfra/unix.h>
 
 #include <mmb/mmb.h>
 #include <mmb/mmb_format.h>
 #include <mmb/mmb_classify.h>
 #include <mmb/mmb_conn.h>
+#include <mmb/mmb_runtime.h>
+#include <mmb/mmb_compiled.h>
+#include <mmb/mmb_lpm.h>
+#include <mmb/mmb_ipset.h>
+#include <mmb/mmb_bitvector.h>
+#include <mmb/mmb_exact.h>
+#include <mmb/mmb_payload.h>
 
 #include <vlibapi/api.h>
 #include <vlibmemory/api.h>
@@ -118,7 +126,32 @@ static int remove_rule(u32 rule_index);
  */
 static void flush();
 
-static void free_rule(mmb_rule_t *rule);
+/**
+ * batch_del_rule
+ * queue deletion of rule until commit
+ * @param rule_index: actual index + 1
+ */
+static int batch_del_rule(u32 rule_index);
+
+/**
+ * batch_free
+ * discard queued rule changes and leave batch mode
+ */
+static void batch_free();
+
+/**
+ * batch_begin / batch_commit
+ * open a batch, install rules resulting from queued changes
+ */
+static int batch_begin();
+static int batch_commit();
+
+/**
+ * apply_ops
+ * install rules resulting from changes at once, outside of any batch
+ */
+static int apply_ops(mmb_batch_op_t *ops);
+
 static void init_rule(mmb_rule_t *rule);
 static clib_error_t* parse_rule(unformat_input_t * input, 
                                 mmb_rule_t *rule);
@@ -254,6 +287,58 @@ static_always_inline int mask_equal(u8 *a, u8 *b) {
    return 1;
 }
 
+/*
+ * return (mask, skip, match) as a vector, key of mmb_main.table_by_mask
+ */
+static_always_inline u8 *table_hash_key(u8 *mask, u32 skip, u32 match) {
+   u8 *key = vec_dup(mask);
+   u8 *p;
+
+   vec_add2(key, p, 2*sizeof(u32));
+   clib_memcpy(p, &skip, sizeof(u32));
+   clib_memcpy(p+sizeof(u32), &match, sizeof(u32));
+   return key;
+}
+
+/*
+ * free sessions, session hash and keys of table
+ */
+static_always_inline void free_table(mmb_table_t *table) {
+   mmb_session_t *session;
+   u8 **merged_key;
+
+   pool_foreach(session, table->sessions, ({
+      vec_free(session->key);
+   }));
+   pool_free(table->sessions);
+   hash_free(table->session_by_key);
+   vec_free(table->mask);
+   vec_free(table->hash_key);
+   vec_foreach(merged_key, table->merged_keys) {
+      vec_free(*merged_key);
+   }
+   vec_free(table->merged_keys);
+}
+
+/*
+ * return MMB_RUNTIME_* parts of the snapshot holding the index of rule
+ */
+static_always_inline u32 rule_runtime_parts(mmb_rule_t *rule) {
+   u32 parts = 0;
+
+   if (rule->lpm)
+      parts |= MMB_RUNTIME_LPM;
+   if (rule->bitvector)
+      parts |= MMB_RUNTIME_BV;
+   if (rule->exact)
+      parts |= MMB_RUNTIME_EXACT;
+   if (in_classifier(rule))
+      parts |= MMB_RUNTIME_LOOKUP;
+   if (vec_len(rule->payload_matches))
+      parts |= MMB_RUNTIME_PAYLOAD;
+   return parts;
+}
+
 static_always_inline void mmb_enable_disable(u32 sw_if_index, int enable_disable) {
    mmb_main_t *mm = &mmb_main;
    mmb_classify_main_t *mcm = mm->mmb_classify_main;
@@ -390,6 +475,7 @@ list_rules_command_fn(vlib_main_t * vm,
   if (!unformat_is_eof(input))
     return clib_error_return(0, "Syntax error: unexpected additional element");
   
+  mmb_runtime_sync_counters(mm);
   vlib_cli_output(vm, "%U", mmb_format_rules, mm->rules);
 
   return 0;
@@ -402,44 +488,52 @@ static void flush() {
   mmb_rule_t *rules = mm->rules, *rule;
   u32 first_table_index = ~0;
 
-  if (vec_len(mm->tables) == 0)
+  batch_free();
+
+  if (vec_len(rules) == 0)
      return;
 
   /* detach first table */
-  first_table_index = mm->tables[0].index;
-  attach_table_if(first_table_index, 0);
+  if (vec_len(mm->tables)) {
+    first_table_index = mm->tables[0].index;
+    attach_table_if(first_table_index, 0);
+  }
 
   purge_conn_forced(mct);
 
   /* delete sessions */
   vec_foreach(rule, rules) {
-    mmb_add_del_session(rule->classify_table_index, rule->classify_key, 
-                        0, 0, 0); 
-    free_rule(rule);
+    if (in_classifier(rule))
+      mmb_add_del_session(rule->classify_table_index, rule->classify_key, 
+                          0, 0, 0); 
+    mmb_runtime_retire_rule(rule);
   }
 
   /* flush lookup table */
   mmb_lookup_entry_t *lookup_entry;
   pool_flush(lookup_entry, mm->lookup_pool, ({
-      vec_free(lookup_entry->rule_indexes);
+      mmb_runtime_retire_rule_indexes(lookup_entry->rule_indexes);
+      lookup_entry->rule_indexes = 0;
   }));
 
   /* delete tables */
   mmb_table_t *table;
-  mmb_session_t *session;
-  mmb_classify_del_table(&first_table_index, 1);
+  if (first_table_index != ~0)
+    mmb_classify_del_table(&first_table_index, 1);
   vec_foreach(table, mm->tables) {
-    vec_foreach(session, table->sessions) {
-       vec_free(session->key);
-    }
-    vec_free(table->sessions);
-    vec_free(table->mask);
+    free_table(table);
   }
   vec_delete(mm->tables, vec_len(mm->tables), 0);
+  hash_free(mm->table_by_mask);
+  hash_free(mm->table_by_index);
+  mm->table_by_mask = hash_create_vec(0, sizeof(u8), sizeof(uword));
+  mm->table_by_index = hash_create(0, sizeof(uword));
 
   /* delete rules */
   if (vec_len(rules))
     vec_delete(rules, vec_len(rules), 0);
+  mmb_runtime_mark(MMB_RUNTIME_ALL);
+  mmb_runtime_publish(mm);
 
   if (mm->enabled) 
      mmb_enable_disable_all(0);
@@ -481,6 +575,284 @@ show_tables_command_fn(vlib_main_t * vm,
    return 0;
 }
 
+static clib_error_t*
+show_lpm_command_fn(vlib_main_t * vm,
+                    unformat_input_t * input,
+                    vlib_cli_command_t * cmd) {
+  mmb_runtime_t *rt;
+
+  /* changes not published yet */
+  mmb_runtime_publish_pending(&mmb_main);
+  rt = mmb_runtime_main.current;
+  if (rt == 0)
+    return 0;
+
+  vlib_cli_output(vm, "ip4 saddr: %U", mmb_format_lpm, 
+                  rt->lpm[MMB_CLASSIFY_TABLE_IP4][MMB_LPM_SRC]);
+  vlib_cli_output(vm, "ip4 daddr: %U", mmb_format_lpm, 
+                  rt->lpm[MMB_CLASSIFY_TABLE_IP4][MMB_LPM_DST]);
+  vlib_cli_output(vm, "ip6 saddr: %U", mmb_format_lpm, 
+                  rt->lpm[MMB_CLASSIFY_TABLE_IP6][MMB_LPM_SRC]);
+  vlib_cli_output(vm, "ip6 daddr: %U", mmb_format_lpm, 
+                  rt->lpm[MMB_CLASSIFY_TABLE_IP6][MMB_LPM_DST]);
+  return 0;
+}
+
+static clib_error_t*
+show_exact_command_fn(vlib_main_t * vm,
+                      unformat_input_t * input,
+                      vlib_cli_command_t * cmd) {
+  mmb_runtime_t *rt;
+
+  /* changes not published yet */
+  mmb_runtime_publish_pending(&mmb_main);
+  rt = mmb_runtime_main.current;
+  if (rt == 0)
+    return 0;
+
+  vlib_cli_output(vm, "ip4: %U", mmb_format_exact, 
+                  rt->exact[MMB_CLASSIFY_TABLE_IP4]);
+  vlib_cli_output(vm, "ip6: %U", mmb_format_exact, 
+                  rt->exact[MMB_CLASSIFY_TABLE_IP6]);
+  return 0;
+}
+
+static clib_error_t*
+show_patterns_command_fn(vlib_main_t * vm,
+                         unformat_input_t * input,
+                         vlib_cli_command_t * cmd) {
+  mmb_runtime_t *rt;
+  mmb_runtime_thread_t *pt;
+  mmb_payload_hits_t **pattern_hits = 0;
+  u64 *hits;
+
+  /* changes not published yet */
+  mmb_runtime_publish_pending(&mmb_main);
+  rt = mmb_runtime_main.current;
+  if (rt == 0)
+    return 0;
+
+  vec_foreach(pt, mmb_runtime_main.per_thread) {
+    vec_add1(pattern_hits, pt->pattern_hits);
+  }
+  hits = mmb_payload_sum_hits(rt->payload, pattern_hits);
+
+  vlib_cli_output(vm, "%U", mmb_format_payload, rt->payload, hits);
+  vec_free(pattern_hits);
+  vec_free(hits);
+  return 0;
+}
+
+static u8 *format_l4_bits(u8 *s, va_list *args) {
+  u32 bits = va_arg(*args, u32);
+  static const char *families[MMB_CLASSIFY_N_TABLES] = { "ip4", "ip6" };
+  static const char *classes[MMB_CLASSIFY_N_L4] = { "tcp", "udp", "icmp",
+                                                    "other" };
+  u32 tid, l4;
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++) {
+    for (l4 = 0; l4 < MMB_CLASSIFY_N_L4; l4++) {
+      if (bits & (1 << (tid * MMB_CLASSIFY_N_L4 + l4)))
+        s = format(s, " %s/%s", families[tid], classes[l4]);
+    }
+  }
+  return bits ? s : format(s, " none");
+}
+
+static clib_error_t*
+show_filters_command_fn(vlib_main_t * vm,
+                        unformat_input_t * input,
+                        vlib_cli_command_t * cmd) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  mmb_runtime_t *rt;
+  mmb_runtime_thread_t *pt;
+  u64 negatives = 0, false_positives = 0;
+  u32 table_index;
+
+  /* changes not published yet */
+  mmb_runtime_publish_pending(&mmb_main);
+  rt = mrm->current;
+  if (rt == 0)
+    return 0;
+
+  vec_foreach_index(table_index, rt->bloom_by_table) {
+    if (rt->bloom_by_table[table_index] == 0)
+      continue;
+    vlib_cli_output(vm, "table %u: %U", table_index, mmb_format_bloom,
+                    rt->bloom_by_table[table_index]);
+    if (table_index < vec_len(rt->l4_by_table))
+      vlib_cli_output(vm, "  probed by:%U", format_l4_bits,
+                      rt->l4_by_table[table_index]);
+  }
+
+  vec_foreach(pt, mrm->per_thread) {
+    negatives += pt->bloom_negatives;
+    false_positives += pt->bloom_false_positives;
+  }
+  vlib_cli_output(vm, "lookups skipped: %lu, false positives: %lu (%.3f%%)",
+                  negatives, false_positives,
+                  negatives + false_positives 
+                  ? 100.0 * false_positives / (negatives + false_positives)
+                  : 0.0);
+  return 0;
+}
+
+static clib_error_t*
+show_ipsets_command_fn(vlib_main_t * vm,
+                       unformat_input_t * input,
+                       vlib_cli_command_t * cmd) {
+  vlib_cli_output(vm, "%U", mmb_format_ipsets, &mmb_ipset_main);
+  return 0;
+}
+
+static uword unformat_ipset_prefix(unformat_input_t *input, va_list *args) {
+  mmb_ipset_prefix_t *prefix = va_arg(*args, mmb_ipset_prefix_t*);
+  int is_ip6 = va_arg(*args, int);
+  u32 len = is_ip6 ? 128 : 32, max_len = len;
+
+  memset(prefix, 0, sizeof(mmb_ipset_prefix_t));
+  if (is_ip6 && unformat(input, "%U", unformat_ip6_address, prefix->addr))
+    ;
+  else if (!is_ip6 && unformat(input, "%U", unformat_ip4_address, 
+                               prefix->addr))
+    ;
+  else
+    return 0;
+
+  if (unformat(input, "/%u", &len) && len > max_len)
+    return 0;
+  prefix->len = len;
+  return 1;
+}
+
+/**
+ * load_ipset
+ *
+ * Read one prefix per line, empty lines and lines starting with '#' are 
+ * ignored.
+ *
+ * @return NULL on success, error of the first invalid line otherwise
+ */
+static clib_error_t *load_ipset(u32 ipset_index, char *filename,
+                                mmb_ipset_prefix_t **prefixes) {
+  mmb_ipset_t *ipset = pool_elt_at_index(mmb_ipset_main.ipsets, ipset_index);
+  mmb_ipset_prefix_t prefix;
+  unformat_input_t line_input;
+  clib_error_t *error = 0;
+  u8 *contents = 0;
+  u32 line_number = 0, start, end;
+
+  if ( (error = unix_file_contents(filename, &contents)) )
+    return error;
+
+  for (start = 0; start < vec_len(contents); start = end + 1) {
+    line_number++;
+    for (end = start; end < vec_len(contents) && contents[end] != '\n'; end++)
+      ;
+    /* CRLF line endings */
+    len = end - start;
+    if (len && contents[end - 1] == '\r')
+      len--;
+
+    unformat_init_string(&line_input, (char *) contents + start, len);
+    if (unformat_check_input(&line_input) == UNFORMAT_END_OF_INPUT
+        || unformat(&line_input, "#"))
+      ;
+    else if (unformat(&line_input, "%U", unformat_ipset_prefix, &prefix,
+                      (int) ipset->is_ip6)
+             && unformat_is_eof(&line_input))
+      vec_add1(*prefixes, prefix);
+    else
+      error = clib_error_return(0, "%s line %u: invalid prefix '%U'",
+                                filename, line_number, 
+                                format_unformat_error, &line_input);
+    unformat_free(&line_input);
+    if (error)
+      break;
+  }
+
+  vec_free(contents);
+  return error;
+}
+
+static clib_error_t*
+ipset_command_fn(vlib_main_t * vm,
+                 unformat_input_t * input,
+                 vlib_cli_command_t * cmd) {
+  unformat_input_tolower(input);
+  mmb_ipset_prefix_t *prefixes = 0, prefix;
+  clib_error_t *error = 0;
+  u8 *name = 0, *filename = 0;
+  u32 ipset_index;
+  int is_add = 1, replace = 0;
+
+  if (unformat(input, "create %v", &name)) {
+    if (mmb_ipset_create(name, unformat(input, "ip6")))
+      error = clib_error_return(0, "ipset %v already exists", name);
+    goto done;
+  }
+
+  if (unformat(input, "delete %v", &name)) {
+    switch (mmb_ipset_delete(name)) {
+      case -1:
+        error = clib_error_return(0, "no ipset named %v", name);
+        break;
+      case -2:
+        error = clib_error_return(0, "ipset %v is used by rules", name);
+        break;
+    }
+    goto done;
+  }
+
+  if (unformat(input, "add %v", &name))
+    ;
+  else if (unformat(input, "del %v", &name))
+    is_add = 0;
+  else if (unformat(input, "load %v %s", &name, &filename))
+    replace = unformat(input, "replace");
+  else
+    return clib_error_return(0, "Syntax error: mmb ipset create <name> [ip6]"
+                                "|delete <name>|add <name> <prefix>..."
+                                "|del <name> <prefix>..."
+                                "|load <name> <file> [replace]");
+
+  ipset_index = mmb_ipset_find(name);
+  if (ipset_index == ~0) {
+    error = clib_error_return(0, "no ipset named %v", name);
+    goto done;
+  }
+
+  if (filename) {
+    vec_add1(filename, 0);
+    if ( (error = load_ipset(ipset_index, (char *) filename, &prefixes)) )
+      goto done;
+  } else {
+    while (unformat(input, "%U", unformat_ipset_prefix, &prefix,
+                    (int) mmb_ipset_main.ipsets[ipset_index].is_ip6))
+      vec_add1(prefixes, prefix);
+    if (!unformat_is_eof(input) || vec_len(prefixes) == 0) {
+      error = clib_error_return(0, "invalid prefix '%U'",
+                                format_unformat_error, input);
+      goto done;
+    }
+  }
+
+  if (mmb_ipset_update(ipset_index, prefixes, is_add, replace)) {
+    error = clib_error_return(0, "prefix longer than the %s addresses of "
+                              "ipset %v", mmb_ipset_main.ipsets[ipset_index]
+                                          .is_ip6 ? "ip6" : "ip4", name);
+    goto done;
+  }
+  vlib_cli_output(vm, "ipset %v: %u members", name,
+                  mmb_ipset_main.ipsets[ipset_index].member_count);
+
+done:
+  vec_free(prefixes);
+  vec_free(filename);
+  vec_free(name);
+  return error;
+}
+
 static clib_error_t*
 show_conn_command_fn(vlib_main_t * vm,
                         unformat_input_t * input,
@@ -509,6 +881,72 @@ show_conn_command_fn(vlib_main_t * vm,
    return 0;
 }
 
+/**
+ * unformat_conn_limit
+ *
+ * parse one limit of the connection table into mct, of the startup
+ * config and of the CLI. A limit of 0 is parsed but sets the error
+ * argument instead of mct.
+ */
+static uword unformat_conn_limit(unformat_input_t *input, va_list *args) {
+  mmb_conn_table_t *mct = va_arg(*args, mmb_conn_table_t*);
+  clib_error_t **error = va_arg(*args, clib_error_t**);
+  u32 value, *limit;
+  char *name;
+
+  if (unformat(input, "max-connections %u", &value)) {
+    name = "max-connections";
+    limit = &mct->max_connections;
+  } else if (unformat(input, "tcp-transient-timeout %u", &value)) {
+    name = "tcp-transient-timeout";
+    limit = &mct->timeouts_value[MMB_TIMEOUT_TCP_TRANSIENT];
+  } else if (unformat(input, "tcp-idle-timeout %u", &value)) {
+    name = "tcp-idle-timeout";
+    limit = &mct->timeouts_value[MMB_TIMEOUT_TCP_IDLE];
+  } else if (unformat(input, "udp-idle-timeout %u", &value)) {
+    name = "udp-idle-timeout";
+    limit = &mct->timeouts_value[MMB_TIMEOUT_UDP_IDLE];
+  } else if (unformat(input, "eviction lru")) {
+    mct->eviction = MMB_EVICTION_LRU;
+    return 1;
+  } else if (unformat(input, "eviction none")) {
+    mct->eviction = MMB_EVICTION_NONE;
+    return 1;
+  } else
+    return 0;
+
+  if (value == 0)
+    *error = clib_error_return(0, "%s must be non-zero", name);
+  else
+    *limit = value;
+  return 1;
+}
+
+static clib_error_t*
+set_conn_command_fn(vlib_main_t * vm,
+                    unformat_input_t * input,
+                    vlib_cli_command_t * cmd) {
+  unformat_input_tolower(input);
+  mmb_main_t *mm = &mmb_main;
+  mmb_conn_table_t *mct = mm->mmb_conn_table;
+  clib_error_t *error = 0;
+  u32 count = 0;
+
+  while (unformat_check_input(input) != UNFORMAT_END_OF_INPUT) {
+    if (!unformat(input, "%U", unformat_conn_limit, mct, &error))
+      return clib_error_return(0, "Syntax error: unknown input `%U'",
+                               format_unformat_error, input);
+    if (error)
+      return error;
+    count++;
+  }
+  if (count == 0)
+    return clib_error_return(0, "Syntax error: no limit given");
+
+  vlib_cli_output(vm, "%U", mmb_format_conn_limits, mct);
+  return 0;
+}
+
 static int vnet_set_mmb_classify_intfc(vlib_main_t *vm, u32 sw_if_index,
                                   u32 ip4_table_index, u32 ip6_table_index,
                                   u32 is_add) {
@@ -606,17 +1044,76 @@ static void ip6_header_host_to_net(u8 *header) {
  *
  * header_size: size of header whose payload is written
  * offset: header offset
+ *
+ * a value that does not fit in the mask is left to the second stage, see
+ * mmb_deep_payload.
  */
 static_always_inline void mmb_match_payload(u8 *mask, u8 *key, u8 *value,
                                             int offset, int header_size) {
-   int byte_count = clib_min(vec_len(value),
-                         MMB_CLASSIFY_MAX_MASK_LEN-header_size-offset);
+   int byte_count = vec_len(value);
+
+   if (offset + header_size + byte_count > MMB_CLASSIFY_MAX_MASK_LEN)
+      return;
 
    clib_memcpy(key+offset+header_size, value, byte_count);
    for (int i=0; i<byte_count; i++)
       mask[offset+header_size+i] = 0xff;
 }
 
+/**
+ * payload_offset
+ *
+ * @return offset from the ip header of the payload of a payload field in a
+ *         packet without options, 0 for other fields
+ */
+static_always_inline u32 payload_offset(mmb_rule_t *rule, u8 field) {
+   u32 l3_size = rule->l3 == ETHERNET_TYPE_IP6 
+                 ? sizeof(ip6_header_t) : sizeof(ip4_header_t);
+
+   switch (field) {
+      case MMB_FIELD_IP4_PAYLOAD:
+      case MMB_FIELD_IP6_PAYLOAD:
+         return l3_size;
+      case MMB_FIELD_ICMP_PAYLOAD:
+         return l3_size + sizeof(icmp46_header_t);
+      case MMB_FIELD_UDP_PAYLOAD:
+         return l3_size + sizeof(udp_header_t);
+      case MMB_FIELD_TCP_PAYLOAD:
+         return l3_size + sizeof(tcp_header_t);
+      default:
+         return 0;
+   }
+}
+
+/**
+ * mmb_deep_payload
+ *
+ * keep a payload value that does not fit in the classifier window for the
+ * second stage, which finds the payload past ip4 options, ip6 extension
+ * headers and tcp options.
+ */
+static void mmb_deep_payload(mmb_rule_t *rule, u8 field, u8 *value,
+                             mmb_deep_t **deeps) {
+   u32 offset = payload_offset(rule, field);
+   mmb_deep_t *deep;
+
+   if (offset == 0 || offset + vec_len(value) <= MMB_CLASSIFY_MAX_MASK_LEN)
+      return;
+
+   vec_add2(*deeps, deep, 1);
+   deep->field = field;
+   deep->value = vec_dup(value);
+}
+
+static void free_deeps(mmb_deep_t **deeps) {
+   mmb_deep_t *deep;
+
+   vec_foreach(deep, *deeps) {
+      vec_free(deep->value);
+   }
+   vec_free(*deeps);
+}
+
 static_always_inline void mmb_icmp_mask_and_key_inline(u8 *mask, 
                           u8 *key, int offset, u8 field, u8 *value) {
 
@@ -1058,6 +1555,23 @@ static void mmb_mask_and_key(mmb_rule_t *rule, int is_match) {
   vec_validate_aligned(key, MMB_CLASSIFY_MAX_MASK_LEN-1, sizeof(u32x4));
 
   mmb_l3_mask_and_key(rule, mask, key, is_match);
+
+  /* second stage */
+  if (is_match) {
+    mmb_match_t *match;
+
+    vec_foreach(match, rule->matches) {
+      mmb_deep_payload(rule, match->field, match->value, &rule->deep_matches);
+    }
+  } else {
+    mmb_target_t *target;
+
+    vec_foreach(target, rule->targets) {
+      if (target->keyword == MMB_TARGET_MODIFY)
+        mmb_deep_payload(rule, target->field, target->value, 
+                         &rule->deep_targets);
+    }
+  }
   
   /* Scan forward looking for the first significant mask octet */
   for (i = 0; i < vec_len(mask); i++)
@@ -1100,12 +1614,32 @@ static void mmb_mask_and_key(mmb_rule_t *rule, int is_match) {
 }
 
 static_always_inline void mmb_compute_mask(mmb_rule_t *rule) {
+   rule->lpm = mmb_lpm_rule_dir(rule) != MMB_LPM_N_DIR;
    mmb_mask_and_key(rule, 1);
+   rule->exact = !rule->lpm && mmb_exact_rule_eligible(rule);
+   rule->bitvector = mmb_main.engine == MMB_ENGINE_BITVECTOR && !rule->lpm
+                     && !rule->exact && mmb_bv_rule_eligible(rule);
    if (!is_drop(rule)) { /* XXX tcp opts */
       mmb_mask_and_key(rule, 0);
    }
 }
 
+/**
+ * mmb_classify_memory_size
+ *
+ * Classifier heap size for a table of nbuckets holding max_entries keys
+ * of match vectors.
+ */
+static_always_inline u32 mmb_classify_memory_size(u32 nbuckets, u32 match,
+                                                  u32 max_entries) {
+  uword entry_size = sizeof(vnet_classify_entry_t) + match * sizeof(u32x4);
+  uword memory_size = nbuckets * sizeof(vnet_classify_bucket_t)
+                    + max_entries * entry_size * MMB_TABLE_MEMORY_HEADROOM
+                    + MMB_TABLE_MEMORY_MIN;
+
+  return (u32) clib_min(memory_size, (uword) 0xffffffff);
+}
+
 static int
 mmb_classify_add_table(u8 *mask, u32 skip, u32 match,
 			              u32 *table_index, u32 next_table_index,
@@ -1115,8 +1649,8 @@ mmb_classify_add_table(u8 *mask, u32 skip, u32 match,
   mmb_classify_main_t *mcm = mm->mmb_classify_main;
   vnet_classify_main_t *vcm = mcm->vnet_classify_main;
 
-  u32 nbuckets = max_entries+1;
-  u32 memory_size = nbuckets << 14; /* ??? */
+  u32 nbuckets = max_pow2(max_entries);
+  u32 memory_size = mmb_classify_memory_size(nbuckets, match, max_entries);
   u32 miss_next_index = IP_LOOKUP_NEXT_REWRITE;
   u32 current_data_flag = 0;
   int current_data_offset = 0;
@@ -1163,19 +1697,16 @@ mmb_classify_update_table (u32 *table_index, u32 next_table_index) {
   return ret;
 }
 
-static_always_inline mmb_session_t *find_session(mmb_table_t *table, 
+static_always_inline mmb_session_t *find_session(mmb_table_t *table,
                                                  mmb_rule_t *rule) {
 
    /* return session for this rule if it exists in this table  */
-   mmb_session_t *sessions = table->sessions;
-   mmb_session_t *session;
+   uword *p = hash_get_mem(table->session_by_key, rule->classify_key);
 
-   vec_foreach(session, sessions) {
-      if (mask_equal(session->key, rule->classify_key))
-         return session;
-   }
+   if (p == 0)
+      return NULL;
 
-   return NULL;
+   return pool_elt_at_index(table->sessions, p[0]);
 }
 
 /**
@@ -1194,13 +1725,14 @@ static int add_del_session(mmb_table_t *table, mmb_rule_t *rule,
 
      if (session == NULL) {
 
-        mmb_session_t new_session;
-        new_session.lookup_index = mmb_lookup_pool_add(rule_index, ~0);
-        new_session.key = vec_dup(rule->classify_key);
-        new_session.next = next_if_match(rule);
+        pool_get(table->sessions, session);
+        session->lookup_index = mmb_lookup_pool_add(rule_index, ~0);
+        session->key = vec_dup(rule->classify_key);
+        session->next = next_if_match(rule);
 
-        vec_add1(table->sessions, new_session);
-        rule->lookup_index = new_session.lookup_index;
+        hash_set_mem(table->session_by_key, session->key,
+                     session - table->sessions);
+        rule->lookup_index = session->lookup_index;
         return 1;
      } else {
 
@@ -1214,8 +1746,9 @@ static int add_del_session(mmb_table_t *table, mmb_rule_t *rule,
       
       if (mmb_lookup_pool_del(rule_index, rule->lookup_index)) {
 
+         hash_unset_mem(table->session_by_key, session->key);
          vec_free(session->key);
-         vec_delete(table->sessions, 1, session - table->sessions);
+         pool_put(table->sessions, session);
 
          return 1;
       } else 
@@ -1270,23 +1803,20 @@ void attach_table_if(u32 table_index, int is_add) {
  */
 static_always_inline u32 find_table_internal_index(int index) {
    mmb_main_t *mm = &mmb_main;
-   mmb_table_t *tables = mm->tables, *table;
-   u32 table_index;
+   uword *p;
 
    if (index == ~0)
       return ~0;
 
-   vec_foreach_index(table_index, tables) {
-      table = &tables[table_index];
-      if (table->index == index)
-        return table_index;
-   }
+   p = hash_get(mm->table_by_index, index);
+   if (p == 0)
+      return ~0;
 
-   return ~0;
+   return p[0];
 }
 
 /**
- * find_table_internal_index
+ * find_table
  *
  * search table by mask
  * @return internal index of table with given mask
@@ -1294,19 +1824,31 @@ static_always_inline u32 find_table_internal_index(int index) {
  */
 static_always_inline u32 find_table(mmb_rule_t *rule) {
    mmb_main_t *mm = &mmb_main;
-   mmb_table_t *tables = mm->tables;
-   mmb_table_t *table;
-   u32 index;
-
-   vec_foreach_index(index, tables) {
-      table = &tables[index];
-      if (mask_equal(table->mask, rule->classify_mask) 
-            && table->skip == rule->classify_skip
-            && table->match == rule->classify_match)
-         return index;
-   }
+   u8 *key = table_hash_key(rule->classify_mask, rule->classify_skip,
+                            rule->classify_match);
+   uword *p = hash_get_mem(mm->table_by_mask, key);
+
+   vec_free(key);
+   if (p == 0)
+      return ~0;
+
+   return p[0];
+}
+
+/*
+ * return 1 if rule must be added or deleted through a rebuild of all 
+ * tables: its mask was unified into a table holding expanded keys. Other
+ * rules change in place, tables they add are unified by the next rebuild
+ */
+static_always_inline int rule_needs_rebuild(mmb_main_t *mm, 
+                                            mmb_rule_t *rule) {
+   u32 table_index;
 
-   return ~0;
+   if (!in_classifier(rule))
+      return 0;
+   table_index = find_table(rule);
+   return table_index != ~0 
+          && vec_len(mm->tables[table_index].merged_keys) != 0;
 }
 
 static_always_inline mmb_table_t *add_table(u32 index, u8* mask, u32 skip, 
@@ -1325,8 +1867,13 @@ static_always_inline mmb_table_t *add_table(u32 index, u8* mask, u32 skip,
   table.next_index = ~0;
   table.entry_count = entry_count;
   table.size = size;
+  table.hash_key = table_hash_key(mask, skip, match);
+  table.session_by_key = hash_create_vec(0, sizeof(u8), sizeof(uword));
 
   vec_add1(mm->tables, table);
+  hash_set_mem(mm->table_by_mask, table.hash_key, vec_len(mm->tables)-1);
+  if (index != ~0)
+    hash_set(mm->table_by_index, index, vec_len(mm->tables)-1);
   return &mm->tables[vec_len(mm->tables)-1];
 }
 
@@ -1372,16 +1919,61 @@ void rechain_table(mmb_table_t *table, int to_table) {
 }
 
 /**
- * realloc_table
+ * table_size_hint
+ *
+ * @return expected number of sessions for (mask, skip, match), 0 if none
+ */
+static_always_inline u32 table_size_hint(u8 *hash_key) {
+  mmb_main_t *mm = &mmb_main;
+  uword *p = hash_get_mem(mm->size_hints, hash_key);
+
+  return p ? p[0] : 0;
+}
+
+/**
+ * table_min_size
+ *
+ * @return capacity under which a table is never shrunk
+ */
+static_always_inline u32 table_min_size(u8 *hash_key) {
+  return clib_max(MMB_TABLE_SIZE_INIT, table_size_hint(hash_key));
+}
+
+/**
+ * table_grow_size
  *
- * Increase/decrease table size by a factor 
- * MMB_TABLE_SIZE_INC_RATIO/MMB_TABLE_SIZE_DEC_RATIO.
+ * @return capacity of a table grown to hold at least entry_count+1 sessions
+ */
+static_always_inline u32 table_grow_size(mmb_table_t *table) {
+  u32 size = clib_max(table->size, 1);
+
+  while (size <= table->entry_count)
+    size *= MMB_TABLE_SIZE_INC_RATIO;
+  return clib_max(size, table_min_size(table->hash_key));
+}
+
+/**
+ * rule_table_size
+ *
+ * @return capacity of a new table for rule
+ */
+static_always_inline u32 rule_table_size(mmb_rule_t *rule) {
+  u8 *hash_key = table_hash_key(rule->classify_mask, rule->classify_skip,
+                                rule->classify_match);
+  u32 size = table_min_size(hash_key);
+
+  vec_free(hash_key);
+  return size;
+}
+
+/**
+ * realloc_table
  *
- * @param deleted_index if != ~0, do not add rules[deleted_index] to table
+ * Replace table by a classifier table of given capacity.
  *
  * @note table index will change
  */
-static void realloc_table(mmb_table_t *table, u8 is_increase) {
+static void realloc_table(mmb_table_t *table, u32 size) {
 
   mmb_main_t *mm = &mmb_main;
   mmb_session_t *session;
@@ -1390,10 +1982,7 @@ static void realloc_table(mmb_table_t *table, u8 is_increase) {
 
   /* create resized table */
   table->index = ~0;
-  if (is_increase)
-    table->size *= MMB_TABLE_SIZE_INC_RATIO;
-  else 
-    table->size /= MMB_TABLE_SIZE_DEC_RATIO;
+  table->size = size;
   mmb_classify_add_table(table->mask, table->skip, table->match,
 			                &table->index, table->next_index, table->size);
   vl_print(mm->vlib_main, "new table of size %u created at index %u "
@@ -1401,12 +1990,16 @@ static void realloc_table(mmb_table_t *table, u8 is_increase) {
            old_index);
 
   /* add sessions to new table */
-  vec_foreach(session, table->sessions) {
+  pool_foreach(session, table->sessions, ({
      mmb_add_del_session(table->index, session->key, 
                          session->next, session->lookup_index, 1); 
      vl_print(mm->vlib_main, "added session to table %u", 
               table->index);  
-  }
+  }));
+
+  hash_unset(mm->table_by_index, old_index);
+  hash_set(mm->table_by_index, table->index, table - mm->tables);
+  mmb_runtime_move_table(old_index, table->index);
 
   rechain_table(table, 1);
 
@@ -1417,11 +2010,11 @@ static void realloc_table(mmb_table_t *table, u8 is_increase) {
   }
 
   /* delete old sessions and table */
-  vec_foreach(session, table->sessions) {
+  pool_foreach(session, table->sessions, ({
      vl_print(mm->vlib_main, "deleting session from table %u", 
                old_index);
      mmb_add_del_session(old_index, session->key, 0, 0, 0); 
-  }
+  }));
   
   mmb_classify_del_table(&old_index, 0);
 }
@@ -1430,6 +2023,7 @@ u32 mmb_lookup_pool_add(u32 rule_index, u32 lookup_index) {
 
    mmb_main_t *mm = &mmb_main;
    mmb_lookup_entry_t *lookup_entry;
+   u32 *rule_indexes;
 
    if (lookup_index == ~0) { /* new lookup element */
       pool_get(mm->lookup_pool, lookup_entry);
@@ -1440,8 +2034,12 @@ u32 mmb_lookup_pool_add(u32 rule_index, u32 lookup_index) {
                lookup_index, rule_index);
 
    } else {
+      /* published vectors are replaced, not modified */
       lookup_entry = pool_elt_at_index(mm->lookup_pool, lookup_index);
-      vec_add1(lookup_entry->rule_indexes, rule_index);
+      rule_indexes = vec_dup(lookup_entry->rule_indexes);
+      vec_add1(rule_indexes, rule_index);
+      mmb_runtime_retire_rule_indexes(lookup_entry->rule_indexes);
+      lookup_entry->rule_indexes = rule_indexes;
 
       vl_print(mm->vlib_main, "appended lookup_index:%u rule_index:%u \n", 
                lookup_index, rule_index);
@@ -1455,15 +2053,17 @@ int mmb_lookup_pool_del(u32 rule_index, u32 lookup_index) {
    mmb_main_t *mm = &mmb_main;
    mmb_lookup_entry_t *lookup_entry = 
       pool_elt_at_index(mm->lookup_pool, lookup_index);
+   u32 *rule_indexes = 0;
 
-   if (vec_len(lookup_entry->rule_indexes) == 1) {
-      vec_free(lookup_entry->rule_indexes);
-      pool_put(mm->lookup_pool, lookup_entry);
-   } else {
-      vec_delete(lookup_entry->rule_indexes, 1, rule_index);
+   /* published vectors are replaced, not modified */
+   if (vec_len(lookup_entry->rule_indexes) > 1) {
+      rule_indexes = vec_dup(lookup_entry->rule_indexes);
+      vec_delete(rule_indexes, 1, vec_search(rule_indexes, rule_index));
    }
-
-   update_lookup_pool(rule_index);
+   mmb_runtime_retire_rule_indexes(lookup_entry->rule_indexes);
+   lookup_entry->rule_indexes = rule_indexes;
+   if (rule_indexes == 0)
+      pool_put(mm->lookup_pool, lookup_entry);
 
    return pool_is_free_index(mm->lookup_pool, lookup_index);
 }
@@ -1475,17 +2075,26 @@ int add_to_classifier(mmb_rule_t *rule) {
   u32 rule_index = vec_len(mm->rules);
   u32 table_count = vec_len(mm->tables);
   int ret=0, next_node = next_if_match(rule);
+  u32 size;
   mmb_compute_mask(rule);
 
+  if (!in_classifier(rule)) {
+      /* prefix and bit vector rules are matched from the runtime snapshot */
+      rule->classify_table_index = ~0;
+      rule->lookup_index = ~0;
+      return 1;
+  }
+
   if (table_count == 0) {
       /* First rule, add table, session and chain table to if */
+      size = rule_table_size(rule);
 
       mmb_classify_add_table(rule->classify_mask, 
          rule->classify_skip, rule->classify_match,
-			&rule->classify_table_index, ~0, MMB_TABLE_SIZE_INIT);
+			&rule->classify_table_index, ~0, size);
       table = add_table(rule->classify_table_index, rule->classify_mask, 
                 rule->classify_skip, rule->classify_match, ~0,
-                1, MMB_TABLE_SIZE_INIT);
+                1, size);
 
       add_del_session(table, rule, NULL, rule_index, 1);
       ret = mmb_add_del_session(rule->classify_table_index, rule->classify_key, 
@@ -1500,10 +2109,11 @@ int add_to_classifier(mmb_rule_t *rule) {
 
   if (mmb_table == ~0) {
     /* Table does not exist, create it, add rule, and chain it to last table */
+    size = rule_table_size(rule);
 
     mmb_classify_add_table(rule->classify_mask, 
          rule->classify_skip, rule->classify_match,
-    		&rule->classify_table_index, ~0, MMB_TABLE_SIZE_INIT);
+    		&rule->classify_table_index, ~0, size);
 
     mmb_table_t *last_table = &mm->tables[table_count-1];
     u32 last_table_index = last_table->index;	
@@ -1512,7 +2122,7 @@ int add_to_classifier(mmb_rule_t *rule) {
 
     table = add_table(rule->classify_table_index, rule->classify_mask, 
                       rule->classify_skip, rule->classify_match, last_table_index,
-                      1, MMB_TABLE_SIZE_INIT);
+                      1, size);
 
     add_del_session(table, rule, NULL, rule_index, 1);
     ret = mmb_add_del_session(rule->classify_table_index, rule->classify_key, 
@@ -1525,8 +2135,8 @@ int add_to_classifier(mmb_rule_t *rule) {
 
    /* Found table */
    table = &mm->tables[mmb_table];
-   if (table->entry_count == table->size)
-       realloc_table(table, 1);   
+   if (table->entry_count >= table->size)
+       realloc_table(table, table_grow_size(table));
    rule->classify_table_index = table->index;
 
    /* check if no existing rule makes new rule invalid */ 
@@ -1600,10 +2210,43 @@ clib_error_t * mmb_add_rule_command(vlib_main_t *vm, unformat_input_t *input,
 
   if ( (error = parse_rule(input, &rule)) )
     return error;
+
+  if (mm->in_batch) {
+    mmb_batch_op_t *op;
+
+    mmb_compute_mask(&rule);
+    vec_add2(mm->batch_ops, op, 1);
+    op->is_add = 1;
+    op->rule_index = ~0;
+    op->rule = rule;
+    vlib_cli_output(vm, "Queued rule: %U", mmb_format_rule, &rule);
+    return 0;
+  }
+
+  mmb_compute_mask(&rule);
+  if (rule_needs_rebuild(mm, &rule)) {
+    mmb_batch_op_t *ops = 0, *op;
+
+    vec_add2(ops, op, 1);
+    op->is_add = 1;
+    op->rule_index = ~0;
+    op->rule = rule;
+    if (apply_ops(ops))
+      return clib_error_return(0, "Invalid rule: Could not add to classifier");
+
+    vlib_cli_output(vm, "Added rule: %U", mmb_format_rule, &rule);
+    return 0;
+  }
+
+  mmb_runtime_sync_counters(mm);
   if ( (error = mmb_add_rule(&rule)) )
     return error;
 
   vec_add1(mm->rules, rule);
+  mmb_runtime_mark_append(MMB_RUNTIME_RULES | rule_runtime_parts(&rule)
+                          | (in_classifier(&rule) 
+                             ? MMB_RUNTIME_BLOOM | MMB_RUNTIME_L4 : 0));
+  mmb_runtime_publish_later(mm);
 
   /* flags */
   if (rule_has_tcp_options(&rule))
@@ -1634,17 +2277,67 @@ add_stateful_rule_command_fn(vlib_main_t *vm, unformat_input_t *input,
   return mmb_add_rule_command(vm, input, 1);
 }
 
+static clib_error_t *
+table_hint_command_fn(vlib_main_t *vm, unformat_input_t *input, 
+                      vlib_cli_command_t *cmd) {
+  mmb_main_t *mm = &mmb_main;
+  mmb_rule_t rule;
+  clib_error_t *error;
+  u32 entries, table_index;
+  u8 *hash_key;
+  uword *p;
+
+  unformat_input_tolower(input);
+  if (!unformat(input, "%u", &entries) || entries == 0)
+    return clib_error_return(0, "Invalid number of entries");
+
+  init_rule(&rule);
+  if ( (error = parse_rule(input, &rule)) ) {
+    mmb_free_rule(&rule);
+    return error;
+  }
+  mmb_compute_mask(&rule);
+
+  hash_key = table_hash_key(rule.classify_mask, rule.classify_skip,
+                            rule.classify_match);
+  p = hash_get_mem(mm->size_hints, hash_key);
+  hash_set_mem(mm->size_hints, hash_key, entries);
+  if (p) /* hash keeps the key of the existing pair */
+    vec_free(hash_key);
+
+  /* grow existing table now instead of on the next insertions */
+  table_index = find_table(&rule);
+  if (table_index != ~0 && mm->tables[table_index].size < entries) {
+    realloc_table(&mm->tables[table_index], entries);
+    mmb_runtime_publish_later(mm);
+  }
+
+  vlib_cli_output(vm, "Table hint: %u entries for mask %U", entries,
+                  mmb_format_key, rule.classify_mask);
+  mmb_free_rule(&rule);
+  return 0;
+}
+
 void update_lookup_pool(u32 rule_index) {
    /** update pool when rule_index is deleted **/
    mmb_main_t *mm = &mmb_main;
-   u32 *current_rule_index;   
+   u32 *current_rule_index, *rule_indexes;   
    mmb_lookup_entry_t *lookup_entry;
 
    pool_foreach(lookup_entry, mm->lookup_pool, ({
+      /* published vectors are replaced, not modified */
+      rule_indexes = 0;
       vec_foreach(current_rule_index, lookup_entry->rule_indexes) {
 
-         if (*current_rule_index > rule_index) 
-            (*current_rule_index)--;
+         if (*current_rule_index > rule_index) {
+            if (rule_indexes == 0)
+               rule_indexes = vec_dup(lookup_entry->rule_indexes);
+            rule_indexes[current_rule_index - lookup_entry->rule_indexes]--;
+         }
+      }
+      if (rule_indexes) {
+         mmb_runtime_retire_rule_indexes(lookup_entry->rule_indexes);
+         lookup_entry->rule_indexes = rule_indexes;
       }
    }));
 }
@@ -1653,65 +2346,1394 @@ static int remove_rule(u32 rule_index) {
 
   mmb_main_t *mm = &mmb_main;
   mmb_conn_table_t *mct = mm->mmb_conn_table;
-  mmb_rule_t *rule, *rules = mm->rules;
+  mmb_rule_t *rule, *rules = mm->rules, *next_rule;
   mmb_table_t *table, *tables = mm->tables;
-  u32 table_index;
+  u32 table_index, parts;
 
   if (rule_index <= 0 || rule_index > vec_len(rules)) 
     return -1;
 
-  /* single rule, flush */
-  if (vec_len(rules) == 1) {
+  if (mm->in_batch)
+    return batch_del_rule(rule_index);
+
+  if (rule_needs_rebuild(mm, &rules[rule_index-1])) {
+    mmb_batch_op_t *ops = 0, *op;
+
+    vec_add2(ops, op, 1);
+    memset(op, 0, sizeof(mmb_batch_op_t));
+    op->rule_index = rule_index-1;
+    return apply_ops(ops) ? -1 : 0;
+  }
+
+  mmb_runtime_sync_counters(mm);
+
+  /* single rule, flush */
+  if (vec_len(rules) == 1) {
     flush();
     return 0;
   }
 
-  rule = &rules[--rule_index];
-  table_index = find_table_internal_index(rule->classify_table_index);
-  table = &tables[table_index];
+  rule = &rules[--rule_index];
+  if (!in_classifier(rule))
+    goto remove;
+
+  table_index = find_table_internal_index(rule->classify_table_index);
+  table = &tables[table_index];
+
+  vl_print(mm->vlib_main, "rule at index:%u table internal index:%u classify_index:%u "
+                           "lookup_index:%u",
+           rule_index,table_index, rule->classify_table_index, rule->lookup_index);
+
+  mmb_session_t *session = find_session(table, rule);
+  if (add_del_session(table, rule, session, rule_index, 0)) { 
+     /* last rule of session, delete session */
+
+     vl_print(mm->vlib_main, "deleting session from table %u", rule->classify_table_index);
+     mmb_add_del_session(rule->classify_table_index, rule->classify_key, 0, 0, 0);
+     table->entry_count--;
+
+     if (table->entry_count == 0) { /* Empty table, delete it */
+
+       vl_print(mm->vlib_main, "table:%u is empty, deleting", rule->classify_table_index);
+       rechain_table(table, 0);
+       mmb_classify_del_table(&rule->classify_table_index, 0);
+       hash_unset_mem(mm->table_by_mask, table->hash_key);
+       hash_unset(mm->table_by_index, table->index);
+       free_table(table);
+       vec_delete(mm->tables, 1, table_index);
+
+       /* shift internal indexes of following tables */
+       for (; table_index < vec_len(mm->tables); table_index++) {
+         table = &mm->tables[table_index];
+         hash_set_mem(mm->table_by_mask, table->hash_key, table_index);
+         hash_set(mm->table_by_index, table->index, table_index);
+       }
+     } else if (table->entry_count <= table->size / MMB_TABLE_SIZE_DEC_THRESHOLD
+                && table->size / MMB_TABLE_SIZE_DEC_RATIO 
+                   >= table_min_size(table->hash_key)) {
+
+       vl_print(mm->vlib_main, "table:%u is too large, shrinking", 
+                rule->classify_table_index);
+       realloc_table(table, table->size / MMB_TABLE_SIZE_DEC_RATIO); 
+       rule->classify_table_index = table->index;
+     }
+  }
+
+remove:
+  /* following rules move down, parts holding their indexes are rebuilt */
+  parts = MMB_RUNTIME_RULES | rule_runtime_parts(rule)
+          | (in_classifier(rule) ? MMB_RUNTIME_BLOOM | MMB_RUNTIME_L4 : 0);
+  for (next_rule = rule + 1; next_rule < vec_end(rules); next_rule++)
+    parts |= rule_runtime_parts(next_rule);
+
+  if (rule->stateful) {
+    purge_conn_index(mct, rule_index);
+  } else {
+    update_conn_pool(mct, rule_index);
+  }
+
+  /* sessions of following rules, whatever engine matched this one */
+  update_lookup_pool(rule_index);
+  mmb_runtime_retire_rule(rule);
+  vec_delete(rules, 1, rule_index);
+  update_flags(mm, rules);
+  /* connections hold rule indexes too, deletions are published at once */
+  mmb_runtime_mark(parts);
+  mmb_runtime_publish(mm);
+
+  if (mm->enabled && vec_len(rules) == 0) 
+    mmb_enable_disable_all(0);
+
+  return 0;
+}
+
+int batch_del_rule(u32 rule_index) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_batch_op_t *op;
+
+  vec_foreach(op, mm->batch_ops) {
+    if (!op->is_add && op->rule_index == rule_index-1)
+      return 0;
+  }
+
+  vec_add2(mm->batch_ops, op, 1);
+  memset(op, 0, sizeof(mmb_batch_op_t));
+  op->rule_index = rule_index-1;
+  return 0;
+}
+
+void batch_free() {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_batch_op_t *op;
+
+  vec_foreach(op, mm->batch_ops) {
+    if (op->is_add)
+      mmb_free_rule(&op->rule);
+  }
+  vec_free(mm->batch_ops);
+  mm->in_batch = 0;
+}
+
+/**
+ * batch_build_tables
+ *
+ * Build tables, sessions and lookup pool of rules in mmb_main without 
+ * creating classifier tables.
+ *
+ * @return 0 on success, -1 if a rule conflicts with a previous one
+ */
+static int batch_build_tables(mmb_rule_t *rules,
+                              mmb_lookup_entry_t **lookup_pool) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_table_t *table;
+  mmb_session_t *session;
+  mmb_lookup_entry_t *lookup_entry;
+  mmb_rule_t *rule;
+  u32 rule_index, table_index;
+
+  vec_foreach_index(rule_index, rules) {
+    rule = &rules[rule_index];
+    if (!in_classifier(rule)) {
+      rule->lookup_index = ~0;
+      continue;
+    }
+
+    table_index = find_table(rule);
+    if (table_index == ~0)
+      table = add_table(~0, rule->classify_mask, rule->classify_skip, 
+                        rule->classify_match, ~0, 0, rule_table_size(rule));
+    else
+      table = &mm->tables[table_index];
+
+    session = find_session(table, rule);
+    if (session == NULL) {
+
+      pool_get(*lookup_pool, lookup_entry);
+      memset(lookup_entry, 0, sizeof(mmb_lookup_entry_t));
+
+      pool_get(table->sessions, session);
+      session->lookup_index = lookup_entry - *lookup_pool;
+      session->key = vec_dup(rule->classify_key);
+      session->next = next_if_match(rule);
+      hash_set_mem(table->session_by_key, session->key, 
+                   session - table->sessions);
+      table->entry_count++;
+    } else {
+
+      lookup_entry = pool_elt_at_index(*lookup_pool, session->lookup_index);
+      /* checking one is enough */
+      if (next_if_match(&rules[lookup_entry->rule_indexes[0]]) 
+            != next_if_match(rule))
+        return -1;
+    }
+
+    vec_add1(lookup_entry->rule_indexes, rule_index);
+    rule->lookup_index = session->lookup_index;
+  }
+
+  return 0;
+}
+
+/**
+ * batch_create_tables
+ *
+ * Create the classifier tables of mmb_main at their final size, from last 
+ * to first so that each table is chained to its successor when created.
+ *
+ * @return classify index of the first table, ~0 on failure
+ */
+static u32 batch_create_tables() {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_table_t *table;
+  mmb_session_t *session;
+  u32 next_index = ~0;
+  int i, ret;
+
+  for (i = vec_len(mm->tables)-1; i >= 0; i--) {
+    table = &mm->tables[i];
+    table->index = ~0;
+    table->size = table_grow_size(table);
+
+    if (mmb_classify_add_table(table->mask, table->skip, table->match,
+                               &table->index, next_index, table->size))
+      goto error;
+
+    ret = 0;
+    pool_foreach(session, table->sessions, ({
+      ret |= mmb_add_del_session(table->index, session->key, session->next,
+                                 session->lookup_index, 1);
+    }));
+    if (ret) {
+      next_index = table->index;
+      goto error;
+    }
+
+    table->previous_index = ~0;
+    table->next_index = next_index;
+    if (next_index != ~0)
+      mm->tables[i+1].previous_index = table->index;
+    hash_set(mm->table_by_index, table->index, i);
+    next_index = table->index;
+  }
+
+  return next_index;
+
+error:
+  if (next_index != ~0)
+    mmb_classify_del_table(&next_index, 1);
+  return ~0;
+}
+
+static_always_inline void free_tables(mmb_table_t *tables, 
+                                      mmb_lookup_entry_t *lookup_pool) {
+  mmb_table_t *table;
+  mmb_lookup_entry_t *lookup_entry;
+
+  vec_foreach(table, tables) {
+    free_table(table);
+  }
+  vec_free(tables);
+  pool_foreach(lookup_entry, lookup_pool, ({
+    vec_free(lookup_entry->rule_indexes);
+  }));
+  pool_free(lookup_pool);
+}
+
+/**
+ * unify_extra_bits
+ *
+ * @return number of bits set in wider but not in mask
+ */
+static_always_inline u32 unify_extra_bits(u8 *mask, u8 *wider) {
+  u32 index, count = 0;
+
+  vec_foreach_index(index, mask) {
+    count += count_set_bits(wider[index] & ~mask[index]);
+  }
+  return count;
+}
+
+/**
+ * unify_mask
+ *
+ * Widen the mask of group to cover table at table_index.
+ *
+ * @return unified mask, NULL if the table cannot join the group
+ */
+static u8 *unify_mask(mmb_table_t *tables, mmb_unify_group_t *groups,
+                      mmb_unify_group_t *group, u32 table_index) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_table_t *first = &tables[group->first], *table = &tables[table_index];
+  mmb_unify_group_t *other;
+  u8 *mask, *hash_key;
+  u32 index;
+  uword *p;
+
+  if (table->skip != first->skip || table->match != first->match
+      || vec_len(table->mask) != vec_len(group->mask))
+    return 0;
+
+  mask = vec_dup(group->mask);
+  vec_foreach_index(index, mask) {
+    mask[index] |= table->mask[index];
+  }
+
+  for (index = group->first; index <= table_index; index++) {
+    if (unify_extra_bits(tables[index].mask, mask) > MMB_UNIFY_MAX_BITS)
+      goto conflict;
+  }
+
+  /* unified table must have its own key in table_by_mask */
+  hash_key = table_hash_key(mask, first->skip, first->match);
+  p = hash_get_mem(mm->table_by_mask, hash_key);
+  vec_free(hash_key);
+  if (p && (p[0] < group->first || p[0] > table_index))
+    goto conflict;
+
+  vec_foreach(other, groups) {
+    if (other != group && tables[other->first].skip == first->skip
+        && tables[other->first].match == first->match
+        && mask_equal(other->mask, mask))
+      goto conflict;
+  }
+
+  return mask;
+
+conflict:
+  vec_free(mask);
+  return 0;
+}
+
+/**
+ * unify_plan
+ *
+ * Group consecutive tables of the chain whose masks can be unified. A table
+ * joins the group of its predecessor if the sessions added by expanding
+ * keys to the unified mask cost less than a chained table.
+ *
+ * @return groups in chain order, covering all tables
+ */
+static mmb_unify_group_t *unify_plan(mmb_table_t *tables, u32 table_cost) {
+
+  mmb_unify_group_t *groups = 0, *group = 0;
+  u64 entry_count;
+  u32 table_index, index;
+  u8 *mask;
+
+  vec_foreach_index(table_index, tables) {
+    if (group && (mask = unify_mask(tables, groups, group, table_index))) {
+
+      entry_count = 0;
+      for (index = group->first; index <= table_index; index++)
+        entry_count += (u64) tables[index].entry_count 
+                       << unify_extra_bits(tables[index].mask, mask);
+
+      if (entry_count < group->entry_count + tables[table_index].entry_count
+                        + table_cost) {
+        vec_free(group->mask);
+        group->mask = mask;
+        group->last = table_index;
+        group->entry_count = entry_count;
+        continue;
+      }
+      vec_free(mask);
+    }
+
+    vec_add2(groups, group, 1);
+    group->first = group->last = table_index;
+    group->mask = vec_dup(tables[table_index].mask);
+    group->entry_count = tables[table_index].entry_count;
+  }
+
+  return groups;
+}
+
+static_always_inline void unify_free_plan(mmb_unify_group_t *groups) {
+  mmb_unify_group_t *group;
+
+  vec_foreach(group, groups) {
+    vec_free(group->mask);
+  }
+  vec_free(groups);
+}
+
+/**
+ * unify_add_sessions
+ *
+ * Add the sessions of table to the unified table, each key being expanded 
+ * to every value of the bits the unified mask adds. The classify node 
+ * collects the rules of every table of the chain, so an expanded key that
+ * already exists gets a new lookup entry with the rules of both sessions, 
+ * those of the earlier table first.
+ *
+ * @return 0 on success, -1 if colliding sessions have different next nodes
+ */
+static int unify_add_sessions(mmb_table_t *unified, mmb_table_t *table,
+                              mmb_lookup_entry_t **lookup_pool,
+                              u32 **new_lookup_indexes) {
+
+  mmb_session_t *session, *new_session;
+  mmb_lookup_entry_t *lookup_entry, *other_entry;
+  u32 *bits = 0, index, bit, value, *rule_index;
+  u8 *key;
+  uword *p;
+  int ret = 0;
+
+  vec_foreach_index(index, table->mask) {
+    for (bit = 0; bit < 8; bit++)
+      if ((unified->mask[index] & ~table->mask[index]) & (1 << bit))
+        vec_add1(bits, index * 8 + bit);
+  }
+
+  pool_foreach(session, table->sessions, ({
+    for (value = 0; ret == 0 && value < (1 << vec_len(bits)); value++) {
+
+      key = vec_dup(session->key);
+      vec_foreach_index(index, key) {
+        key[index] &= table->mask[index];
+      }
+      vec_foreach_index(index, bits) {
+        if (value & (1 << index))
+          key[bits[index] / 8] |= 1 << (bits[index] % 8);
+      }
+
+      p = hash_get_mem(unified->session_by_key, key);
+      if (p == 0) {
+        pool_get(unified->sessions, new_session);
+        new_session->key = key;
+        new_session->lookup_index = session->lookup_index;
+        new_session->next = session->next;
+        hash_set_mem(unified->session_by_key, key, 
+                     new_session - unified->sessions);
+        unified->entry_count++;
+        continue;
+      }
+      vec_free(key);
+
+      new_session = pool_elt_at_index(unified->sessions, p[0]);
+      if (new_session->next != session->next) {
+        ret = -1;
+        break;
+      }
+
+      /* rules of both sessions */
+      pool_get(*lookup_pool, lookup_entry);
+      memset(lookup_entry, 0, sizeof(mmb_lookup_entry_t));
+      vec_add1(*new_lookup_indexes, lookup_entry - *lookup_pool);
+      other_entry = pool_elt_at_index(*lookup_pool, new_session->lookup_index);
+      lookup_entry->rule_indexes = vec_dup(other_entry->rule_indexes);
+      other_entry = pool_elt_at_index(*lookup_pool, session->lookup_index);
+      vec_foreach(rule_index, other_entry->rule_indexes) {
+        if (vec_search(lookup_entry->rule_indexes, *rule_index) == ~0)
+          vec_add1(lookup_entry->rule_indexes, *rule_index);
+      }
+      new_session->lookup_index = lookup_entry - *lookup_pool;
+    }
+  }));
+
+  vec_free(bits);
+  return ret;
+}
+
+/**
+ * unify_group
+ *
+ * Build the unified table of a group.
+ *
+ * @return 0 on success, -1 if the tables of the group cannot be unified
+ */
+static int unify_group(mmb_table_t *unified, mmb_table_t *tables,
+                       mmb_unify_group_t *group,
+                       mmb_lookup_entry_t **lookup_pool) {
+
+  mmb_table_t *first = &tables[group->first];
+  mmb_lookup_entry_t *lookup_entry;
+  u32 table_index, *new_lookup_indexes = 0, *lookup_index;
+  int ret = 0;
+
+  memset(unified, 0, sizeof(mmb_table_t));
+  unified->index = ~0;
+  unified->next_index = ~0;
+  unified->previous_index = ~0;
+  unified->mask = vec_dup(group->mask);
+  unified->skip = first->skip;
+  unified->match = first->match;
+  unified->hash_key = table_hash_key(group->mask, first->skip, first->match);
+  unified->session_by_key = hash_create_vec(0, sizeof(u8), sizeof(uword));
+
+  for (table_index = group->first; ret == 0 && table_index <= group->last;
+       table_index++)
+    ret = unify_add_sessions(unified, &tables[table_index], lookup_pool,
+                             &new_lookup_indexes);
+
+  if (ret) {
+    vec_foreach(lookup_index, new_lookup_indexes) {
+      lookup_entry = pool_elt_at_index(*lookup_pool, *lookup_index);
+      vec_free(lookup_entry->rule_indexes);
+      pool_put(*lookup_pool, lookup_entry);
+    }
+    free_table(unified);
+  }
+
+  vec_free(new_lookup_indexes);
+  return ret;
+}
+
+/**
+ * unify_tables
+ *
+ * Replace the tables of mmb_main, not created in the classifier yet, by 
+ * their unified groups. Tables of a group keep their hash key in 
+ * table_by_mask, pointing to the unified table.
+ */
+static void unify_tables(mmb_lookup_entry_t **lookup_pool, u32 table_cost) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_unify_group_t *groups = unify_plan(mm->tables, table_cost), *group;
+  mmb_table_t *old_tables = mm->tables, *table, unified;
+  u32 table_index, unified_index;
+
+  if (vec_len(groups) == vec_len(old_tables)) {
+    unify_free_plan(groups);
+    return;
+  }
+
+  mm->tables = 0;
+  hash_free(mm->table_by_mask);
+  mm->table_by_mask = hash_create_vec(0, sizeof(u8), sizeof(uword));
+
+  vec_foreach(group, groups) {
+    if (group->first != group->last
+        && unify_group(&unified, old_tables, group, lookup_pool) == 0) {
+
+      vec_add1(mm->tables, unified);
+      unified_index = vec_len(mm->tables)-1;
+      table = &mm->tables[unified_index];
+      hash_set_mem(mm->table_by_mask, table->hash_key, unified_index);
+
+      for (table_index = group->first; table_index <= group->last; 
+           table_index++) {
+        table = &old_tables[table_index];
+        vec_add1(mm->tables[unified_index].merged_keys, table->hash_key);
+        hash_set_mem(mm->table_by_mask, table->hash_key, unified_index);
+        table->hash_key = 0;
+        free_table(table);
+      }
+      continue;
+    }
+
+    /* single table, or sessions of the group conflict: keep tables */
+    for (table_index = group->first; table_index <= group->last; 
+         table_index++) {
+      vec_add1(mm->tables, old_tables[table_index]);
+      hash_set_mem(mm->table_by_mask, old_tables[table_index].hash_key,
+                   vec_len(mm->tables)-1);
+    }
+  }
+
+  vec_free(old_tables);
+  unify_free_plan(groups);
+}
+
+/**
+ * restore_tables
+ *
+ * Restore tables, sessions and lookup pool of compiled rules in mmb_main
+ * without creating classifier tables.
+ *
+ * @return 0 on success, -1 if compiled tables are inconsistent
+ */
+static int restore_tables(mmb_compiled_t *compiled, 
+                          mmb_lookup_entry_t **lookup_pool) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_compiled_table_t *compiled_table;
+  mmb_table_t *table;
+  mmb_session_t *session;
+  mmb_lookup_entry_t *lookup_entry;
+  u32 lookup_index, *rule_index, session_index;
+  u32 *free_indexes = 0;
+  u8 *hash_key, **merged_key;
+  uword *p;
+
+  vec_foreach_index(lookup_index, compiled->lookup) {
+    pool_get(*lookup_pool, lookup_entry);
+    memset(lookup_entry, 0, sizeof(mmb_lookup_entry_t));
+    lookup_entry->rule_indexes = vec_dup(compiled->lookup[lookup_index]);
+    if (vec_len(lookup_entry->rule_indexes) == 0)
+      vec_add1(free_indexes, lookup_index);
+  }
+  vec_foreach(rule_index, free_indexes) {
+    pool_put_index(*lookup_pool, *rule_index);
+  }
+  vec_free(free_indexes);
+
+  vec_foreach(compiled_table, compiled->tables) {
+    hash_key = table_hash_key(compiled_table->mask, compiled_table->skip,
+                              compiled_table->match);
+    p = hash_get_mem(mm->table_by_mask, hash_key);
+    vec_free(hash_key);
+    if (p) /* duplicate table */
+      return -1;
+    table = add_table(~0, compiled_table->mask, compiled_table->skip,
+                      compiled_table->match, ~0, 
+                      vec_len(compiled_table->keys), compiled_table->size);
+
+    vec_foreach(merged_key, compiled_table->merged_keys) {
+      p = hash_get_mem(mm->table_by_mask, *merged_key);
+      if (p && !mask_equal(*merged_key, table->hash_key))
+        return -1;
+      hash_key = vec_dup(*merged_key);
+      vec_add1(table->merged_keys, hash_key);
+      hash_set_mem(mm->table_by_mask, hash_key, table - mm->tables);
+    }
+
+    vec_foreach_index(session_index, compiled_table->keys) {
+      lookup_index = compiled_table->lookup_indexes[session_index];
+      if (pool_is_free_index(*lookup_pool, lookup_index))
+        return -1;
+
+      pool_get(table->sessions, session);
+      session->key = vec_dup(compiled_table->keys[session_index]);
+      session->lookup_index = lookup_index;
+      session->next = compiled_table->nexts[session_index];
+      hash_set_mem(table->session_by_key, session->key,
+                   session - table->sessions);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * install_rules
+ *
+ * Compile rules into a new chain of classifier tables, swap it in on every
+ * interface and delete the old chain once workers are past the swap.
+ *
+ * @param rules new rules vector, becomes mmb_main.rules on success
+ * @param deleted indexes of current rules that are not in rules, freed
+ * @param compiled if not NULL, tables and lookup pool of rules
+ * @return 0 on success, -2 if rules could not be compiled 
+ *         (live rules are unchanged)
+ */
+static int install_rules(mmb_rule_t *rules, u32 *deleted,
+                         mmb_compiled_t *compiled) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_conn_table_t *mct = mm->mmb_conn_table;
+  mmb_rule_t *old_rules = mm->rules, *rule;
+  mmb_lookup_entry_t *lookup_pool = 0, *old_lookup_pool = mm->lookup_pool;
+  mmb_lookup_entry_t *lookup_entry;
+  mmb_table_t *old_tables = mm->tables;
+  uword *old_table_by_mask = mm->table_by_mask;
+  uword *old_table_by_index = mm->table_by_index;
+  u32 rule_index, old_head, new_head = ~0;
+  int i, ret;
+
+  /* compile new generation off to the side */
+  mm->tables = 0;
+  mm->table_by_mask = hash_create_vec(0, sizeof(u8), sizeof(uword));
+  mm->table_by_index = hash_create(0, sizeof(uword));
+
+  if (compiled)
+    ret = restore_tables(compiled, &lookup_pool);
+  else
+    ret = batch_build_tables(rules, &lookup_pool);
+  if (ret == 0 && compiled == 0 && mm->unify_masks)
+    unify_tables(&lookup_pool, mm->unify_table_cost);
+
+  if (ret || (vec_len(mm->tables) && (new_head = batch_create_tables()) == ~0)) {
+
+    free_tables(mm->tables, lookup_pool);
+    hash_free(mm->table_by_mask);
+    hash_free(mm->table_by_index);
+    mm->tables = old_tables;
+    mm->table_by_mask = old_table_by_mask;
+    mm->table_by_index = old_table_by_index;
+
+    vec_free(deleted);
+    return -2;
+  }
+
+  vec_foreach(rule, rules) {
+    rule->classify_table_index = !in_classifier(rule)
+                                 ? ~0 : mm->tables[find_table(rule)].index;
+    if (rule->stateful && !mct->conn_hash_is_initialized)
+      mmb_conn_hash_init();
+  }
+
+  /* swap generations while workers are parked */
+  old_head = vec_len(old_tables) ? old_tables[0].index : ~0;
+  vlib_worker_thread_barrier_sync(mm->vlib_main);
+
+  if (new_head != ~0)
+    attach_table_if(new_head, 1);
+  else if (old_head != ~0)
+    attach_table_if(old_head, 0);
+  mm->rules = rules;
+  mm->lookup_pool = lookup_pool;
+
+  /* connections of deleted rules, highest index first */
+  for (i = vec_len(deleted)-1; i >= 0; i--) {
+    rule_index = deleted[i];
+    if (old_rules[rule_index].stateful)
+      purge_conn_index(mct, rule_index);
+    else
+      update_conn_pool(mct, rule_index);
+    mmb_runtime_retire_rule(&old_rules[rule_index]);
+  }
+  pool_foreach(lookup_entry, old_lookup_pool, ({
+    mmb_runtime_retire_rule_indexes(lookup_entry->rule_indexes);
+    lookup_entry->rule_indexes = 0;
+  }));
+  update_flags(mm, rules);
+  mmb_runtime_mark(MMB_RUNTIME_ALL);
+  mmb_runtime_publish(mm);
+
+  vlib_worker_thread_barrier_release(mm->vlib_main);
+
+  /* free old generation */
+  if (old_head != ~0)
+    mmb_classify_del_table(&old_head, 1);
+  free_tables(old_tables, old_lookup_pool);
+  hash_free(old_table_by_mask);
+  hash_free(old_table_by_index);
+
+  vec_free(old_rules);
+  vec_free(deleted);
+
+  if (!mm->enabled && vec_len(rules))
+    mmb_enable_disable_all(1);
+  else if (mm->enabled && vec_len(rules) == 0)
+    mmb_enable_disable_all(0);
+
+  return 0;
+}
+
+/**
+ * apply_ops
+ *
+ * Install the rules resulting from changes ops. Added rules belong to 
+ * mm->rules on success and are freed otherwise, ops is freed.
+ *
+ * @return 0 on success, 
+ *         -2 if the rules could not be compiled (live rules are unchanged)
+ */
+static int apply_ops(mmb_batch_op_t *ops) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_batch_op_t *op;
+  mmb_rule_t *rules = 0, *old_rules = mm->rules;
+  u32 *deleted = 0, rule_index;
+  u8 *is_deleted = 0;
+
+  mmb_runtime_sync_counters(mm);
+
+  /* remaining rules in order, followed by added rules */
+  vec_validate(is_deleted, vec_len(old_rules));
+  vec_foreach(op, ops) {
+    if (!op->is_add)
+      is_deleted[op->rule_index] = 1;
+  }
+  vec_foreach_index(rule_index, old_rules) {
+    if (is_deleted[rule_index])
+      vec_add1(deleted, rule_index);
+    else
+      vec_add1(rules, old_rules[rule_index]);
+  }
+  vec_foreach(op, ops) {
+    if (op->is_add)
+      vec_add1(rules, op->rule);
+  }
+  vec_free(is_deleted);
+
+  if (install_rules(rules, deleted, 0)) {
+    vec_free(rules);
+    vec_foreach(op, ops) {
+      if (op->is_add)
+        mmb_free_rule(&op->rule);
+    }
+    vec_free(ops);
+    return -2;
+  }
+
+  /* added rules now belong to mm->rules */
+  vec_free(ops);
+  return 0;
+}
+
+/**
+ * batch_commit
+ *
+ * Install the rules resulting from queued changes and close the batch.
+ *
+ * @return 0 on success, -1 if no batch is open,
+ *         -2 if the batch could not be compiled (live rules are unchanged)
+ */
+static int batch_commit() {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_batch_op_t *ops = mm->batch_ops;
+
+  if (!mm->in_batch)
+    return -1;
+
+  mm->batch_ops = 0;
+  mm->in_batch = 0;
+  return apply_ops(ops);
+}
+
+static int batch_begin() {
+  mmb_main_t *mm = &mmb_main;
+
+  if (mm->in_batch)
+    return -1;
+
+  mm->in_batch = 1;
+  return 0;
+}
+
+static int batch_abort() {
+  mmb_main_t *mm = &mmb_main;
+
+  if (!mm->in_batch)
+    return -1;
+
+  batch_free();
+  return 0;
+}
+
+static clib_error_t*
+begin_command_fn(vlib_main_t * vm,
+                 unformat_input_t * input,
+                 vlib_cli_command_t * cmd) {
+  if (batch_begin())
+    return clib_error_return(0, "A batch is already open");
+  return 0;
+}
+
+static clib_error_t*
+commit_command_fn(vlib_main_t * vm,
+                  unformat_input_t * input,
+                  vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  u32 op_count = vec_len(mm->batch_ops);
+
+  switch (batch_commit()) {
+    case -1:
+      return clib_error_return(0, "No open batch");
+    case -2:
+      return clib_error_return(0, "Invalid batch: could not add to "
+                                  "classifier, batch discarded");
+    default:
+      break;
+  }
+
+  vlib_cli_output(vm, "Committed %u changes, %u rules", op_count,
+                  vec_len(mm->rules));
+  return 0;
+}
+
+static clib_error_t*
+abort_command_fn(vlib_main_t * vm,
+                 unformat_input_t * input,
+                 vlib_cli_command_t * cmd) {
+  if (batch_abort())
+    return clib_error_return(0, "No open batch");
+  return 0;
+}
+
+/**
+ * load_rules
+ *
+ * Parse and validate every rule of a file, then add them in one batch.
+ * Lines end with '\n' or "\r\n".
+ * Empty lines and lines starting with '#' are ignored, a rule may be 
+ * preceded by an add keyword (add, add-stateless, add-stateful).
+ * If a batch is open, rules are queued in it.
+ *
+ * @return NULL on success, error of the first invalid line otherwise
+ */
+static clib_error_t *load_rules(char *filename, u32 *rule_count) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_rule_t *rules = 0, *rule;
+  mmb_batch_op_t *ops = 0, *op;
+  unformat_input_t line_input;
+  clib_error_t *error;
+  u8 *contents = 0, in_batch = mm->in_batch;
+  u32 line_number = 0, start, end, len;
+  int stateful;
+
+  if ( (error = unix_file_contents(filename, &contents)) )
+    return error;
+
+  for (start = 0; start < vec_len(contents); start = end + 1) {
+    line_number++;
+    for (end = start; end < vec_len(contents) && contents[end] != '\n'; end++)
+      ;
+
+    unformat_init_string(&line_input, (char *) contents + start, end - start);
+    unformat_input_tolower(&line_input);
+    if (unformat_check_input(&line_input) == UNFORMAT_END_OF_INPUT
+        || unformat(&line_input, "#")) {
+      unformat_free(&line_input);
+      continue;
+    }
+
+    stateful = 0;
+    unformat(&line_input, "mmb");
+    if (unformat(&line_input, "add-stateful"))
+      stateful = 1;
+    else if (unformat(&line_input, "add-stateless"))
+      ;
+    else
+      unformat(&line_input, "add");
+
+    vec_add2(rules, rule, 1);
+    init_rule(rule);
+    rule->stateful = stateful;
+
+    if ( (error = parse_rule(&line_input, rule)) ) {
+      clib_error_t *line_error = clib_error_return(0, "%s line %u: %v",
+                                   filename, line_number, error->what);
+      clib_error_free(error);
+      error = line_error;
+    } else if (!unformat_is_eof(&line_input)) {
+      error = clib_error_return(0, "%s line %u: unexpected '%U'",
+                                filename, line_number, 
+                                format_unformat_error, &line_input);
+    }
+    unformat_free(&line_input);
+    if (error)
+      goto done;
+
+    mmb_compute_mask(rule);
+  }
+
+  /* queue all rules and compile them at once */
+  vec_foreach(rule, rules) {
+    vec_add2(ops, op, 1);
+    op->is_add = 1;
+    op->rule_index = ~0;
+    op->rule = *rule;
+  }
+  *rule_count = vec_len(rules);
+  vec_free(rules);
+  vec_free(contents);
+
+  if (in_batch) {
+    vec_append(mm->batch_ops, ops);
+    vec_free(ops);
+    return 0;
+  }
+  if (apply_ops(ops))
+    return clib_error_return(0, "%s: could not add rules to classifier, "
+                                "no rule loaded", filename);
+  return 0;
+
+done:
+  vec_foreach(rule, rules) {
+    mmb_free_rule(rule);
+  }
+  vec_free(rules);
+  vec_free(contents);
+  return error;
+}
+
+static clib_error_t*
+load_command_fn(vlib_main_t * vm,
+                unformat_input_t * input,
+                vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  clib_error_t *error;
+  u8 *filename = 0;
+  u32 rule_count = 0;
+
+  if (!unformat(input, "%s", &filename))
+    return clib_error_return(0, "Syntax error: mmb load <file>");
+  vec_add1(filename, 0);
+
+  error = load_rules((char *) filename, &rule_count);
+  if (!error)
+    vlib_cli_output(vm, "%s %u rules from %s", 
+                    mm->in_batch ? "Queued" : "Loaded", rule_count, filename);
+  vec_free(filename);
+  return error;
+}
+
+static clib_error_t*
+save_compiled_command_fn(vlib_main_t * vm,
+                         unformat_input_t * input,
+                         vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  clib_error_t *error;
+  u8 *filename = 0;
+
+  if (!unformat(input, "%s", &filename))
+    return clib_error_return(0, "Syntax error: mmb save-compiled <file>");
+  vec_add1(filename, 0);
+
+  mmb_runtime_sync_counters(mm);
+  error = mmb_compiled_write((char *) filename, mm);
+  if (!error)
+    vlib_cli_output(vm, "Saved %u rules, %u tables to %s", 
+                    vec_len(mm->rules), vec_len(mm->tables), filename);
+  vec_free(filename);
+  return error;
+}
+
+/**
+ * load_compiled_rules
+ *
+ * Replace all rules by the rules, tables and sessions of a file written by
+ * mmb save-compiled. Rules are neither parsed nor validated again and no
+ * mask is computed.
+ *
+ * @return NULL on success
+ */
+static clib_error_t *load_compiled_rules(char *filename) {
+
+  mmb_main_t *mm = &mmb_main;
+  mmb_compiled_t compiled;
+  mmb_rule_t *rule;
+  clib_error_t *error;
+  u32 *deleted = 0, rule_index;
+
+  if (mm->in_batch)
+    return clib_error_return(0, "Commit or abort the open batch first");
+
+  if ( (error = mmb_compiled_read(filename, &compiled)) )
+    return error;
+
+  /* set indexes and pattern ids are not saved, sets are bound by name */
+  vec_foreach(rule, compiled.rules) {
+    mmb_payload_ref_rule(rule);
+    if ( (error = mmb_ipset_resolve_rule(rule)) ) {
+      vec_foreach(rule, compiled.rules) {
+        mmb_free_rule(rule);
+      }
+      vec_free(compiled.rules);
+      mmb_compiled_free(&compiled);
+      return error;
+    }
+  }
+
+  mmb_runtime_sync_counters(mm);
+  vec_foreach_index(rule_index, mm->rules) {
+    vec_add1(deleted, rule_index);
+  }
+
+  if (install_rules(compiled.rules, deleted, &compiled)) {
+    vec_foreach(rule, compiled.rules) {
+      mmb_free_rule(rule);
+    }
+    vec_free(compiled.rules);
+    error = clib_error_return(0, "%s: inconsistent tables, could not add "
+                                 "rules to classifier", filename);
+  }
+
+  mmb_compiled_free(&compiled);
+  return error;
+}
+
+static clib_error_t*
+load_compiled_command_fn(vlib_main_t * vm,
+                         unformat_input_t * input,
+                         vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  clib_error_t *error;
+  u8 *filename = 0;
+
+  if (!unformat(input, "%s", &filename))
+    return clib_error_return(0, "Syntax error: mmb load-compiled <file>");
+  vec_add1(filename, 0);
+
+  error = load_compiled_rules((char *) filename);
+  if (!error)
+    vlib_cli_output(vm, "Loaded %u rules, %u tables from %s", 
+                    vec_len(mm->rules), vec_len(mm->tables), filename);
+  vec_free(filename);
+  return error;
+}
+
+static clib_error_t*
+optimize_command_fn(vlib_main_t * vm,
+                    unformat_input_t * input,
+                    vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  mmb_rule_t *rules;
+  u32 table_cost = mm->unify_table_cost;
+  u8 unify_masks;
+
+  if (unformat(input, "on"))
+    unify_masks = 1;
+  else if (unformat(input, "off"))
+    unify_masks = 0;
+  else
+    return clib_error_return(0, "Syntax error: "
+                                "mmb optimize on [table-cost <n>]|off");
+  unformat(input, "table-cost %u", &table_cost);
+
+  if (mm->in_batch)
+    return clib_error_return(0, "Commit or abort the open batch first");
+
+  mm->unify_masks = unify_masks;
+  mm->unify_table_cost = table_cost;
+
+  /* recompile current rules */
+  if (vec_len(mm->rules)) {
+    mmb_runtime_sync_counters(mm);
+    rules = vec_dup(mm->rules);
+    if (install_rules(rules, 0, 0)) {
+      vec_free(rules);
+      return clib_error_return(0, "Could not add rules to classifier, "
+                                  "rules are unchanged");
+    }
+  }
+
+  vlib_cli_output(vm, "Mask unification %s, %u tables", 
+                  unify_masks ? "on" : "off", vec_len(mm->tables));
+  return 0;
+}
+
+static clib_error_t*
+engine_command_fn(vlib_main_t * vm,
+                  unformat_input_t * input,
+                  vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  mmb_rule_t *rules, *rule;
+  u32 bitvector_count = 0;
+  u8 engine;
+
+  if (unformat(input, "classifier"))
+    engine = MMB_ENGINE_CLASSIFIER;
+  else if (unformat(input, "bitvector"))
+    engine = MMB_ENGINE_BITVECTOR;
+  else
+    return clib_error_return(0, "Syntax error: "
+                                "mmb engine classifier|bitvector");
+
+  if (mm->in_batch)
+    return clib_error_return(0, "Commit or abort the open batch first");
+
+  /* recompile current rules */
+  if (vec_len(mm->rules)) {
+    mmb_runtime_sync_counters(mm);
+    rules = vec_dup(mm->rules);
+    vec_foreach(rule, rules) {
+      rule->bitvector = engine == MMB_ENGINE_BITVECTOR && !rule->lpm
+                        && !rule->exact && mmb_bv_rule_eligible(rule);
+    }
+    if (install_rules(rules, 0, 0)) {
+      vec_free(rules);
+      return clib_error_return(0, "Could not add rules to classifier, "
+                                  "rules are unchanged");
+    }
+  }
+  mm->engine = engine;
+
+  vec_foreach(rule, mm->rules) {
+    bitvector_count += rule->bitvector;
+  }
+  vlib_cli_output(vm, "%u rules in bit vectors, %u classifier tables",
+                  bitvector_count, vec_len(mm->tables));
+  return 0;
+}
 
-  vl_print(mm->vlib_main, "rule at index:%u table internal index:%u classify_index:%u "
-                           "lookup_index:%u",
-           rule_index,table_index, rule->classify_table_index, rule->lookup_index);
+static clib_error_t*
+show_bitvector_command_fn(vlib_main_t * vm,
+                          unformat_input_t * input,
+                          vlib_cli_command_t * cmd) {
+  mmb_runtime_t *rt;
 
-  mmb_session_t *session = find_session(table, rule);
-  if (add_del_session(table, rule, session, rule_index, 0)) { 
-     /* last rule of session, delete session */
+  /* changes not published yet */
+  mmb_runtime_publish_pending(&mmb_main);
+  rt = mmb_runtime_main.current;
+  if (rt == 0)
+    return 0;
 
-     vl_print(mm->vlib_main, "deleting session from table %u", rule->classify_table_index);
-     mmb_add_del_session(rule->classify_table_index, rule->classify_key, 0, 0, 0);
-     table->entry_count--;
+  vlib_cli_output(vm, "ip4: %U", mmb_format_bv, 
+                  rt->bv[MMB_CLASSIFY_TABLE_IP4]);
+  vlib_cli_output(vm, "ip6: %U", mmb_format_bv, 
+                  rt->bv[MMB_CLASSIFY_TABLE_IP6]);
+  return 0;
+}
 
-     if (table->entry_count == 0) { /* Empty table, delete it */
+#define MMB_BENCHMARK_PACKET_BYTES 128
 
-       vl_print(mm->vlib_main, "table:%u is empty, deleting", rule->classify_table_index);
-       rechain_table(table, 0);
-       mmb_classify_del_table(&rule->classify_table_index, 0);
-       vec_free(mm->tables[table_index].mask);
-       vec_delete(mm->tables, 1, table_index);
-     } else if (table->entry_count <= table->size / MMB_TABLE_SIZE_DEC_THRESHOLD) {
+/**
+ * benchmark_command_fn
+ *
+ * Time ip4 or ip6 lookups of the classifier chain holding current rules,
+ * walked in full and as the classify nodes walk it, skipping tables by
+ * protocol class and session filter of the published snapshot, against a
+ * bit vector classifier of the same rules, built off to the side. Half of 
+ * the packets are random, the others are built from the key of a rule.
+ */
+static clib_error_t*
+benchmark_command_fn(vlib_main_t * vm,
+                     unformat_input_t * input,
+                     vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  vnet_classify_main_t *vcm = mm->mmb_classify_main->vnet_classify_main;
+  mmb_bv_t *bv[MMB_CLASSIFY_N_TABLES];
+  mmb_classify_table_id_t tid = MMB_CLASSIFY_TABLE_IP4;
+  vnet_classify_table_t *t;
+  mmb_runtime_t *rt;
+  mmb_bloom_t *bloom;
+  mmb_rule_t *rule;
+  u8 *packets = 0, *p, l4_bit;
+  u32 *candidates = 0, *rule_indexes = 0;
+  u32 packet_count = 10000, index, byte, skip, seed, table_index;
+  u64 start, chain_cycles, node_cycles, bv_cycles, chain_hits = 0;
+  u64 node_hits = 0, node_skipped = 0, bv_hits = 0, hash;
+  f64 now = vlib_time_now(vm);
+
+  while (unformat_check_input(input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat(input, "packets %u", &packet_count)) {
+      if (packet_count == 0)
+        return clib_error_return(0, "packets must be non-zero");
+    } else if (unformat(input, "ip6"))
+      tid = MMB_CLASSIFY_TABLE_IP6;
+    else
+      return clib_error_return(0, "Syntax error: "
+                                  "mmb benchmark [packets <n>] [ip6]");
+  }
+  if (mm->engine != MMB_ENGINE_CLASSIFIER || vec_len(mm->tables) == 0)
+    return clib_error_return(0, "No rule in the classifier chain, "
+                                "see mmb engine classifier");
+
+  /* filters and protocol classes of the snapshot the nodes use */
+  mmb_runtime_publish_pending(mm);
+  rt = mmb_runtime_main.current;
+
+  vec_foreach(rule, mm->rules) {
+    if (rule->l3 == (tid == MMB_CLASSIFY_TABLE_IP6 ? ETHERNET_TYPE_IP6 
+                                                   : ETHERNET_TYPE_IP4)
+        && in_classifier(rule))
+      vec_add1(candidates, rule - mm->rules);
+  }
 
-       vl_print(mm->vlib_main, "table:%u is too large, shrinking", 
-                rule->classify_table_index);
-       realloc_table(table, 0); 
-       rule->classify_table_index = table->index;
-     }
+  seed = random_default_seed();
+  vec_validate_aligned(packets, 
+                       packet_count * MMB_BENCHMARK_PACKET_BYTES - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  for (index = 0; index < packet_count; index++) {
+    p = packets + index * MMB_BENCHMARK_PACKET_BYTES;
+    for (byte = 0; byte < MMB_BENCHMARK_PACKET_BYTES; byte++)
+      p[byte] = random_u32(&seed);
+    p[0] = tid == MMB_CLASSIFY_TABLE_IP6 ? 0x60 : 0x45;
+
+    if ((index & 1) == 0 || vec_len(candidates) == 0)
+      continue;
+    rule = &mm->rules[candidates[random_u32(&seed) % vec_len(candidates)]];
+    skip = rule->classify_skip * sizeof(u32x4);
+    for (byte = 0; byte < vec_len(rule->classify_mask)
+                   && skip + byte < MMB_BENCHMARK_PACKET_BYTES; byte++)
+      p[skip+byte] = (p[skip+byte] & ~rule->classify_mask[byte])
+                     | (rule->classify_key[byte] & rule->classify_mask[byte]);
   }
 
-  if (rule->stateful) {
-    purge_conn_index(mct, rule_index);
-  } else {
-    update_conn_pool(mct, rule_index);
+  mmb_bv_build(mm->rules, 1, bv);
+
+  start = clib_cpu_time_now();
+  for (index = 0; index < packet_count; index++) {
+    p = packets + index * MMB_BENCHMARK_PACKET_BYTES;
+    t = pool_elt_at_index(vcm->tables, mm->tables[0].index);
+    for (;;) {
+      if (vnet_classify_find_entry(t, p, vnet_classify_hash_packet(t, p), 
+                                   now))
+        chain_hits++;
+      if (t->next_table_index == ~0)
+        break;
+      t = pool_elt_at_index(vcm->tables, t->next_table_index);
+    }
+  }
+  chain_cycles = clib_cpu_time_now() - start;
+
+  /* the walk of mmb_classify_inline */
+  start = clib_cpu_time_now();
+  for (index = 0; index < packet_count; index++) {
+    p = packets + index * MMB_BENCHMARK_PACKET_BYTES;
+    l4_bit = mmb_classify_packet_l4_bit(tid, p);
+    for (table_index = mm->tables[0].index; table_index != ~0;
+         table_index = t->next_table_index) {
+      t = pool_elt_at_index(vcm->tables, table_index);
+      if (!mmb_runtime_l4_maybe(rt, table_index, l4_bit)) {
+        node_skipped++;
+        continue;
+      }
+      hash = vnet_classify_hash_packet(t, p);
+      bloom = mmb_runtime_bloom(rt, table_index);
+      if (bloom && !mmb_bloom_maybe(bloom, hash)) {
+        node_skipped++;
+        continue;
+      }
+      if (vnet_classify_find_entry(t, p, hash, now))
+        node_hits++;
+    }
+  }
+  node_cycles = clib_cpu_time_now() - start;
+
+  start = clib_cpu_time_now();
+  for (index = 0; index < packet_count; index++) {
+    p = packets + index * MMB_BENCHMARK_PACKET_BYTES;
+    vec_reset_length(rule_indexes);
+    if (bv[tid])
+      mmb_bv_lookup(bv[tid], p, &rule_indexes);
+    bv_hits += vec_len(rule_indexes);
   }
+  bv_cycles = clib_cpu_time_now() - start;
+
+  vlib_cli_output(vm, "%u %s packets, %u %s rules in the classifier",
+                  packet_count, tid == MMB_CLASSIFY_TABLE_IP6 ? "ip6" : "ip4",
+                  vec_len(candidates), 
+                  tid == MMB_CLASSIFY_TABLE_IP6 ? "ip6" : "ip4");
+  vlib_cli_output(vm, "classifier: %u tables, %.1f cycles/packet, "
+                  "%lu session hits", vec_len(mm->tables),
+                  (f64) chain_cycles / packet_count, chain_hits);
+  vlib_cli_output(vm, "classifier with filters: %.1f cycles/packet, "
+                  "%lu session hits, %lu table lookups skipped",
+                  (f64) node_cycles / packet_count, node_hits, node_skipped);
+  vlib_cli_output(vm, "bit vector: %.1f cycles/packet, %lu rule hits, %U",
+                  (f64) bv_cycles / packet_count, bv_hits,
+                  mmb_format_bv, bv[tid]);
+
+  mmb_bv_free(bv[MMB_CLASSIFY_TABLE_IP4]);
+  mmb_bv_free(bv[MMB_CLASSIFY_TABLE_IP6]);
+  vec_free(rule_indexes);
+  vec_free(candidates);
+  vec_free(packets);
+  return 0;
+}
 
-  free_rule(rule);
-  vec_delete(rules, 1, rule_index);
-  update_flags(mm, rules);
+static clib_error_t*
+show_optimize_command_fn(vlib_main_t * vm,
+                         unformat_input_t * input,
+                         vlib_cli_command_t * cmd) {
+  mmb_main_t *mm = &mmb_main;
+  mmb_table_t *old_tables = mm->tables, *table;
+  uword *old_table_by_mask = mm->table_by_mask;
+  uword *old_table_by_index = mm->table_by_index;
+  mmb_lookup_entry_t *lookup_pool = 0;
+  mmb_rule_t *rules = vec_dup(mm->rules);
+  mmb_unify_group_t *groups = 0, *group;
+  clib_error_t *error = 0;
+  u64 entry_count = 0, unified_entry_count = 0;
+  u32 table_cost = mm->unify_table_cost;
+
+  unformat(input, "table-cost %u", &table_cost);
+
+  /* tables of current rules without unification, off to the side */
+  mm->tables = 0;
+  mm->table_by_mask = hash_create_vec(0, sizeof(u8), sizeof(uword));
+  mm->table_by_index = hash_create(0, sizeof(uword));
+
+  if (batch_build_tables(rules, &lookup_pool)) {
+    error = clib_error_return(0, "Could not compile current rules");
+    goto done;
+  }
+  groups = unify_plan(mm->tables, table_cost);
 
-  if (mm->enabled && vec_len(rules) == 0) 
-    mmb_enable_disable_all(0);
+  vec_foreach(table, mm->tables) {
+    entry_count += table->entry_count;
+  }
+  vec_foreach(group, groups) {
+    unified_entry_count += group->entry_count;
+  }
 
-  return 0;
+  vlib_cli_output(vm, "before: %u tables, %lu sessions, cost %lu", 
+                  vec_len(mm->tables), entry_count, 
+                  entry_count + (u64) vec_len(mm->tables) * table_cost);
+  vlib_cli_output(vm, "after:  %u tables, %lu sessions, cost %lu", 
+                  vec_len(groups), unified_entry_count, 
+                  unified_entry_count + (u64) vec_len(groups) * table_cost);
+
+  vec_foreach(group, groups) {
+    if (group->first == group->last)
+      continue;
+    vlib_cli_output(vm, "tables [%u-%u] unified, %lu sessions\n\tmask %U", 
+                    group->first, group->last, group->entry_count,
+                    mmb_format_key, group->mask);
+  }
+
+done:
+  unify_free_plan(groups);
+  free_tables(mm->tables, lookup_pool);
+  hash_free(mm->table_by_mask);
+  hash_free(mm->table_by_index);
+  mm->tables = old_tables;
+  mm->table_by_mask = old_table_by_mask;
+  mm->table_by_index = old_table_by_index;
+  vec_free(rules);
+  return error;
 }
 
 static clib_error_t*
@@ -1767,6 +3789,16 @@ static_always_inline void translate_target_ip4_ecn(mmb_target_t *target) {
   target->field = MMB_FIELD_IP4_ECN;
 }
 
+static_always_inline u8 ip6_eh_kind(u8 field) {
+  switch (field) {
+#define _(a,b,c) case a: return c;
+   foreach_mmb_ip6_eh_cli
+#undef _
+   default:
+     return 0;
+  }
+}
+
 static_always_inline void translate_match_bit_flags(mmb_match_t *match) {
   match->condition = MMB_COND_EQ;
   vec_add1(match->value, 1);
@@ -1777,6 +3809,8 @@ u16 get_field_protocol(u8 field) {
      return ETHERNET_TYPE_IP4;
   if (MMB_FIELD_IP6_VER <= field && field <= MMB_FIELD_IP6_PAYLOAD)
      return ETHERNET_TYPE_IP6;
+  if (MMB_FIELD_IP6_EH_HOPBYHOP <= field && field <= MMB_FIELD_IP6_EH)
+     return ETHERNET_TYPE_IP6;
   if (MMB_FIELD_ICMP_TYPE <= field && field <= MMB_FIELD_ICMP_PAYLOAD)
      return IP_PROTOCOL_ICMP;
   if (MMB_FIELD_UDP_SPORT <= field && field <= MMB_FIELD_UDP_PAYLOAD)
@@ -1867,6 +3901,28 @@ clib_error_t* validate_matches(mmb_rule_t *rule) {
            || (error = update_l4(field, &rule->l4)) )
        goto end;
 
+     if (condition == MMB_COND_IN) {
+       /* matched against the set, not by the classifier */
+       vec_add1(rule->set_matches, *match);
+       match->value = 0;
+       vec_insert_elt_first(deletions, &index);
+       continue;
+     }
+
+     if (condition == MMB_COND_CONTAINS) {
+       if (mmb_payload_field_scope(field) == ~0 
+           || vec_len(match->value) == 0) {
+         error = clib_error_return(0, "'contains' requires a payload field "
+                                      "and a value");
+         goto end;
+       }
+       /* matched by the payload automaton, not by the classifier */
+       vec_add1(rule->payload_matches, *match);
+       match->value = 0;
+       vec_insert_elt_first(deletions, &index);
+       continue;
+     }
+
      switch (field) {
        case MMB_FIELD_ALL:
          /* other fields must be empty, and no other matches */
@@ -1911,6 +3967,21 @@ clib_error_t* validate_matches(mmb_rule_t *rule) {
          vec_add1(rule->opt_matches, *match);
          vec_insert_elt_first(deletions, &index);
          break;
+#define _(a,b,c) case a:
+   foreach_mmb_ip6_eh_cli
+#undef _
+       case MMB_FIELD_IP6_EH:
+         /* presence of the extension header, found by the headers walker */
+         if (condition || vec_len(match->value) > 0) {
+           error = clib_error_return(0, "%s does not take a condition nor a value", 
+                                    fields[field_toindex(field)]);
+           goto end;
+         }
+         match->opt_kind = ip6_eh_kind(field);
+         rule->opts_in_matches=1;
+         vec_add1(rule->opt_matches, *match);
+         vec_insert_elt_first(deletions, &index);
+         continue;
        case MMB_FIELD_INTERFACE_IN:  
        case MMB_FIELD_INTERFACE_OUT:
          if ( (error = validate_if(rule, match, field)) ) 
@@ -1933,13 +4004,18 @@ clib_error_t* validate_matches(mmb_rule_t *rule) {
      vlib_cli_output(mmb_main.vlib_main, "deleting %u size:%u\n", *deletion, vec_len(rule->matches));
 
      mmb_match_t *match = &rule->matches[*deletion];
-     if (vec_len(rule->matches) == 1 && vec_len(rule->opt_matches) == 0) {
+     if (vec_len(rule->matches) == 1 && vec_len(rule->opt_matches) == 0
+         && vec_len(rule->set_matches) == 0 
+         && vec_len(rule->payload_matches) == 0) {
        match->field = MMB_FIELD_ALL;
        match->condition = 0;
      } else  /* del */
        vec_delete(rule->matches, 1, *deletion);
    }
 
+   if ( !(error = mmb_ipset_resolve_rule(rule)) )
+     mmb_payload_ref_rule(rule);
+
 end:
    vec_free(deletions);
    return error;
@@ -2150,7 +4226,7 @@ void init_rule(mmb_rule_t *rule) {
   clib_bitmap_zero(rule->opt_strips);
 }
 
-void free_rule(mmb_rule_t *rule) {
+void mmb_free_rule(mmb_rule_t *rule) {
   uword index;
 
   vec_foreach_index(index, rule->targets) {
@@ -2168,6 +4244,18 @@ void free_rule(mmb_rule_t *rule) {
   }
   vec_free(rule->opt_matches);
 
+  vec_foreach_index(index, rule->set_matches) {
+    vec_free(rule->set_matches[index].value);
+  }
+  vec_free(rule->set_matches);
+  mmb_ipset_unref_rule(rule);
+  mmb_payload_unref_rule(rule);
+
+  vec_foreach_index(index, rule->payload_matches) {
+    vec_free(rule->payload_matches[index].value);
+  }
+  vec_free(rule->payload_matches);
+
   clib_bitmap_free(rule->opt_strips);
 
   vec_foreach_index(index, rule->opt_mods) {
@@ -2184,6 +4272,8 @@ void free_rule(mmb_rule_t *rule) {
   vec_free(rule->classify_key);
   vec_free(rule->rewrite_mask);
   vec_free(rule->rewrite_key);
+  free_deeps(&rule->deep_matches);
+  free_deeps(&rule->deep_targets);
 }
 
 /**
@@ -2266,6 +4356,139 @@ VLIB_CLI_COMMAND(sr_content_command_flush_rule, static) = {
     .function = flush_rules_command_fn,
 };
 
+/**
+ * @brief CLI command to queue rule changes until commit
+ */
+VLIB_CLI_COMMAND(sr_content_command_begin, static) = {
+    .path = "mmb begin",
+    .short_help = "Queue rule changes until mmb commit",
+    .function = begin_command_fn,
+};
+
+/**
+ * @brief CLI command to apply queued rule changes atomically
+ */
+VLIB_CLI_COMMAND(sr_content_command_commit, static) = {
+    .path = "mmb commit",
+    .short_help = "Apply queued rule changes",
+    .function = commit_command_fn,
+};
+
+/**
+ * @brief CLI command to discard queued rule changes
+ */
+VLIB_CLI_COMMAND(sr_content_command_abort, static) = {
+    .path = "mmb abort",
+    .short_help = "Discard queued rule changes",
+    .function = abort_command_fn,
+};
+
+/**
+ * @brief CLI command to load rules from a file
+ */
+VLIB_CLI_COMMAND(sr_content_command_load, static) = {
+    .path = "mmb load",
+    .short_help = "Add all rules of a file at once: mmb load <file>",
+    .function = load_command_fn,
+};
+
+/**
+ * @brief CLI command to save rules and tables in binary form
+ */
+VLIB_CLI_COMMAND(sr_content_command_save_compiled, static) = {
+    .path = "mmb save-compiled",
+    .short_help = "Save compiled rules: mmb save-compiled <file>",
+    .function = save_compiled_command_fn,
+};
+
+/**
+ * @brief CLI command to restore rules saved by mmb save-compiled
+ */
+VLIB_CLI_COMMAND(sr_content_command_load_compiled, static) = {
+    .path = "mmb load-compiled",
+    .short_help = "Replace all rules by compiled rules: "
+                  "mmb load-compiled <file>",
+    .function = load_compiled_command_fn,
+};
+
+/**
+ * @brief CLI command to enable mask unification
+ */
+VLIB_CLI_COMMAND(sr_content_command_optimize, static) = {
+    .path = "mmb optimize",
+    .short_help = "Unify masks of chained tables: "
+                  "mmb optimize on [table-cost <n>]|off",
+    .function = optimize_command_fn,
+};
+
+/**
+ * @brief CLI command to select the engine of indexable rules
+ */
+VLIB_CLI_COMMAND(sr_content_command_engine, static) = {
+    .path = "mmb engine",
+    .short_help = "Match indexable rules by bit vectors or by the classifier: "
+                  "mmb engine classifier|bitvector",
+    .function = engine_command_fn,
+};
+
+/**
+ * @brief CLI command to show payload patterns
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_patterns, static) = {
+    .path = "mmb show patterns",
+    .short_help = "Display payload patterns and their hits: "
+                  "mmb show patterns",
+    .function = show_patterns_command_fn,
+};
+
+/**
+ * @brief CLI command to show exact 5-tuple tables
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_exact, static) = {
+    .path = "mmb show exact",
+    .short_help = "Display exact 5-tuple tables: mmb show exact",
+    .function = show_exact_command_fn,
+};
+
+/**
+ * @brief CLI command to show bit vector classifiers
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_bitvector, static) = {
+    .path = "mmb show bitvector",
+    .short_help = "Display bit vector classifiers: mmb show bitvector",
+    .function = show_bitvector_command_fn,
+};
+
+/**
+ * @brief CLI command to compare classifier chain and bit vector lookups
+ */
+VLIB_CLI_COMMAND(sr_content_command_benchmark, static) = {
+    .path = "mmb benchmark",
+    .short_help = "Time classifier and bit vector lookups of current rules: "
+                  "mmb benchmark [packets <n>] [ip6]",
+    .function = benchmark_command_fn,
+};
+
+/**
+ * @brief CLI command to show tables before and after mask unification
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_optimize, static) = {
+    .path = "mmb show optimize",
+    .short_help = "Display tables before and after mask unification: "
+                  "mmb show optimize [table-cost <n>]",
+    .function = show_optimize_command_fn,
+};
+
+/**
+ * @brief CLI command to pre-size the table of a mask
+ */
+VLIB_CLI_COMMAND(sr_content_command_table_hint, static) = {
+    .path = "mmb table-hint",
+    .short_help = "Expected number of rules for the mask of a rule: "
+                  "mmb table-hint <entries> <rule>",
+    .function = table_hint_command_fn,
+};
+
 /**
  * @brief CLI command to show classify tables
  */
@@ -2275,6 +4498,18 @@ VLIB_CLI_COMMAND(sr_content_command_show_tables, static) = {
     .function = show_tables_command_fn,
 };
 
+/**
+ * @brief CLI command to set connection table limits
+ */
+VLIB_CLI_COMMAND(sr_content_command_set_conn, static) = {
+    .path = "mmb set connections",
+    .short_help = "Set connection table limits: mmb set connections "
+                  "[max-connections <n>] [tcp-transient-timeout <sec>] "
+                  "[tcp-idle-timeout <sec>] [udp-idle-timeout <sec>] "
+                  "[eviction lru|none]",
+    .function = set_conn_command_fn,
+};
+
 /**
  * @brief CLI command to show connections tables
  */
@@ -2284,6 +4519,45 @@ VLIB_CLI_COMMAND(sr_content_command_show_conn, static) = {
     .function = show_conn_command_fn,
 };
 
+/**
+ * @brief CLI command to show prefix tries
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_lpm, static) = {
+    .path = "mmb show lpm",
+    .short_help = "Display longest prefix match tries: mmb show lpm",
+    .function = show_lpm_command_fn,
+};
+
+/**
+ * @brief CLI command to show session filters
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_filters, static) = {
+    .path = "mmb show filters",
+    .short_help = "Display session filters of classifier tables: "
+                  "mmb show filters",
+    .function = show_filters_command_fn,
+};
+
+/**
+ * @brief CLI command to manage named address sets
+ */
+VLIB_CLI_COMMAND(sr_content_command_ipset, static) = {
+    .path = "mmb ipset",
+    .short_help = "Manage address sets: mmb ipset create <name> [ip6]"
+                  "|delete <name>|add <name> <prefix>..."
+                  "|del <name> <prefix>...|load <name> <file> [replace]",
+    .function = ipset_command_fn,
+};
+
+/**
+ * @brief CLI command to show address sets
+ */
+VLIB_CLI_COMMAND(sr_content_command_show_ipsets, static) = {
+    .path = "mmb show ipsets",
+    .short_help = "Display address sets: mmb show ipsets",
+    .function = show_ipsets_command_fn,
+};
+
 static void
 vl_api_mmb_table_flush_t_handler(vl_api_mmb_table_flush_t *mp)
 {
@@ -2308,6 +4582,152 @@ vl_api_mmb_remove_rule_t_handler(vl_api_mmb_remove_rule_t *mp)
   REPLY_MACRO(VL_API_MMB_REMOVE_RULE_REPLY);
 }
 
+static void
+vl_api_mmb_batch_begin_t_handler(vl_api_mmb_batch_begin_t *mp)
+{
+  vl_api_mmb_batch_begin_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+
+  int rv = batch_begin();
+
+  REPLY_MACRO(VL_API_MMB_BATCH_BEGIN_REPLY);
+}
+
+static void
+vl_api_mmb_batch_commit_t_handler(vl_api_mmb_batch_commit_t *mp)
+{
+  vl_api_mmb_batch_commit_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+
+  int rv = batch_commit();
+
+  REPLY_MACRO(VL_API_MMB_BATCH_COMMIT_REPLY);
+}
+
+static void
+vl_api_mmb_batch_abort_t_handler(vl_api_mmb_batch_abort_t *mp)
+{
+  vl_api_mmb_batch_abort_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+
+  int rv = batch_abort();
+
+  REPLY_MACRO(VL_API_MMB_BATCH_ABORT_REPLY);
+}
+
+static void
+vl_api_mmb_load_t_handler(vl_api_mmb_load_t *mp)
+{
+  vl_api_mmb_load_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+  clib_error_t *error;
+  u32 rule_count;
+  int rv = 0;
+
+  mp->filename[ARRAY_LEN(mp->filename)-1] = 0;
+  error = load_rules((char *) mp->filename, &rule_count);
+  if (error) {
+    clib_error_report(error);
+    rv = -1;
+  }
+
+  REPLY_MACRO(VL_API_MMB_LOAD_REPLY);
+}
+
+static void
+vl_api_mmb_conn_limits_set_t_handler(vl_api_mmb_conn_limits_set_t *mp)
+{
+  vl_api_mmb_conn_limits_set_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+  mmb_conn_table_t *mct = mm->mmb_conn_table;
+  u32 value;
+  int rv = 0;
+
+  /* 0 leaves a limit unchanged */
+  if ((value = ntohl(mp->max_connections)))
+    mct->max_connections = value;
+  if ((value = ntohl(mp->tcp_transient_timeout)))
+    mct->timeouts_value[MMB_TIMEOUT_TCP_TRANSIENT] = value;
+  if ((value = ntohl(mp->tcp_idle_timeout)))
+    mct->timeouts_value[MMB_TIMEOUT_TCP_IDLE] = value;
+  if ((value = ntohl(mp->udp_idle_timeout)))
+    mct->timeouts_value[MMB_TIMEOUT_UDP_IDLE] = value;
+  if (mp->eviction)
+    mct->eviction = mp->eviction == 2 ? MMB_EVICTION_LRU : MMB_EVICTION_NONE;
+
+  REPLY_MACRO(VL_API_MMB_CONN_LIMITS_SET_REPLY);
+}
+
+static void
+vl_api_mmb_ipset_create_t_handler(vl_api_mmb_ipset_create_t *mp)
+{
+  vl_api_mmb_ipset_create_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+  u8 *name;
+
+  mp->name[ARRAY_LEN(mp->name)-1] = 0;
+  name = format(0, "%s", mp->name);
+  int rv = mmb_ipset_create(name, mp->is_ip6);
+  vec_free(name);
+
+  REPLY_MACRO(VL_API_MMB_IPSET_CREATE_REPLY);
+}
+
+static void
+vl_api_mmb_ipset_delete_t_handler(vl_api_mmb_ipset_delete_t *mp)
+{
+  vl_api_mmb_ipset_delete_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+  u8 *name;
+
+  mp->name[ARRAY_LEN(mp->name)-1] = 0;
+  name = format(0, "%s", mp->name);
+  int rv = mmb_ipset_delete(name);
+  vec_free(name);
+
+  REPLY_MACRO(VL_API_MMB_IPSET_DELETE_REPLY);
+}
+
+static void
+vl_api_mmb_ipset_add_del_t_handler(vl_api_mmb_ipset_add_del_t *mp)
+{
+  vl_api_mmb_ipset_add_del_reply_t *rmp;
+  mmb_main_t *mm = &mmb_main;
+  mmb_ipset_prefix_t *prefixes = 0, *prefix;
+  u32 count = clib_net_to_host_u32(mp->count), index, ipset_index;
+  u32 length = vl_msg_api_get_msg_length(mp);
+  u8 *name;
+  int rv = 0;
+
+  /* bound count by the message, count * size could wrap */
+  if (length < sizeof(*mp)
+      || count > (length - sizeof(*mp)) / sizeof(mp->prefixes[0])) {
+    rv = -1;
+    goto reply;
+  }
+
+  mp->name[ARRAY_LEN(mp->name)-1] = 0;
+  name = format(0, "%s", mp->name);
+  ipset_index = mmb_ipset_find(name);
+  vec_free(name);
+  if (ipset_index == ~0) {
+    rv = -2;
+    goto reply;
+  }
+
+  for (index = 0; index < count; index++) {
+    vec_add2(prefixes, prefix, 1);
+    clib_memcpy(prefix->addr, mp->prefixes[index].address, 
+                sizeof(prefix->addr));
+    prefix->len = mp->prefixes[index].length;
+  }
+  rv = mmb_ipset_update(ipset_index, prefixes, mp->is_add, mp->replace);
+  vec_free(prefixes);
+
+reply:
+  REPLY_MACRO(VL_API_MMB_IPSET_ADD_DEL_REPLY);
+}
+
 static void
 send_mmb_table_details(u32 rule_num, mmb_rule_t *rule, unix_shared_memory_queue_t *q, u32 context)
 {
@@ -2345,6 +4765,14 @@ vl_api_mmb_table_dump_t_handler(vl_api_mmb_table_dump_t *mp)
 #define foreach_mmb_plugin_api_msg     \
   _(MMB_TABLE_FLUSH, mmb_table_flush)  \
   _(MMB_REMOVE_RULE, mmb_remove_rule)  \
+  _(MMB_BATCH_BEGIN, mmb_batch_begin)  \
+  _(MMB_BATCH_COMMIT, mmb_batch_commit)  \
+  _(MMB_BATCH_ABORT, mmb_batch_abort)  \
+  _(MMB_LOAD, mmb_load)  \
+  _(MMB_CONN_LIMITS_SET, mmb_conn_limits_set)  \
+  _(MMB_IPSET_CREATE, mmb_ipset_create)  \
+  _(MMB_IPSET_DELETE, mmb_ipset_delete)  \
+  _(MMB_IPSET_ADD_DEL, mmb_ipset_add_del)  \
   _(MMB_TABLE_DUMP, mmb_table_dump)
 
 /**
@@ -2397,6 +4825,10 @@ static clib_error_t * mmb_init(vlib_main_t *vm) {
   standalone_random_default_seed = (u32) mm->last_conn_table_timeout_check;
 #endif
   mm->random_seed = random_default_seed();
+  mm->table_by_mask = hash_create_vec(0, sizeof(u8), sizeof(uword));
+  mm->table_by_index = hash_create(0, sizeof(uword));
+  mm->size_hints = hash_create_vec(0, sizeof(u8), sizeof(uword));
+  mm->unify_table_cost = MMB_UNIFY_TABLE_COST;
    
   if ((error = mmb_conn_table_init(vm)))
     return error;
@@ -2420,3 +4852,53 @@ static clib_error_t * mmb_init(vlib_main_t *vm) {
 
 VLIB_INIT_FUNCTION (mmb_init);
 
+/**
+ * @brief Startup configuration of the connection table.
+ *
+ * mmb { conn-buckets <n> conn-memory <size> conn-memory-ip4 <size>
+ *       conn-memory-ip6 <size> max-connections <n>
+ *       tcp-transient-timeout <sec> tcp-idle-timeout <sec>
+ *       udp-idle-timeout <sec> eviction lru|none }
+ */
+static clib_error_t * mmb_config(vlib_main_t *vm, unformat_input_t *input) {
+  mmb_conn_table_t *mct = &mmb_conn_table;
+  clib_error_t * error;
+  uword memory;
+  u32 buckets;
+
+  if ((error = vlib_call_init_function(vm, mmb_init)))
+    return error;
+
+  while (unformat_check_input(input) != UNFORMAT_END_OF_INPUT) {
+    if (unformat(input, "conn-buckets %u", &buckets)) {
+      if (buckets == 0)
+        return clib_error_return(0, "conn-buckets must be non-zero");
+      mct->conn_buckets = buckets;
+    } else if (unformat(input, "conn-memory-ip4 %U", unformat_memory_size,
+                        &memory)) {
+      if (memory == 0)
+        return clib_error_return(0, "conn-memory-ip4 must be non-zero");
+      mct->conn_memory4 = memory;
+    } else if (unformat(input, "conn-memory-ip6 %U", unformat_memory_size,
+                        &memory)) {
+      if (memory == 0)
+        return clib_error_return(0, "conn-memory-ip6 must be non-zero");
+      mct->conn_memory6 = memory;
+    } else if (unformat(input, "conn-memory %U", unformat_memory_size,
+                        &memory)) {
+      if (memory == 0)
+        return clib_error_return(0, "conn-memory must be non-zero");
+      mct->conn_memory = memory;
+    } else if (unformat(input, "%U", unformat_conn_limit, mct, &error)) {
+      if (error)
+        return error;
+    }
+    else
+      return clib_error_return(0, "unknown input `%U'",
+                               format_unformat_error, input);
+  }
+  return 0;
+}
+
+VLIB_CONFIG_FUNCTION (mmb_config, "mmb");
+
@@ -46,7 +46,9 @@
   _(LEQ, "<=")                \
   _(GEQ, ">=")                \
   _(LT,  "<")                 \
-  _(GT,  ">")
+  _(GT,  ">")                 \
+  _(IN,  "in")                \
+  _(CONTAINS, "contains")
 
 #define foreach_mmb_target \
   _(DROP)                  \
@@ -214,11 +216,26 @@ _(ip6,IP6)
 #define next_if_match(rule)\
     (is_drop(rule)\
      ? MMB_CLASSIFY_NEXT_INDEX_DROP : MMB_CLASSIFY_NEXT_INDEX_MATCH)
-
-#define MMB_TABLE_SIZE_INIT 2
-#define MMB_TABLE_SIZE_INC_RATIO 2
-#define MMB_TABLE_SIZE_DEC_RATIO 2
-#define MMB_TABLE_SIZE_DEC_THRESHOLD 4
+#define in_classifier(rule)\
+    (!(rule)->lpm && !(rule)->bitvector && !(rule)->exact)
+
+#define MMB_TABLE_SIZE_INIT 64
+#define MMB_TABLE_SIZE_INC_RATIO 4
+#define MMB_TABLE_SIZE_DEC_RATIO 4
+#define MMB_TABLE_SIZE_DEC_THRESHOLD 16
+/* classifier memory per entry is multiplied by this factor to account for
+ * power-of-two page rounding and bucket splits */
+#define MMB_TABLE_MEMORY_HEADROOM 4
+#define MMB_TABLE_MEMORY_MIN (64<<10)
+
+/* mask unification: a chained table costs as much as MMB_UNIFY_TABLE_COST 
+ * sessions, a mask is widened by at most MMB_UNIFY_MAX_BITS bits */
+#define MMB_UNIFY_TABLE_COST 64
+#define MMB_UNIFY_MAX_BITS 8
+
+/* engine matching the rules it can index, others go to the classifier */
+#define MMB_ENGINE_CLASSIFIER 0
+#define MMB_ENGINE_BITVECTOR 1
 
 typedef struct {
    u8 *key;
@@ -239,11 +256,14 @@ typedef struct {
   u32 entry_count; /*! table occupation */
   u32 size;   /*! table capacity */
 
-  u8 *mask; 
+  u8 *mask;
   u32 skip;
   u32 match;
+  u8 *hash_key; /*! (mask, skip, match) key in mmb_main.table_by_mask */
+  u8 **merged_keys; /*! hash keys of the tables unified in this one */
 
-  mmb_session_t *sessions;
+  mmb_session_t *sessions; /*! pool of sessions */
+  uword *session_by_key; /*! session key -> index in sessions pool */
 
 } mmb_table_t;
 
@@ -261,6 +281,56 @@ typedef struct {
    u8 reverse; /*! reverse matching (boolean not) */
 } mmb_match_t;
 
+typedef struct {
+   u32 ipset_index; /*! The set to look the address up in */
+   u8 field; /*! The address field */
+   u8 reverse; /*! not in set */
+} mmb_ipset_match_t;
+
+typedef struct {
+   u8 field; /*! payload field, value starts at its first byte */
+   u8 *value; /*! bytes to match or to write */
+} mmb_deep_t;
+
+/**
+ * mmb_deep_offset
+ *
+ * @return offset from the ip header of the payload of deep->field, past ip4
+ *         options, ip6 extension headers and tcp options, ~0 if the packet
+ *         has no such payload
+ */
+static_always_inline u32 mmb_deep_offset(mmb_deep_t *deep, mmb_headers_t *hdr,
+                                         u8 *h0, u32 len0) {
+   switch (deep->field) {
+      case MMB_FIELD_IP4_PAYLOAD:
+         return hdr->l4_offset;
+      case MMB_FIELD_IP6_PAYLOAD:
+         return sizeof(ip6_header_t);
+      default:
+         break;
+   }
+   if (!hdr->l4_valid)
+      return ~0;
+
+   switch (deep->field) {
+      case MMB_FIELD_ICMP_PAYLOAD:
+         return hdr->l4_proto == IP_PROTOCOL_ICMP 
+                || hdr->l4_proto == IP_PROTOCOL_ICMP6
+                ? hdr->l4_offset + sizeof(icmp46_header_t) : ~0;
+      case MMB_FIELD_UDP_PAYLOAD:
+         return hdr->l4_proto == IP_PROTOCOL_UDP
+                ? hdr->l4_offset + sizeof(udp_header_t) : ~0;
+      case MMB_FIELD_TCP_PAYLOAD:
+         return hdr->l4_proto == IP_PROTOCOL_TCP
+                && hdr->l4_offset + sizeof(tcp_header_t) <= len0
+                ? hdr->l4_offset 
+                  + tcp_doff((tcp_header_t *) (h0 + hdr->l4_offset)) * 4
+                : ~0;
+      default:
+         return ~0;
+   }
+}
+
 typedef struct {
    u8 keyword; /*! The target keyword */ 
    u8 field;  /*! The field to modify */
@@ -278,6 +348,11 @@ typedef struct {
   /* matches/constraints */
   mmb_match_t *matches; /*! Matches vector */
   mmb_match_t *opt_matches; /*! Options (tcp, ip6) */
+  mmb_match_t *set_matches; /*! "<addr-field> in <set>", value is the name */
+  mmb_ipset_match_t *ipset_matches; /*! set_matches bound to their sets */
+  mmb_deep_t *deep_matches; /*! payload bytes past the classifier mask */
+  mmb_match_t *payload_matches; /*! "<payload-field> contains <value>" */
+  u32 *payload_ids; /*! pattern id of each payload match */
   u32 match_count; /*! count of matched packets */
 
   /* targets/modifications */
@@ -300,6 +375,7 @@ typedef struct {
   u32 rewrite_skip;
   u32 rewrite_match;
   u8 *rewrite_key;
+  mmb_deep_t *deep_targets; /*! payload bytes past the rewrite mask */
 
   /* drop rate, unit is 0.001% */
   u32 drop_rate;
@@ -312,18 +388,43 @@ typedef struct {
   u8 lb:1;
   u8 stateful:1;
   u8 shuffle:1;
-  u8 unused:1; 
+  u8 lpm:1; /*! matched by longest prefix match, not by the classifier */
+  u8 bitvector:1; /*! matched by the bit vector classifier */
+  u8 exact:1; /*! matched by the exact 5-tuple table */
 
 } mmb_rule_t;
 
+typedef struct {
+   u8 is_add;
+   u32 rule_index; /*! index of the rule to delete */
+   mmb_rule_t rule; /*! rule to add */
+} mmb_batch_op_t;
+
+typedef struct {
+   u32 first; /*! first table of the group, in chain order */
+   u32 last; /*! last table of the group */
+   u8 *mask; /*! unified mask */
+   u64 entry_count; /*! sessions after key expansion (upper bound) */
+} mmb_unify_group_t;
+
 typedef struct {
    /* API message ID base */
    u16 msg_id_base;
 
    mmb_rule_t *rules;  /*! Rules vector, per if, per dir */
-   mmb_table_t *tables; /*! Tables vector */   
+   mmb_table_t *tables; /*! Tables vector */
+   uword *table_by_mask; /*! (mask, skip, match) -> index in tables */
+   uword *table_by_index; /*! classify table index -> index in tables */
+   uword *size_hints; /*! (mask, skip, match) -> expected number of sessions */
    mmb_lookup_entry_t *lookup_pool; /*! rule lookup pool */
 
+   u8 in_batch; /*! rule changes are queued until commit */
+   mmb_batch_op_t *batch_ops; /*! queued rule changes */
+
+   u8 unify_masks; /*! unify masks of chained tables when compiling */
+   u32 unify_table_cost; /*! cost of a chained table, in sessions */
+   u8 engine; /*! MMB_ENGINE_* */
+
    u8 feature_arc_index;
    u32 *sw_if_indexes;
 
@@ -364,6 +465,13 @@ u16 get_field_protocol(u8 field);
  */
 u8 is_fixed_length(u8 field);
 
+/**
+ * mmb_free_rule
+ *
+ * free vectors of rule
+ */
+void mmb_free_rule(mmb_rule_t *rule);
+
 /**
  * bytes_to_u32
  * 
@@ -0,0 +1,345 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * bit vector classifier.
+ */
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_bitvector.h>
+
+typedef struct {
+  u8 offset;
+  u8 width;
+} mmb_bv_field_t;
+
+typedef struct {
+  u8 point[MMB_BV_MAX_WIDTH]; /*! big endian, zero padded */
+  u32 bit;
+  u8 is_add;
+} mmb_bv_event_t;
+
+typedef struct {
+  u64 **rows; /*! distinct rows */
+  uword *row_by_bits; /*! row bits -> index in rows */
+} mmb_bv_rows_t;
+
+static_always_inline u32 rule_tid(mmb_rule_t *rule) {
+  return rule->l3 == ETHERNET_TYPE_IP6
+         ? MMB_CLASSIFY_TABLE_IP6 : MMB_CLASSIFY_TABLE_IP4;
+}
+
+static void bv_fields(u32 tid, mmb_bv_field_t fields[MMB_BV_MAX_DIMS]) {
+  u8 addr_width = tid == MMB_CLASSIFY_TABLE_IP4 ? 4 : 16;
+  u32 index = 0;
+
+#define _(f, o4, o6, w)                                             \
+  fields[index].offset = tid == MMB_CLASSIFY_TABLE_IP4 ? o4 : o6;   \
+  fields[index].width = w ? w : addr_width;                         \
+  index++;
+  foreach_mmb_bv_dim
+#undef _
+}
+
+/**
+ * rule_mask
+ *
+ * @return byte of the classifier mask of rule at offset of the ip header
+ */
+static_always_inline u8 rule_mask(mmb_rule_t *rule, u32 offset) {
+  u32 skip = rule->classify_skip * sizeof(u32x4);
+
+  if (offset < skip || offset - skip >= vec_len(rule->classify_mask))
+    return 0;
+  return rule->classify_mask[offset - skip];
+}
+
+static_always_inline u8 rule_key(mmb_rule_t *rule, u32 offset) {
+  u32 skip = rule->classify_skip * sizeof(u32x4);
+
+  if (offset < skip || offset - skip >= vec_len(rule->classify_key))
+    return 0;
+  return rule->classify_key[offset - skip] & rule_mask(rule, offset);
+}
+
+/**
+ * is_prefix_mask
+ *
+ * @return 1 if the mask of rule over field is leading ones then zeroes
+ */
+static int is_prefix_mask(mmb_rule_t *rule, mmb_bv_field_t *field) {
+  u32 index;
+  u8 mask, in_prefix = 1;
+
+  for (index = 0; index < field->width; index++) {
+    mask = rule_mask(rule, field->offset + index);
+    if (!in_prefix) {
+      if (mask)
+        return 0;
+      continue;
+    }
+    if (mask == 0xff)
+      continue;
+    /* ~mask must be 2^k - 1 */
+    if ((u8) ~mask & (u8) (~mask + 1))
+      return 0;
+    in_prefix = 0;
+  }
+  return 1;
+}
+
+int mmb_bv_rule_eligible(mmb_rule_t *rule) {
+  mmb_bv_field_t fields[MMB_BV_MAX_DIMS];
+  u32 offset, length, index;
+  u8 mask;
+
+  if (rule->in != ~0 || rule->out != ~0 || vec_len(rule->classify_mask) == 0)
+    return 0;
+
+  bv_fields(rule_tid(rule), fields);
+  length = rule->classify_skip * sizeof(u32x4) + vec_len(rule->classify_mask);
+  for (offset = 0; offset < length; offset++) {
+    mask = rule_mask(rule, offset);
+    /* ip version is implied by the node */
+    if (mask == 0 || (offset == 0 && (mask & 0x0f) == 0))
+      continue;
+
+    for (index = 0; index < MMB_BV_MAX_DIMS; index++) {
+      if (offset >= fields[index].offset
+          && offset < fields[index].offset + fields[index].width)
+        break;
+    }
+    if (index == MMB_BV_MAX_DIMS)
+      return 0;
+  }
+
+  for (index = 0; index < MMB_BV_MAX_DIMS; index++) {
+    if (fields[index].width > 1 && !is_prefix_mask(rule, &fields[index]))
+      return 0;
+  }
+  return 1;
+}
+
+static u32 bv_row(mmb_bv_rows_t *rows, u64 *bits) {
+  uword *p = hash_get_mem(rows->row_by_bits, bits);
+  u64 *row;
+
+  if (p)
+    return p[0];
+
+  row = vec_dup(bits);
+  vec_add1(rows->rows, row);
+  hash_set_mem(rows->row_by_bits, row, vec_len(rows->rows)-1);
+  return vec_len(rows->rows)-1;
+}
+
+static_always_inline void bv_set(u64 *bits, u32 bit, int is_set) {
+  if (is_set)
+    bits[bit / 64] |= 1ULL << (bit % 64);
+  else
+    bits[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+static void bv_build_direct(mmb_bv_dim_t *dim, mmb_rule_t *rules,
+                            u32 *rule_indexes, mmb_bv_rows_t *rows,
+                            u64 *bits) {
+  mmb_rule_t *rule;
+  u32 value, bit;
+
+  vec_validate(dim->row_by_interval, 255);
+  for (value = 0; value < 256; value++) {
+    memset(bits, 0, vec_bytes(bits));
+    vec_foreach_index(bit, rule_indexes) {
+      rule = &rules[rule_indexes[bit]];
+      if ((value & rule_mask(rule, dim->offset))
+          == rule_key(rule, dim->offset))
+        bv_set(bits, bit, 1);
+    }
+    dim->row_by_interval[value] = bv_row(rows, bits);
+  }
+}
+
+static int bv_event_cmp(void *a, void *b) {
+  mmb_bv_event_t *ea = a, *eb = b;
+
+  return memcmp(ea->point, eb->point, sizeof(ea->point));
+}
+
+static void bv_build_range(mmb_bv_dim_t *dim, mmb_rule_t *rules,
+                           u32 *rule_indexes, mmb_bv_rows_t *rows,
+                           u64 *bits) {
+  mmb_bv_event_t *events = 0, *event, *next;
+  u8 zero[MMB_BV_MAX_WIDTH], *last;
+  mmb_rule_t *rule;
+  u32 bit, index, row;
+  int carry;
+
+  /* rule accepts [lo, hi]: added at lo, removed at hi + 1 */
+  vec_foreach_index(bit, rule_indexes) {
+    rule = &rules[rule_indexes[bit]];
+    vec_add2(events, event, 2);
+    memset(event, 0, 2 * sizeof(mmb_bv_event_t));
+    event[0].bit = event[1].bit = bit;
+    event[0].is_add = 1;
+    for (index = 0; index < dim->width; index++) {
+      event[0].point[index] = rule_key(rule, dim->offset + index);
+      event[1].point[index] = event[0].point[index]
+                              | (u8) ~rule_mask(rule, dim->offset + index);
+    }
+    for (index = dim->width, carry = 1; index > 0 && carry; index--)
+      carry = ++event[1].point[index-1] == 0;
+    if (carry) /* hi is the largest value */
+      _vec_len(events)--;
+  }
+  vec_sort_with_function(events, bv_event_cmp);
+
+  memset(bits, 0, vec_bytes(bits));
+  memset(zero, 0, sizeof(zero));
+  vec_add(dim->starts, zero, dim->width);
+  vec_add1(dim->row_by_interval, bv_row(rows, bits));
+
+  for (event = events; event < vec_end(events); event = next) {
+    for (next = event; next < vec_end(events)
+         && bv_event_cmp(next, event) == 0; next++)
+      bv_set(bits, next->bit, next->is_add);
+
+    row = bv_row(rows, bits);
+    last = vec_end(dim->starts) - dim->width;
+    if (memcmp(last, event->point, dim->width) == 0)
+      dim->row_by_interval[vec_len(dim->row_by_interval)-1] = row;
+    else if (row != dim->row_by_interval[vec_len(dim->row_by_interval)-1]) {
+      vec_add(dim->starts, event->point, dim->width);
+      vec_add1(dim->row_by_interval, row);
+    }
+  }
+  vec_free(events);
+}
+
+static mmb_bv_t *bv_create(mmb_rule_t *rules, u32 *rule_indexes, u32 tid) {
+  mmb_bv_field_t fields[MMB_BV_MAX_DIMS];
+  mmb_bv_t *bv = clib_mem_alloc(sizeof(mmb_bv_t));
+  mmb_bv_rows_t rows;
+  mmb_bv_dim_t *dim;
+  u64 *bits = 0, **row;
+  u32 index, bit, *rule_index;
+
+  memset(bv, 0, sizeof(mmb_bv_t));
+  memset(&rows, 0, sizeof(rows));
+  rows.row_by_bits = hash_create_vec(0, sizeof(u64), sizeof(uword));
+  bv->rule_indexes = rule_indexes;
+  bv->word_count = 2 * ((vec_len(rule_indexes) + 127) / 128);
+  vec_validate(bits, bv->word_count - 1);
+
+  vec_foreach_index(bit, rule_indexes) {
+    bv_set(bits, bit, 1);
+  }
+  bv->all_row = bv_row(&rows, bits);
+
+  bv_fields(tid, fields);
+  for (index = 0; index < MMB_BV_MAX_DIMS; index++) {
+    /* only fields some rule constrains */
+    vec_foreach(rule_index, rule_indexes) {
+      for (bit = 0; bit < fields[index].width; bit++) {
+        if (rule_mask(&rules[*rule_index], fields[index].offset + bit))
+          break;
+      }
+      if (bit < fields[index].width)
+        break;
+    }
+    if (rule_index == vec_end(rule_indexes))
+      continue;
+
+    vec_add2(bv->dims, dim, 1);
+    dim->offset = fields[index].offset;
+    dim->width = fields[index].width;
+    if (dim->width == 1)
+      bv_build_direct(dim, rules, rule_indexes, &rows, bits);
+    else
+      bv_build_range(dim, rules, rule_indexes, &rows, bits);
+  }
+
+  bv->row_count = vec_len(rows.rows);
+  vec_validate_aligned(bv->rows, bv->row_count * bv->word_count - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  vec_foreach(row, rows.rows) {
+    clib_memcpy(bv->rows + (row - rows.rows) * bv->word_count, *row,
+                bv->word_count * sizeof(u64));
+  }
+
+  hash_free(rows.row_by_bits);
+  vec_foreach(row, rows.rows) {
+    vec_free(*row);
+  }
+  vec_free(rows.rows);
+  vec_free(bits);
+  return bv;
+}
+
+void mmb_bv_build(mmb_rule_t *rules, int all,
+                  mmb_bv_t *bv[MMB_CLASSIFY_N_TABLES]) {
+  u32 *rule_indexes[MMB_CLASSIFY_N_TABLES];
+  mmb_rule_t *rule;
+  u32 tid;
+
+  memset(rule_indexes, 0, sizeof(rule_indexes));
+  vec_foreach(rule, rules) {
+    if (all ? rule->lpm || !mmb_bv_rule_eligible(rule) : !rule->bitvector)
+      continue;
+    vec_add1(rule_indexes[rule_tid(rule)], rule - rules);
+  }
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++)
+    bv[tid] = vec_len(rule_indexes[tid])
+              ? bv_create(rules, rule_indexes[tid], tid) : 0;
+}
+
+void mmb_bv_free(mmb_bv_t *bv) {
+  mmb_bv_dim_t *dim;
+
+  if (bv == 0)
+    return;
+
+  vec_foreach(dim, bv->dims) {
+    vec_free(dim->starts);
+    vec_free(dim->row_by_interval);
+  }
+  vec_free(bv->dims);
+  vec_free(bv->rows);
+  vec_free(bv->rule_indexes);
+  clib_mem_free(bv);
+}
+
+u8 *mmb_format_bv(u8 *s, va_list *args) {
+  mmb_bv_t *bv = va_arg(*args, mmb_bv_t*);
+  mmb_bv_dim_t *dim;
+  u64 bytes;
+
+  if (bv == 0)
+    return format(s, "empty");
+
+  bytes = vec_bytes(bv->rows);
+  vec_foreach(dim, bv->dims) {
+    bytes += vec_bytes(dim->starts) + vec_bytes(dim->row_by_interval);
+  }
+
+  s = format(s, "%u rules, %u rows of %u bits, %U",
+             vec_len(bv->rule_indexes), bv->row_count, bv->word_count * 64,
+             format_memory_size, bytes);
+  vec_foreach(dim, bv->dims) {
+    s = format(s, "\n  offset %u: %u %s", dim->offset,
+               vec_len(dim->row_by_interval),
+               dim->width == 1 ? "values" : "intervals");
+  }
+  return s;
+}
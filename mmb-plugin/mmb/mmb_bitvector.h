@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * bit vector classifier.
+ *
+ * Each header field (protocol, addresses, ports, tcp flags) is indexed on
+ * its own: the value of the field selects a row, the bitmap of the rules
+ * accepting that value. A packet matches the rules of the AND of the rows
+ * of every field. One-byte fields select their row directly, wider fields
+ * by binary search of the elementary intervals bounded by the prefixes of
+ * the rules. Identical rows are stored once.
+ */
+
+#ifndef __included_mmb_bitvector_h__
+#define __included_mmb_bitvector_h__
+
+#include <vppinfra/vec.h>
+#include <vppinfra/hash.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_classify.h>
+
+#define MMB_BV_MAX_DIMS 6
+#define MMB_BV_MAX_WIDTH 16
+
+/* field, ip4 offset, ip6 offset, width in bytes (0: address width) */
+#define foreach_mmb_bv_dim           \
+  _(PROTO,     9,  6,  1)            \
+  _(SADDR,    12,  8,  0)            \
+  _(DADDR,    16, 24,  0)            \
+  _(SPORT,    20, 40,  2)            \
+  _(DPORT,    22, 42,  2)            \
+  _(TCP_FLAGS, 33, 53, 1)
+
+typedef struct {
+  u8 offset; /*! in the ip header */
+  u8 width; /*! bytes, 1 for a direct index */
+  u8 *starts; /*! interval starts, width bytes each, ascending */
+  u32 *row_by_interval; /*! row of each interval, of each value if width 1 */
+} mmb_bv_dim_t;
+
+typedef struct {
+  mmb_bv_dim_t *dims; /*! fields constrained by at least one rule */
+  u64 *rows; /*! row_count x word_count bits, aligned */
+  u32 word_count; /*! even */
+  u32 row_count;
+  u32 all_row; /*! row of every rule */
+  u32 *rule_indexes; /*! rule index of each bit */
+} mmb_bv_t;
+
+/**
+ * mmb_bv_rule_eligible
+ *
+ * @return 1 if the classifier mask of rule only covers fields indexed by
+ *         the bit vector classifier, with prefix masks on wide fields
+ */
+int mmb_bv_rule_eligible(mmb_rule_t *rule);
+
+/**
+ * mmb_bv_build
+ *
+ * build bit vector classifiers by address family.
+ * @param all index every eligible rule instead of rules flagged bitvector
+ */
+void mmb_bv_build(mmb_rule_t *rules, int all,
+                  mmb_bv_t *bv[MMB_CLASSIFY_N_TABLES]);
+
+void mmb_bv_free(mmb_bv_t *bv);
+
+u8 *mmb_format_bv(u8 *s, va_list *args);
+
+static_always_inline u32 mmb_bv_dim_row(mmb_bv_dim_t *dim, u8 *h0) {
+  u8 *value = h0 + dim->offset;
+  u32 low = 0, high, middle;
+
+  if (dim->width == 1)
+    return dim->row_by_interval[value[0]];
+
+  /* last interval starting at or before value */
+  high = vec_len(dim->row_by_interval) - 1;
+  while (low < high) {
+    middle = (low + high + 1) / 2;
+    if (memcmp(dim->starts + middle * dim->width, value, dim->width) <= 0)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return dim->row_by_interval[low];
+}
+
+/**
+ * mmb_bv_lookup
+ *
+ * append indexes of the rules matching header h0 to rule_indexes
+ */
+static_always_inline void mmb_bv_lookup(mmb_bv_t *bv, u8 *h0,
+                                        u32 **rule_indexes) {
+  u64 *rows[MMB_BV_MAX_DIMS];
+  u32 dim_index, dim_count = vec_len(bv->dims), word, bit;
+  u64 *all = bv->rows + bv->all_row * bv->word_count, bits;
+
+  for (dim_index = 0; dim_index < dim_count; dim_index++)
+    rows[dim_index] = bv->rows + bv->word_count
+                      * mmb_bv_dim_row(&bv->dims[dim_index], h0);
+
+  for (word = 0; word < bv->word_count; word += 2) {
+#ifdef CLIB_HAVE_VEC128
+    u64x2 acc = *(u64x2 *) (all + word);
+    for (dim_index = 0; dim_index < dim_count; dim_index++)
+      acc &= *(u64x2 *) (rows[dim_index] + word);
+    if ((acc[0] | acc[1]) == 0)
+      continue;
+    u64 words[2] = { acc[0], acc[1] };
+#else
+    u64 words[2] = { all[word], all[word+1] };
+    for (dim_index = 0; dim_index < dim_count; dim_index++) {
+      words[0] &= rows[dim_index][word];
+      words[1] &= rows[dim_index][word+1];
+    }
+    if ((words[0] | words[1]) == 0)
+      continue;
+#endif
+    for (bit = 0; bit < 2; bit++) {
+      bits = words[bit];
+      while (bits) {
+        vec_add1(*rule_indexes,
+                 bv->rule_indexes[(word + bit) * 64 + count_trailing_zeros(bits)]);
+        bits &= bits - 1;
+      }
+    }
+  }
+}
+
+#endif /* __included_mmb_bitvector_h__ */
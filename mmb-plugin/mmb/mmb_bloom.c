@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Bloom filters of classifier sessions.
+ */
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_classify.h>
+#include <mmb/mmb_bloom.h>
+
+static void bloom_add(mmb_bloom_t *bloom, u64 hash) {
+  u64 mixed = mmb_bloom_mix(hash);
+  mmb_bloom_block_t *block = mmb_bloom_block(bloom, mixed);
+  u32 index, bit;
+
+  for (index = 0; index < MMB_BLOOM_K; index++) {
+    bit = (mixed >> (9 * index)) & (MMB_BLOOM_BLOCK_BITS - 1);
+    block->words[bit / 64] |= 1ULL << (bit % 64);
+  }
+}
+
+/**
+ * bloom_fp_rate
+ *
+ * @return probability that a key not in the filter hits it
+ */
+static f64 bloom_fp_rate(mmb_bloom_t *bloom) {
+  mmb_bloom_block_t *block;
+  f64 rate = 0, fill;
+  u32 index, bits;
+
+  vec_foreach(block, bloom->blocks) {
+    bits = 0;
+    for (index = 0; index < ARRAY_LEN(block->words); index++)
+      bits += count_set_bits(block->words[index]);
+    fill = (f64) bits / MMB_BLOOM_BLOCK_BITS;
+    rate += fill * fill * fill * fill;
+  }
+  return rate / vec_len(bloom->blocks);
+}
+
+static mmb_bloom_t *bloom_create(mmb_table_t *table) {
+  mmb_bloom_t *bloom = clib_mem_alloc(sizeof(mmb_bloom_t));
+  u32 keys = clib_max(pool_elts(table->sessions), 1);
+  u32 blocks = (keys * MMB_BLOOM_BITS_PER_KEY + MMB_BLOOM_BLOCK_BITS - 1)
+               / MMB_BLOOM_BLOCK_BITS;
+
+  memset(bloom, 0, sizeof(mmb_bloom_t));
+  bloom->log2_blocks = max_log2(blocks);
+  vec_validate_aligned(bloom->blocks, (1 << bloom->log2_blocks) - 1,
+                       CLIB_CACHE_LINE_BYTES);
+  return bloom;
+}
+
+/**
+ * bloom_table
+ *
+ * @return classifier table of table, NULL if it is not in the classifier
+ */
+static vnet_classify_table_t *bloom_table(mmb_main_t *mm,
+                                          mmb_table_t *table) {
+  vnet_classify_main_t *vcm = mm->mmb_classify_main->vnet_classify_main;
+
+  if (table->index == ~0 || pool_is_free_index(vcm->tables, table->index))
+    return 0;
+  return pool_elt_at_index(vcm->tables, table->index);
+}
+
+/**
+ * bloom_hash
+ *
+ * @return classifier hash of a session key, hashed as a packet from an
+ *         aligned copy
+ */
+static u64 bloom_hash(vnet_classify_table_t *t, u8 **scratch, u8 *key) {
+  vec_validate_aligned(*scratch, vec_len(key) - 1, sizeof(u32x4));
+  clib_memcpy(*scratch, key, vec_len(key));
+  return vnet_classify_hash_packet(t, *scratch);
+}
+
+mmb_bloom_t *mmb_bloom_build_table(mmb_main_t *mm, mmb_table_t *table) {
+  vnet_classify_table_t *t = bloom_table(mm, table);
+  mmb_session_t *session;
+  mmb_bloom_t *bloom;
+  u8 *key = 0;
+
+  if (t == 0)
+    return 0;
+
+  bloom = bloom_create(table);
+  pool_foreach(session, table->sessions, ({
+    bloom_add(bloom, bloom_hash(t, &key, session->key));
+    bloom->key_count++;
+  }));
+
+  vec_free(key);
+  return bloom;
+}
+
+mmb_bloom_t **mmb_bloom_build(mmb_main_t *mm) {
+  mmb_bloom_t **blooms = 0, *bloom;
+  mmb_table_t *table;
+
+  vec_foreach(table, mm->tables) {
+    bloom = mmb_bloom_build_table(mm, table);
+    if (bloom == 0)
+      continue;
+
+    vec_validate(blooms, table->index);
+    blooms[table->index] = bloom;
+  }
+  return blooms;
+}
+
+int mmb_bloom_add_key(mmb_main_t *mm, mmb_bloom_t *bloom,
+                      mmb_table_t *table, u8 *key) {
+  vnet_classify_table_t *t = bloom_table(mm, table);
+  u8 *scratch = 0;
+
+  if (t == 0 || (u64) (bloom->key_count + 1) * MMB_BLOOM_MIN_BITS_PER_KEY
+                > (u64) vec_len(bloom->blocks) * MMB_BLOOM_BLOCK_BITS)
+    return 0;
+
+  bloom_add(bloom, bloom_hash(t, &scratch, key));
+  bloom->key_count++;
+  vec_free(scratch);
+  return 1;
+}
+
+void mmb_bloom_free(mmb_bloom_t *bloom) {
+  if (bloom == 0)
+    return;
+  vec_free(bloom->blocks);
+  clib_mem_free(bloom);
+}
+
+u8 *mmb_format_bloom(u8 *s, va_list *args) {
+  mmb_bloom_t *bloom = va_arg(*args, mmb_bloom_t*);
+
+  return format(s, "%u keys, %u blocks (%U), expected false positives %.3f%%",
+                bloom->key_count, vec_len(bloom->blocks),
+                format_memory_size, vec_bytes(bloom->blocks),
+                bloom_fp_rate(bloom) * 100);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Bloom filters of classifier sessions.
+ *
+ * One filter per classifier table, over the classifier hash of the masked
+ * key of each session. A filter is made of cache line sized blocks: a key
+ * sets MMB_BLOOM_K bits of a single block, so a probe reads one cache line,
+ * and a packet whose hash misses the filter does not touch the table.
+ *
+ * Bits are only ever set: sessions added to a table set their bits in the
+ * published filter, which data plane threads keep reading, until the filter
+ * holds MMB_BLOOM_MIN_BITS_PER_KEY bits per key and is rebuilt larger.
+ */
+
+#ifndef __included_mmb_bloom_h__
+#define __included_mmb_bloom_h__
+
+#include <vppinfra/vec.h>
+#include <vnet/classify/vnet_classify.h>
+#include <mmb/mmb.h>
+
+#define MMB_BLOOM_K 4
+#define MMB_BLOOM_BLOCK_BITS 512
+#define MMB_BLOOM_BITS_PER_KEY 16
+#define MMB_BLOOM_MIN_BITS_PER_KEY 8
+
+typedef struct {
+  u64 words[MMB_BLOOM_BLOCK_BITS / 64];
+} mmb_bloom_block_t;
+
+typedef struct {
+  mmb_bloom_block_t *blocks; /*! power of 2 blocks, cache line aligned */
+  u32 log2_blocks;
+  u32 key_count;
+} mmb_bloom_t;
+
+/**
+ * mmb_bloom_build
+ *
+ * build filters of the classifier tables of mm, indexed by classifier
+ * table index.
+ */
+mmb_bloom_t **mmb_bloom_build(mmb_main_t *mm);
+
+/**
+ * mmb_bloom_build_table
+ *
+ * @return filter of the sessions of table, NULL if table is not in the
+ *         classifier
+ */
+mmb_bloom_t *mmb_bloom_build_table(mmb_main_t *mm, mmb_table_t *table);
+
+/**
+ * mmb_bloom_add_key
+ *
+ * set the bits of a session key of table in its filter.
+ * @return 0 if the filter is full and must be rebuilt
+ */
+int mmb_bloom_add_key(mmb_main_t *mm, mmb_bloom_t *bloom,
+                      mmb_table_t *table, u8 *key);
+
+void mmb_bloom_free(mmb_bloom_t *bloom);
+
+u8 *mmb_format_bloom(u8 *s, va_list *args);
+
+static_always_inline u64 mmb_bloom_mix(u64 hash) {
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static_always_inline mmb_bloom_block_t *mmb_bloom_block(mmb_bloom_t *bloom,
+                                                        u64 mixed) {
+  if (bloom->log2_blocks == 0)
+    return bloom->blocks;
+  return &bloom->blocks[mixed >> (64 - bloom->log2_blocks)];
+}
+
+/**
+ * mmb_bloom_maybe
+ *
+ * @param hash classifier hash of the packet for the table of the filter
+ * @return 0 if no session of the table can match, 1 otherwise
+ */
+static_always_inline int mmb_bloom_maybe(mmb_bloom_t *bloom, u64 hash) {
+  u64 mixed = mmb_bloom_mix(hash);
+  mmb_bloom_block_t *block = mmb_bloom_block(bloom, mixed);
+  u32 index, bit;
+
+  for (index = 0; index < MMB_BLOOM_K; index++) {
+    bit = (mixed >> (9 * index)) & (MMB_BLOOM_BLOCK_BITS - 1);
+    if (!(block->words[bit / 64] & (1ULL << (bit % 64))))
+      return 0;
+  }
+  return 1;
+}
+
+#endif /* __included_mmb_bloom_h__ */
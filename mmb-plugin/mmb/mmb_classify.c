@@ -27,6 +27,10 @@
 #include <mmb/mmb_classify.h>
 #include <mmb/mmb.h>
 #include <mmb/mmb_opts.h>
+#include <mmb/mmb_headers.h>
+#include <mmb/mmb_runtime.h>
+#include <mmb/mmb_lpm.h>
+#include <mmb/mmb_ipset.h>
 
 typedef struct {
   u32 sw_if_index;
@@ -72,7 +76,9 @@ static u8 *format_mmb_classify_trace(u8 * s, va_list * args)
 #define foreach_mmb_classify_error                 \
 _(MISS, "Flow classify misses")                     \
 _(HIT, "Flow classify hits")                        \
-_(DROP, "Flow classify action drop")
+_(DROP, "Flow classify action drop")                \
+_(REFUSED, "Connections refused, table full")       \
+_(EVICTED, "Connections evicted, table full")
 
 typedef enum {
 #define _(sym,str) MMB_CLASSIFY_ERROR_##sym,
@@ -199,22 +205,27 @@ static inline int mmb_match_opt(mmb_match_t *match, mmb_tcp_options_t *options)
 }
 
 static inline int mmb_match_opts(mmb_rule_t *rule, u8 *p0, 
-                       mmb_tcp_options_t *tcpo0, u8 *tcpo0_flag, u8 is_ip6) {
+                       mmb_headers_t *hdr0, mmb_tcp_options_t *tcpo0, 
+                       u8 *tcpo0_flag) {
 
    mmb_match_t *opt_matches = rule->opt_matches, *match;
-   
-   if (*tcpo0_flag == 0) { /* parse options */
-      tcp_header_t *tcph;
-      if (is_ip6)
-         tcph = ip6_next_header((ip6_header_t*)p0);
-      else
-         tcph = ip4_next_header((ip4_header_t*)p0);
-      mmb_parse_tcp_options(tcph, tcpo0);
-      *tcpo0_flag = 1;
-   }
 
-   /* match */
    vec_foreach(match, opt_matches) {
+      if (match->field != MMB_FIELD_TCP_OPT) { /* ip6 extension header */
+         if (!mmb_true_condition(mmb_headers_has_eh(hdr0, 
+                                    match->field == MMB_FIELD_IP6_EH 
+                                       ? ~0 : match->opt_kind),
+                                 match->reverse))
+            return 0;
+         continue;
+      }
+
+      if (*tcpo0_flag == 0) { /* parse options */
+         if (!hdr0->l4_valid || hdr0->l4_proto != IP_PROTOCOL_TCP)
+            return 0;
+         mmb_parse_tcp_options((tcp_header_t*)(p0 + hdr0->l4_offset), tcpo0);
+         *tcpo0_flag = 1;
+      }
       if (!mmb_match_opt(match, tcpo0))
          return 0;
    }
@@ -228,6 +239,189 @@ static_always_inline int random_drop(mmb_main_t *mm, u32 drop_rate) {
    return random_value < drop_rate;
 }
 
+/**
+ * mmb_match_deep
+ *
+ * second stage of rules matching payload values past the classifier mask,
+ * for packets the mask already matched.
+ * @param len0 bytes of the packet from h0
+ */
+static_always_inline int mmb_match_deep(mmb_rule_t *rule, u8 *h0, u32 len0,
+                                        mmb_headers_t *hdr0) {
+   mmb_deep_t *deep;
+   u32 offset;
+
+   vec_foreach(deep, rule->deep_matches) {
+      offset = mmb_deep_offset(deep, hdr0, h0, len0);
+      if (offset == ~0 || offset + vec_len(deep->value) > len0
+          || memcmp(h0 + offset, deep->value, vec_len(deep->value)))
+         return 0;
+   }
+   return 1;
+}
+
+/**
+ * mmb_match_rules
+ *
+ * sort matched rules into stateless matches and stateful openers.
+ * @param next next node of the classifier session, ~0 to use the one of
+ *             each rule
+ */
+static_always_inline void mmb_match_rules(mmb_main_t *mm, mmb_runtime_t *rt,
+                       u32 *rule_indexes0, u32 next, u8 *h0, u32 len0,
+                       mmb_headers_t *hdr0, mmb_payload_scan_t *scan0,
+                       mmb_tcp_options_t *tcpo0, u8 *tcpo0_flag, u8 is_ip6,
+                       u32 **matches, u32 **matches_opener, 
+                       u32 **matches_shuffle, u32 *next0) {
+   mmb_rule_t *rule;
+   u32 *rule_index;
+
+   vec_foreach(rule_index, rule_indexes0) {
+
+      rule = mmb_runtime_rule(rt, *rule_index);
+      if (PREDICT_FALSE(rule == 0))
+         continue;
+      if (rule->opts_in_matches 
+          && !mmb_match_opts(rule, h0, hdr0, tcpo0, tcpo0_flag))
+         continue;
+      if (rule->ipset_matches && !mmb_ipset_match(rule, h0))
+         continue;
+      if (rule->deep_matches && !mmb_match_deep(rule, h0, len0, hdr0))
+         continue;
+      if (rule->payload_matches 
+          && !mmb_payload_match(rt->payload, rule, *rule_index, scan0, 
+                                h0, len0, hdr0, is_ip6))
+         continue;
+
+      if (rule->stateful == 0) { /* stateless */
+         vec_add1(*matches, *rule_index);
+         if (rule->drop_rate == 0 
+             || rule->drop_rate == MMB_MAX_DROP_RATE_VALUE
+             || random_drop(mm, rule->drop_rate))
+            *next0 = next != ~0 ? next : next_if_match(rule);
+      } else { 
+         if (rule->shuffle == 0) { /* stateful */
+            vec_add1(*matches_opener, *rule_index);
+         } else { /* stateful + seed */
+            vec_add1(*matches_shuffle, *rule_index);
+         }
+      }
+
+      rule->match_count++;
+   }
+}
+
+/**
+ * mmb_match_lpm
+ *
+ * @return rules whose address prefix covers the address of h0 in the given
+ *         direction, NULL if none
+ */
+static_always_inline u32 *mmb_match_lpm(mmb_runtime_t *rt, u8 *h0,
+                                        mmb_classify_table_id_t tid,
+                                        mmb_lpm_dir_t dir) {
+   mmb_lpm_t *lpm = rt->lpm[tid][dir];
+   u8 *addr;
+
+   if (lpm == 0)
+      return 0;
+
+   if (tid == MMB_CLASSIFY_TABLE_IP4)
+      addr = dir == MMB_LPM_SRC 
+             ? ((ip4_header_t *) h0)->src_address.as_u8
+             : ((ip4_header_t *) h0)->dst_address.as_u8;
+   else
+      addr = dir == MMB_LPM_SRC 
+             ? ((ip6_header_t *) h0)->src_address.as_u8
+             : ((ip6_header_t *) h0)->dst_address.as_u8;
+
+   return mmb_lpm_lookup(lpm, addr);
+}
+
+static_always_inline u32 mmb_classify_table_index(mmb_classify_main_t *mcm,
+                                                  mmb_classify_table_id_t tid,
+                                                  u32 sw_if_index) {
+   if (sw_if_index >= vec_len(mcm->classify_table_index_by_sw_if_index[tid]))
+      return ~0;
+   return mcm->classify_table_index_by_sw_if_index[tid][sw_if_index];
+}
+
+/**
+ * mmb_classify_find_entry
+ *
+ * look a packet up in a classifier table, unless the filter of the table
+ * rules out every session.
+ */
+static_always_inline vnet_classify_entry_t *
+mmb_classify_find_entry(mmb_runtime_t *rt, vnet_classify_table_t *t0,
+                        u32 table_index0, u8 *h0, u64 hash0, f64 now,
+                        u32 *bloom_negatives, u32 *bloom_false_positives) {
+   mmb_bloom_t *bloom = mmb_runtime_bloom(rt, table_index0);
+   vnet_classify_entry_t *e0;
+
+   if (bloom && !mmb_bloom_maybe(bloom, hash0)) {
+      (*bloom_negatives)++;
+      return 0;
+   }
+
+   e0 = vnet_classify_find_entry(t0, h0, hash0, now);
+   if (bloom && e0 == 0)
+      (*bloom_false_positives)++;
+   return e0;
+}
+
+/**
+ * mmb_classify_dispatch
+ *
+ * @return first table of the chain from table_index0 whose sessions may
+ *         match the family and protocol class l4_bit0, ~0 if none
+ */
+static_always_inline u32
+mmb_classify_dispatch(mmb_runtime_t *rt, vnet_classify_main_t *vcm,
+                      u32 table_index0, u8 l4_bit0) {
+   while (table_index0 != ~0 
+          && !mmb_runtime_l4_maybe(rt, table_index0, l4_bit0))
+      table_index0 = pool_elt_at_index(vcm->tables, 
+                                       table_index0)->next_table_index;
+   return table_index0;
+}
+
+/**
+ * mmb_classify_conn_opener
+ *
+ * @return 1 if a packet missing a connection opens one: it matched
+ *         stateful rules, and is neither an icmp error nor a non-first
+ *         fragment, whose ports only come from the fragment cache
+ */
+static_always_inline int 
+mmb_classify_conn_opener(mmb_5tuple_t *pkt_5tuple, u32 *matches_opener,
+                         u32 *matches_shuffle) {
+  return (vec_len(matches_opener) != 0 || vec_len(matches_shuffle) != 0)
+         && !pkt_5tuple->pkt_info.is_quoted_packet
+         && !pkt_5tuple->pkt_info.is_nonfirst_fragment;
+}
+
+/**
+ * mmb_classify_conn_found
+ *
+ * track a packet of connection conn_id, the rules of the connection apply.
+ * A quoted packet does not make the connection active but references it,
+ * so that it is not evicted while the packet is handled.
+ */
+static_always_inline void 
+mmb_classify_conn_found(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple,
+                        mmb_conn_id_t *conn_id, u64 now, u32 *rule_set, 
+                        u32 *next) {
+  mmb_conn_t *conn = pool_elt_at_index(mct->conn_pool, conn_id->conn_index);
+
+  mmb_reference_conn(conn, now);
+  if (!pkt_5tuple->pkt_info.is_quoted_packet)
+     mmb_track_conn(conn, pkt_5tuple, conn_id->dir, now);
+  *rule_set = conn->rule_set;
+  if (*next == MMB_CLASSIFY_NEXT_INDEX_MISS)
+     *next = MMB_CLASSIFY_NEXT_INDEX_MATCH;
+}
+
 static inline uword
 mmb_classify_inline(vlib_main_t * vm,
                      vlib_node_runtime_t * node,
@@ -241,18 +435,44 @@ mmb_classify_inline(vlib_main_t * vm,
   vnet_classify_main_t *vcm = mcm->vnet_classify_main;
   mmb_conn_table_t *mct = mm->mmb_conn_table;
 
-  mmb_rule_t *rules = mm->rules;
-  mmb_lookup_entry_t *lookup_pool = mm->lookup_pool, *lookup_entry;
-  u32 *rule_index; 
+  u32 thread_index = vlib_get_thread_index();
+  mmb_runtime_t *rt = mmb_runtime_enter(thread_index);
+  mmb_runtime_thread_t *pt = rt ? vec_elt_at_index(
+                                 mmb_runtime_main.per_thread, thread_index)
+                                : 0;
+  u32 to_rewrite = 0; 
   f64 now = vlib_time_now(vm);
   u64 now_ticks = clib_cpu_time_now();
    
   u32 hits = 0;
   u32 drop = 0;
+  u32 refused = 0, evicted = 0;
+  u32 bloom_negatives = 0, bloom_false_positives = 0;
+  u32 *bv_rule_indexes = pt ? pt->bv_rule_indexes : 0;
+  mmb_payload_scan_t scan0 = { 0 };
+
+  /* per packet state of the frame, between passes */
+  mmb_5tuple_t pkt_5tuples[VLIB_FRAME_SIZE];
+  mmb_conn_id_t conn_ids[VLIB_FRAME_SIZE];
+  u64 conn_hashes[VLIB_FRAME_SIZE];
+  u32 *matches_opener[VLIB_FRAME_SIZE], *matches_shuffle[VLIB_FRAME_SIZE];
+  u32 nexts[VLIB_FRAME_SIZE], rule_sets[VLIB_FRAME_SIZE];
+  u32 missed[VLIB_FRAME_SIZE];
+  u32 i, j, n_missed, n_openers, n_added;
+  mmb_conn_add_result_t added;
+  int is_stateful;
 
   mmb_tcp_options_t tcpo0;
   init_tcp_options(&tcpo0);
 
+  if (rt && rt->payload) {
+    /* counters of patterns added since the last frame, only this thread
+     * writes them */
+    if (PREDICT_FALSE(vec_len(pt->pattern_hits) < rt->payload->n_ids))
+      vec_validate(pt->pattern_hits, rt->payload->n_ids - 1);
+    scan0.pattern_hits = pt->pattern_hits;
+  }
+
   from = vlib_frame_vector_args(frame);
   n_left_from = frame->n_vectors;
 
@@ -288,21 +508,30 @@ mmb_classify_inline(vlib_main_t * vm,
       h1 = vlib_buffer_get_current(b1);
 
       sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
-      table_index0 = mcm->classify_table_index_by_sw_if_index[tid][sw_if_index0];
+      table_index0 = mmb_classify_dispatch(rt, vcm,
+                        mmb_classify_table_index(mcm, tid, sw_if_index0),
+                        mmb_classify_packet_l4_bit(tid, h0));
 
       sw_if_index1 = vnet_buffer(b1)->sw_if_index[VLIB_RX];
-      table_index1 = mcm->classify_table_index_by_sw_if_index[tid][sw_if_index1];
-
-      t0 = pool_elt_at_index(vcm->tables, table_index0);
-      t1 = pool_elt_at_index(vcm->tables, table_index1);
-
-      vnet_buffer(b0)->l2_classify.hash =
-        vnet_classify_hash_packet(t0, (u8 *) h0);
-      vnet_classify_prefetch_bucket(t0, vnet_buffer(b0)->l2_classify.hash);
+      table_index1 = mmb_classify_dispatch(rt, vcm,
+                        mmb_classify_table_index(mcm, tid, sw_if_index1),
+                        mmb_classify_packet_l4_bit(tid, h1));
+
+      /* no table when all rules are matched by lpm, or none of them
+       * by the classifier matches the protocol of the packet */
+      if (PREDICT_TRUE(table_index0 != ~0)) {
+        t0 = pool_elt_at_index(vcm->tables, table_index0);
+        vnet_buffer(b0)->l2_classify.hash =
+          vnet_classify_hash_packet(t0, (u8 *) h0);
+        vnet_classify_prefetch_bucket(t0, vnet_buffer(b0)->l2_classify.hash);
+      }
 
-      vnet_buffer(b1)->l2_classify.hash =
-        vnet_classify_hash_packet(t1, (u8 *) h1);
-      vnet_classify_prefetch_bucket(t1, vnet_buffer(b1)->l2_classify.hash);
+      if (PREDICT_TRUE(table_index1 != ~0)) {
+        t1 = pool_elt_at_index(vcm->tables, table_index1);
+        vnet_buffer(b1)->l2_classify.hash =
+          vnet_classify_hash_packet(t1, (u8 *) h1);
+        vnet_classify_prefetch_bucket(t1, vnet_buffer(b1)->l2_classify.hash);
+      }
 
       vnet_buffer(b0)->l2_classify.table_index = table_index0;
       vnet_buffer(b1)->l2_classify.table_index = table_index1;
@@ -325,20 +554,23 @@ mmb_classify_inline(vlib_main_t * vm,
      h0 = vlib_buffer_get_current(b0);
 
      sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
-     table_index0 = mcm->classify_table_index_by_sw_if_index[tid][sw_if_index0];
-
-     t0 = pool_elt_at_index(vcm->tables, table_index0);
-     vnet_buffer(b0)->l2_classify.hash =
-        vnet_classify_hash_packet(t0,(u8 *) h0);
+     table_index0 = mmb_classify_dispatch(rt, vcm,
+                       mmb_classify_table_index(mcm, tid, sw_if_index0),
+                       mmb_classify_packet_l4_bit(tid, h0));
+
+     if (PREDICT_TRUE(table_index0 != ~0)) {
+       t0 = pool_elt_at_index(vcm->tables, table_index0);
+       vnet_buffer(b0)->l2_classify.hash =
+          vnet_classify_hash_packet(t0,(u8 *) h0);
+       vnet_classify_prefetch_bucket(t0, vnet_buffer(b0)->l2_classify.hash);
+     }
 
      vnet_buffer(b0)->l2_classify.table_index = table_index0;
-     vnet_classify_prefetch_bucket(t0, vnet_buffer(b0)->l2_classify.hash);
 
      from++;
      n_left_from--;
   }
 
-  next_index = node->cached_next_index;
   from = vlib_frame_vector_args(frame);
   n_left_from = frame->n_vectors;
 
@@ -349,6 +581,221 @@ mmb_classify_inline(vlib_main_t * vm,
      if (purge_conn_expired(mct, now_ticks))
          mm->last_conn_table_timeout_check = now_ticks;
   }
+  is_stateful = mct->conn_hash_is_initialized;
+
+  /* Second pass: match rules, prefetch connection buckets */
+  for (i = 0; i < frame->n_vectors; i++) {
+
+      vlib_buffer_t *b0;
+      u32 next0 = MMB_CLASSIFY_NEXT_INDEX_MISS;
+      u32 table_index0;
+      vnet_classify_table_t *t0;
+      vnet_classify_entry_t *e0;
+      u64 hash0;
+      u8 *h0, l4_bit0;
+      u32 len0;
+      u32 *matches;
+      u8 tcpo0_flag;
+      mmb_5tuple_t *pkt_5tuple = &pkt_5tuples[i];
+      mmb_headers_t hdr0;
+
+      /* Stride 3 seems to work best */
+      if (PREDICT_TRUE(i + 3 < frame->n_vectors)) {
+          vlib_buffer_t *p1 = vlib_get_buffer(vm, from[i+3]);
+          vnet_classify_table_t *tp1;
+          u32 table_index1;
+          u64 phash1;
+
+          table_index1 = vnet_buffer(p1)->l2_classify.table_index;
+
+          if (PREDICT_TRUE(table_index1 != ~0)) {
+              mmb_bloom_t *bloom1 = mmb_runtime_bloom(rt, table_index1);
+              tp1 = pool_elt_at_index(vcm->tables, table_index1);
+              phash1 = vnet_buffer(p1)->l2_classify.hash;
+              /* no entry to fetch on a filter miss */
+              if (bloom1 == 0 || mmb_bloom_maybe(bloom1, phash1))
+                 vnet_classify_prefetch_entry(tp1, phash1);
+          }
+      }
+
+      b0 = vlib_get_buffer(vm, from[i]);
+      h0 = vlib_buffer_get_current(b0);
+      len0 = b0->current_length;
+      scan0.scanned = 0;
+      table_index0 = vnet_buffer(b0)->l2_classify.table_index;
+      e0 = 0;
+      t0 = 0;
+      matches = 0;
+      matches_opener[i] = 0;
+      matches_shuffle[i] = 0;
+      tcpo0_flag = 0;
+      conn_ids[i].as_u64 = 0;
+      conn_ids[i].conn_index = ~0;
+      rule_sets[i] = ~0;
+
+      mmb_headers_parse(&hdr0, h0, len0, tid);
+      mmb_fill_5tuple(h0, &hdr0, tid, pkt_5tuple);
+
+      /* matching stateless rules */
+      if (PREDICT_TRUE(table_index0 != ~0)) {
+
+          hash0 = vnet_buffer(b0)->l2_classify.hash;
+          t0 = pool_elt_at_index(vcm->tables, table_index0);
+          e0 = mmb_classify_find_entry(rt, t0, table_index0, h0, hash0,
+                                       now, &bloom_negatives, 
+                                       &bloom_false_positives);
+
+          if (e0) { /* match */
+              mmb_match_rules(mm, rt, 
+                              mmb_runtime_lookup(rt, e0->opaque_index),
+                              e0->next_index, h0, len0, &hdr0, &scan0, 
+                              &tcpo0, &tcpo0_flag, tid, &matches, 
+                              &matches_opener[i], &matches_shuffle[i], 
+                              &next0);
+              hits++;
+          } 
+           
+          l4_bit0 = mmb_classify_packet_l4_bit(tid, h0);
+          while (next0 != MMB_CLASSIFY_NEXT_INDEX_DROP) {
+             table_index0 = mmb_classify_dispatch(rt, vcm, 
+                                                  t0->next_table_index,
+                                                  l4_bit0);
+             if (table_index0 == ~0)
+               break;
+             t0 = pool_elt_at_index(vcm->tables, table_index0);
+
+             hash0 = vnet_classify_hash_packet(t0, h0);
+             e0 = mmb_classify_find_entry(rt, t0, table_index0, h0, hash0,
+                                          now, &bloom_negatives, 
+                                          &bloom_false_positives);
+
+             if (e0) {
+                mmb_match_rules(mm, rt, 
+                                mmb_runtime_lookup(rt, e0->opaque_index),
+                                e0->next_index, h0, len0, &hdr0, &scan0, 
+                                &tcpo0, &tcpo0_flag, tid, &matches, 
+                                &matches_opener[i], &matches_shuffle[i], 
+                                &next0);
+                hits++;
+             }
+          }
+      }
+
+      /* matching exact 5-tuple rules, one probe */
+      if (rt && rt->exact[tid] && next0 != MMB_CLASSIFY_NEXT_INDEX_DROP) {
+          u32 *rule_indexes0 = mmb_exact_lookup(rt->exact[tid], pkt_5tuple);
+
+          if (rule_indexes0) {
+             mmb_match_rules(mm, rt, rule_indexes0, ~0, h0, len0, 
+                             &hdr0, &scan0, &tcpo0, &tcpo0_flag, tid, 
+                             &matches, &matches_opener[i], 
+                             &matches_shuffle[i], &next0);
+             hits++;
+          }
+      }
+
+      /* matching prefix rules, one trie walk per direction */
+      if (rt && next0 != MMB_CLASSIFY_NEXT_INDEX_DROP) {
+          u32 *rule_indexes0;
+          mmb_lpm_dir_t dir;
+
+          for (dir = 0; dir < MMB_LPM_N_DIR; dir++) {
+             rule_indexes0 = mmb_match_lpm(rt, h0, tid, dir);
+             if (rule_indexes0 == 0)
+                continue;
+             mmb_match_rules(mm, rt, rule_indexes0, ~0, h0, len0, 
+                             &hdr0, &scan0, &tcpo0, &tcpo0_flag, tid, 
+                             &matches, &matches_opener[i], 
+                             &matches_shuffle[i], &next0);
+             hits++;
+          }
+      }
+
+      /* matching bit vector rules */
+      if (rt && rt->bv[tid] && next0 != MMB_CLASSIFY_NEXT_INDEX_DROP) {
+          vec_reset_length(bv_rule_indexes);
+          mmb_bv_lookup(rt->bv[tid], h0, &bv_rule_indexes);
+          if (vec_len(bv_rule_indexes)) {
+             mmb_match_rules(mm, rt, bv_rule_indexes, ~0, h0, len0, 
+                             &hdr0, &scan0, &tcpo0, &tcpo0_flag, tid, 
+                             &matches, &matches_opener[i], 
+                             &matches_shuffle[i], &next0);
+             hits++;
+          }
+      }
+
+      /* connection key of the packet, its bucket is searched next pass */
+      if (is_stateful) {
+         if (tid == MMB_CLASSIFY_TABLE_IP4)
+            mmb_track_frag(mct, thread_index, h0, pkt_5tuple, now_ticks);
+         /* icmp errors are tracked by the connection of the quoted packet,
+          * none if it cannot be read */
+         if (PREDICT_FALSE(pkt_5tuple->pkt_info.is_quoted_packet)
+             && !mmb_fill_quoted_5tuple(h0, len0, &hdr0, tid, pkt_5tuple))
+            pkt_5tuple->pkt_info.l4_valid = 0;
+         /* only packets with a valid l4 key have connections */
+         if (pkt_5tuple->pkt_info.l4_valid)
+            conn_hashes[i] = mmb_prefetch_conn(mct, pkt_5tuple);
+      }
+
+      /* pass matches & l4 header to next node */
+      vnet_buffer(b0)->l2_classify.hash = (u64)matches;
+      vnet_buffer(b0)->unused[2] = mmb_headers_l4_opaque(&hdr0);
+      nexts[i] = next0;
+  }
+
+  /* Third pass: stateful matching, buckets were prefetched */
+  n_missed = n_openers = 0;
+  for (i = 0; is_stateful && i < frame->n_vectors; i++) {
+      mmb_5tuple_t *pkt_5tuple = &pkt_5tuples[i];
+
+      if (pkt_5tuple->pkt_info.l4_valid == 0)
+         continue;
+      if (mmb_find_conn(mct, pkt_5tuple, conn_hashes[i], &conn_ids[i])) { 
+         /* found connection, update entry and add rule indexes  */
+         mmb_classify_conn_found(mct, pkt_5tuple, &conn_ids[i], now_ticks,
+                                 &rule_sets[i], &nexts[i]);
+      } else {
+         if (mmb_classify_conn_opener(pkt_5tuple, matches_opener[i],
+                                      matches_shuffle[i]))
+            n_openers++;
+         missed[n_missed++] = i;
+      }
+  }
+
+  /* Fourth pass: add new connections in packet order, the following 
+   * packets of the frame find the connections added before them */
+  for (j = 0, n_added = 0; n_openers && j < n_missed; j++) {
+      mmb_5tuple_t *pkt_5tuple = &pkt_5tuples[missed[j]];
+
+      i = missed[j];
+      if (n_added && mmb_find_conn(mct, pkt_5tuple, conn_hashes[i], 
+                                   &conn_ids[i])) {
+         mmb_classify_conn_found(mct, pkt_5tuple, &conn_ids[i], now_ticks,
+                                 &rule_sets[i], &nexts[i]);
+      } else if (mmb_classify_conn_opener(pkt_5tuple, matches_opener[i],
+                                          matches_shuffle[i])) {
+         /* new valid connection matched */
+         vec_append(matches_opener[i], matches_shuffle[i]);
+         added = mmb_add_conn(mct, rt, pkt_5tuple, matches_opener[i], 
+                              matches_shuffle[i], now_ticks);
+         if (PREDICT_FALSE(added == MMB_CONN_REFUSED)) {
+            refused++;
+            continue;
+         }
+         evicted += added == MMB_CONN_ADDED_EVICTING;
+         conn_ids[i].conn_index = pkt_5tuple->pkt_info.conn_index;
+         rule_sets[i] = pool_elt_at_index(mct->conn_pool, 
+                                          conn_ids[i].conn_index)->rule_set;
+         if (nexts[i] == MMB_CLASSIFY_NEXT_INDEX_MISS)
+            nexts[i] = MMB_CLASSIFY_NEXT_INDEX_MATCH;
+         n_added++;
+      }
+  }
+
+  /* Last pass: pass rules of the conn & conn id to next node, enqueue */
+  next_index = node->cached_next_index;
+  i = 0;
 
   while (n_left_from > 0) {
 
@@ -361,34 +808,7 @@ mmb_classify_inline(vlib_main_t * vm,
 
          u32 bi0;
          vlib_buffer_t *b0;
-         u32 next0 = MMB_CLASSIFY_NEXT_INDEX_MISS;
-         u32 table_index0;
-         vnet_classify_table_t *t0;
-         vnet_classify_entry_t *e0;
-         u64 hash0;
-         u8 *h0;
-         u32 *matches, *matches_opener, *matches_shuffle;
-         mmb_rule_t *rule;
-         u32 conn_index, conn_dir;
-         u8 tcpo0_flag;
-         mmb_5tuple_t pkt_5tuple;
-         clib_bihash_kv_48_8_t pkt_conn_index;
-
-         /* Stride 3 seems to work best */
-         if (PREDICT_TRUE(n_left_from > 3)) {
-             vlib_buffer_t *p1 = vlib_get_buffer(vm, from[3]);
-             vnet_classify_table_t *tp1;
-             u32 table_index1;
-             u64 phash1;
-
-             table_index1 = vnet_buffer(p1)->l2_classify.table_index;
-
-             if (PREDICT_TRUE(table_index1 != ~0)) {
-                 tp1 = pool_elt_at_index(vcm->tables, table_index1);
-                 phash1 = vnet_buffer(p1)->l2_classify.hash;
-                 vnet_classify_prefetch_entry(tp1, phash1);
-             }
-         }
+         u32 next0 = nexts[i];
 
          /* Speculatively enqueue b0 to the current next frame */
          bi0 = from[0];
@@ -399,133 +819,9 @@ mmb_classify_inline(vlib_main_t * vm,
          n_left_to_next -= 1;
 
          b0 = vlib_get_buffer(vm, bi0);
-         h0 = vlib_buffer_get_current(b0);
-         table_index0 = vnet_buffer(b0)->l2_classify.table_index;
-         e0 = 0;
-         t0 = 0;
-         matches = 0;
-         matches_opener = 0;
-         matches_shuffle = 0;
-         tcpo0_flag = 0;
-         conn_index = ~0;
-         conn_dir = 0;
-
-         mmb_fill_5tuple(b0, h0, tid, &pkt_5tuple);
-
-         /* matching stateless rules */
-         if (PREDICT_TRUE(table_index0 != ~0)) {
-
-             hash0 = vnet_buffer(b0)->l2_classify.hash;
-             t0 = pool_elt_at_index(vcm->tables, table_index0);
-             e0 = vnet_classify_find_entry(t0, h0, hash0, now);
-
-             if (e0) { /* match */
-                 lookup_entry = pool_elt_at_index(lookup_pool, e0->opaque_index);
-
-                 vec_foreach(rule_index, lookup_entry->rule_indexes) {
-
-                    rule = rules+*rule_index;
-                    if (rule->opts_in_matches && !mmb_match_opts(rule, h0, &tcpo0, &tcpo0_flag, tid))
-                       continue;
-                                           
-                    if (rule->stateful == 0) { /* stateless */
-                       vec_add1(matches, *rule_index);
-                       if (rule->drop_rate == 0 
-                           || rule->drop_rate == MMB_MAX_DROP_RATE_VALUE
-                           || random_drop(mm, rule->drop_rate))
-                          next0 = e0->next_index;  
-                     } else { 
-                       if (rule->shuffle == 0) { /* stateful */
-                          vec_add1(matches_opener, *rule_index);
-                       } else { /* stateful + seed */
-                          vec_add1(matches_shuffle, *rule_index);
-                       }
-                     }
-
-                     rule->match_count++;  
-                 }
-                 hits++;
-             } 
-              
-             while (next0 != MMB_CLASSIFY_NEXT_INDEX_DROP) {
-                if (t0->next_table_index != ~0)
-                  t0 = pool_elt_at_index(vcm->tables,
-                                          t0->next_table_index);
-                else { 
-                  break;
-                }
-
-                hash0 = vnet_classify_hash_packet(t0, h0);
-                e0 = vnet_classify_find_entry(t0, h0, hash0, now);
-
-                if (e0) {
-
-                   lookup_entry = pool_elt_at_index(lookup_pool, e0->opaque_index);
-                   vec_foreach(rule_index, lookup_entry->rule_indexes) {
-
-                      rule = rules+*rule_index;
-                      if (rule->opts_in_matches && !mmb_match_opts(rule, h0, &tcpo0, &tcpo0_flag, tid))
-                         continue;
-
-                      if (rule->stateful == 0) { /* stateless */
-                          vec_add1(matches, *rule_index);
-                         if (rule->drop_rate == 0 
-                             || rule->drop_rate == MMB_MAX_DROP_RATE_VALUE
-                             || random_drop(mm, rule->drop_rate))
-                            next0 = e0->next_index;  
-                      } else { 
-                         if (rule->shuffle == 0) { /* stateful */
-                            vec_add1(matches_opener, *rule_index);
-                         } else { /* stateful + seed */
-                            vec_add1(matches_shuffle, *rule_index);
-                         }
-                      }
- 
-                      rule->match_count++;
-                   }
-                   hits++;
-                }
-             }
-         }
-
-         /* stateful matching */
-         if (mct->conn_hash_is_initialized) {
-             mmb_conn_t *conn;
-             mmb_conn_id_t conn_id;
-
-            if (mmb_find_conn(mct, &pkt_5tuple, &pkt_conn_index)) { 
-               /* found connection, update entry and add rule indexes  */
-
-               conn_id.as_u64 = pkt_conn_index.value;
-               conn = pool_elt_at_index(mct->conn_pool, conn_id.conn_index);
-               mmb_track_conn(conn, &pkt_5tuple, conn_id.dir, now_ticks);
-
-               vec_append(matches, conn->rule_indexes);
-               conn_index = conn_id.conn_index;
-               conn_dir   = conn_id.dir;
-               if (next0 == MMB_CLASSIFY_NEXT_INDEX_MISS)
-                  next0 = MMB_CLASSIFY_NEXT_INDEX_MATCH;
-               
-            } else if ((vec_len(matches_opener) != 0 || vec_len(matches_shuffle) != 0)
-                        && pkt_5tuple.pkt_info.l4_valid == 1) {
-               /* new valid connection matched */
-
-               vec_append(matches_opener, matches_shuffle);
-               mmb_add_conn(mct, &pkt_5tuple, matches_opener, 
-                            matches_shuffle, now_ticks);
-               conn_index = pkt_5tuple.pkt_info.conn_index;
-               
-               vec_append(matches, matches_opener);
-               
-               if (next0 == MMB_CLASSIFY_NEXT_INDEX_MISS)
-                  next0 = MMB_CLASSIFY_NEXT_INDEX_MATCH;
-            }
-         }
-
-         /* pass matches & conn id to next ode */
-         vnet_buffer(b0)->l2_classify.hash = (u64)matches;
-         vnet_buffer(b0)->unused[0] = conn_index;
-         vnet_buffer(b0)->unused[1] = conn_dir;
+         vnet_buffer(b0)->l2_classify.opaque_index = rule_sets[i];
+         vnet_buffer(b0)->unused[0] = conn_ids[i].conn_index;
+         vnet_buffer(b0)->unused[1] = conn_ids[i].dir;
 
          if (PREDICT_FALSE((node->flags & VLIB_NODE_FLAG_TRACE)
                             && (b0->flags & VLIB_BUFFER_IS_TRACED))) {
@@ -534,16 +830,17 @@ mmb_classify_inline(vlib_main_t * vm,
               t->sw_if_index = vnet_buffer(b0)->sw_if_index[VLIB_RX];
               t->next_index = next0;
               t->rule_indexes = vec_dup((u32*)vnet_buffer(b0)->l2_classify.hash);
-              /*clib_memcpy(&t->packet_5tuple, &pkt_5tuple,
-		                    sizeof(pkt_5tuple));
-              clib_memcpy(t->packet_data, h0,
-		                    sizeof(t->packet_data)); *//* offsetof */
-              t->conn_index = conn_index;
-              t->conn_dir = conn_dir;
+              vec_append(t->rule_indexes, mmb_conn_rule_set(mct, rule_sets[i]));
+              t->conn_index = conn_ids[i].conn_index;
+              t->conn_dir = conn_ids[i].dir;
          }
 
-         vec_free(matches_opener);
-         vec_free(matches_shuffle);
+         vec_free(matches_opener[i]);
+         vec_free(matches_shuffle[i]);
+         i++;
+
+         if (next0 == MMB_CLASSIFY_NEXT_INDEX_MATCH)
+            to_rewrite++;
 
          /* Verify speculative enqueue, maybe switch current next frame */
          vlib_validate_buffer_enqueue_x1(vm, node, next_index, to_next,
@@ -559,7 +856,22 @@ mmb_classify_inline(vlib_main_t * vm,
   vlib_node_increment_counter(vm, node->node_index,
                                MMB_CLASSIFY_ERROR_DROP,
                                drop);
+  vlib_node_increment_counter(vm, node->node_index,
+                               MMB_CLASSIFY_ERROR_REFUSED,
+                               refused);
+  vlib_node_increment_counter(vm, node->node_index,
+                               MMB_CLASSIFY_ERROR_EVICTED,
+                               evicted);
+
+  clib_bitmap_free(scan0.hits);
 
+  if (rt) {
+    /* kept for the next frame */
+    pt->bv_rule_indexes = bv_rule_indexes;
+    pt->bloom_negatives += bloom_negatives;
+    pt->bloom_false_positives += bloom_false_positives;
+    mmb_runtime_leave(thread_index, to_rewrite);
+  }
 
   return frame->n_vectors;
 }
@@ -22,6 +22,7 @@
 #include <vlib/vlib.h>
 #include <vnet/vnet.h>
 #include <vnet/classify/vnet_classify.h>
+#include <vnet/ip/ip.h>
 
 #define MMB_CLASSIFY_MAX_MASK_LEN (5*sizeof(u32x4))
 
@@ -31,6 +32,15 @@ typedef enum {
   MMB_CLASSIFY_N_TABLES=2,
 } mmb_classify_table_id_t;
 
+/* protocol classes of the first-stage dispatch of the chain */
+typedef enum {
+  MMB_CLASSIFY_L4_TCP=0,
+  MMB_CLASSIFY_L4_UDP=1,
+  MMB_CLASSIFY_L4_ICMP=2,
+  MMB_CLASSIFY_L4_OTHER=3,
+  MMB_CLASSIFY_N_L4=4,
+} mmb_classify_l4_t;
+
 typedef enum {
   MMB_CLASSIFY_NEXT_INDEX_MATCH,
   MMB_CLASSIFY_NEXT_INDEX_MISS,
@@ -47,4 +57,36 @@ typedef struct {
 
 mmb_classify_main_t mmb_classify_main;
 
+static_always_inline mmb_classify_l4_t mmb_classify_l4(u8 protocol) {
+  switch (protocol) {
+    case IP_PROTOCOL_TCP:
+      return MMB_CLASSIFY_L4_TCP;
+    case IP_PROTOCOL_UDP:
+      return MMB_CLASSIFY_L4_UDP;
+    case IP_PROTOCOL_ICMP:
+    case IP_PROTOCOL_ICMP6:
+      return MMB_CLASSIFY_L4_ICMP;
+    default:
+      return MMB_CLASSIFY_L4_OTHER;
+  }
+}
+
+/**
+ * mmb_classify_l4_bit
+ *
+ * @return bit of the address family and protocol class of an ip header,
+ *         among the MMB_CLASSIFY_N_TABLES * MMB_CLASSIFY_N_L4 bits of a u8
+ */
+static_always_inline u8 mmb_classify_l4_bit(mmb_classify_table_id_t tid,
+                                            u8 protocol) {
+  return 1 << (tid * MMB_CLASSIFY_N_L4 + mmb_classify_l4(protocol));
+}
+
+static_always_inline u8
+mmb_classify_packet_l4_bit(mmb_classify_table_id_t tid, u8 *h0) {
+  if (tid == MMB_CLASSIFY_TABLE_IP4)
+    return mmb_classify_l4_bit(tid, ((ip4_header_t *) h0)->protocol);
+  return mmb_classify_l4_bit(tid, ((ip6_header_t *) h0)->protocol);
+}
+
 #endif /* __included_mmb_classify_h__ */
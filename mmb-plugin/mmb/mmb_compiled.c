@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * compiled rules files.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <mmb/mmb.h>
+#include <mmb/mmb_compiled.h>
+
+typedef struct {
+  u8 *data;
+  uword size;
+  uword offset;
+} mmb_compiled_cursor_t;
+
+/************************
+ *   writing
+ ***********************/
+
+static void put(u8 **buf, void *data, uword size) {
+  vec_add(*buf, (u8 *) data, size);
+  while (vec_len(*buf) % MMB_COMPILED_ALIGN)
+    vec_add1(*buf, 0);
+}
+
+static void put_u32(u8 **buf, u32 value) {
+  put(buf, &value, sizeof(u32));
+}
+
+static void put_vec(u8 **buf, void *v, u32 elt_size) {
+  mmb_compiled_vec_t header = { .len = vec_len(v), .elt_size = elt_size };
+
+  put(buf, &header, sizeof(header));
+  if (header.len)
+    put(buf, v, header.len * elt_size);
+}
+
+/* elements of a vector holding value pointers are written with null values,
+ * the values follow */
+#define put_vec_of_values(buf, v)             \
+do {                                          \
+  typeof(v) _copy = vec_dup(v), _elt;         \
+  vec_foreach(_elt, _copy) {                  \
+    _elt->value = 0;                          \
+  }                                           \
+  put_vec(buf, _copy, sizeof(_copy[0]));      \
+  vec_free(_copy);                            \
+} while (0)
+
+static void put_matches(u8 **buf, mmb_match_t *matches) {
+  mmb_match_t *match;
+
+  put_vec_of_values(buf, matches);
+  vec_foreach(match, matches) {
+    put_vec(buf, match->value, sizeof(u8));
+  }
+}
+
+static void put_targets(u8 **buf, mmb_target_t *targets) {
+  mmb_target_t *target;
+
+  put_vec_of_values(buf, targets);
+  vec_foreach(target, targets) {
+    put_vec(buf, target->value, sizeof(u8));
+  }
+}
+
+static void put_deeps(u8 **buf, mmb_deep_t *deeps) {
+  mmb_deep_t *deep;
+
+  put_vec_of_values(buf, deeps);
+  vec_foreach(deep, deeps) {
+    put_vec(buf, deep->value, sizeof(u8));
+  }
+}
+
+static void reset_rule_vectors(mmb_rule_t *rule) {
+  rule->matches = 0;
+  rule->opt_matches = 0;
+  rule->set_matches = 0;
+  rule->ipset_matches = 0;
+  rule->payload_matches = 0;
+  rule->payload_ids = 0;
+  rule->targets = 0;
+  rule->opt_strips = 0;
+  rule->opt_mods = 0;
+  rule->opt_adds = 0;
+  rule->shuffle_targets = 0;
+  rule->classify_mask = 0;
+  rule->classify_key = 0;
+  rule->rewrite_mask = 0;
+  rule->rewrite_key = 0;
+  rule->deep_matches = 0;
+  rule->deep_targets = 0;
+}
+
+static void put_rule(u8 **buf, mmb_rule_t *rule) {
+  mmb_transport_option_t *opt;
+  mmb_rule_t fields = *rule;
+
+  /* vectors follow, pointers are not written */
+  reset_rule_vectors(&fields);
+  put(buf, &fields, sizeof(mmb_rule_t));
+  put_matches(buf, rule->matches);
+  put_matches(buf, rule->opt_matches);
+  put_matches(buf, rule->set_matches);
+  put_matches(buf, rule->payload_matches);
+  put_targets(buf, rule->targets);
+  put_vec(buf, rule->opt_strips, sizeof(uword));
+  put_targets(buf, rule->opt_mods);
+  put_vec_of_values(buf, rule->opt_adds);
+  vec_foreach(opt, rule->opt_adds) {
+    put_vec(buf, opt->value, sizeof(u8));
+  }
+  put_targets(buf, rule->shuffle_targets);
+  put_vec(buf, rule->classify_mask, sizeof(u8));
+  put_vec(buf, rule->classify_key, sizeof(u8));
+  put_vec(buf, rule->rewrite_mask, sizeof(u8));
+  put_vec(buf, rule->rewrite_key, sizeof(u8));
+  put_deeps(buf, rule->deep_matches);
+  put_deeps(buf, rule->deep_targets);
+}
+
+static void put_table(u8 **buf, mmb_table_t *table) {
+  mmb_session_t *session;
+  u32 *lookup_indexes = 0, *nexts = 0;
+  u8 **merged_key;
+
+  put_vec(buf, table->mask, sizeof(u8));
+  put_u32(buf, table->skip);
+  put_u32(buf, table->match);
+  put_u32(buf, table->size);
+
+  put_u32(buf, vec_len(table->merged_keys));
+  vec_foreach(merged_key, table->merged_keys) {
+    put_vec(buf, *merged_key, sizeof(u8));
+  }
+
+  put_u32(buf, pool_elts(table->sessions));
+  pool_foreach(session, table->sessions, ({
+    put_vec(buf, session->key, sizeof(u8));
+    vec_add1(lookup_indexes, session->lookup_index);
+    vec_add1(nexts, session->next);
+  }));
+  put_vec(buf, lookup_indexes, sizeof(u32));
+  put_vec(buf, nexts, sizeof(u32));
+
+  vec_free(lookup_indexes);
+  vec_free(nexts);
+}
+
+clib_error_t *mmb_compiled_write(char *filename, mmb_main_t *mm) {
+  mmb_compiled_header_t header;
+  mmb_rule_t *rule;
+  mmb_table_t *table;
+  mmb_lookup_entry_t *lookup_entry;
+  clib_error_t *error = 0;
+  u32 lookup_index, table_index, chained = 0;
+  u8 *buf = 0;
+  uword *p;
+  int fd;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = MMB_COMPILED_MAGIC;
+  header.version = MMB_COMPILED_VERSION;
+  header.rule_size = sizeof(mmb_rule_t);
+  header.match_size = sizeof(mmb_match_t);
+  header.target_size = sizeof(mmb_target_t);
+  header.option_size = sizeof(mmb_transport_option_t);
+  header.rule_count = vec_len(mm->rules);
+  header.table_count = vec_len(mm->tables);
+  header.lookup_count = vec_len(mm->lookup_pool);
+  put(&buf, &header, sizeof(header));
+
+  vec_foreach(rule, mm->rules) {
+    put_rule(&buf, rule);
+  }
+  /* tables in chain order, starting from the one with no predecessor */
+  table_index = ~0;
+  vec_foreach(table, mm->tables) {
+    if (table->previous_index == ~0)
+      table_index = table - mm->tables;
+  }
+  while (table_index != ~0 && chained < header.table_count) {
+    table = &mm->tables[table_index];
+    put_table(&buf, table);
+    chained++;
+    p = hash_get(mm->table_by_index, table->next_index);
+    table_index = p ? p[0] : ~0;
+  }
+  if (chained != header.table_count) {
+    vec_free(buf);
+    return clib_error_return(0, "table chain is inconsistent");
+  }
+  for (lookup_index = 0; lookup_index < header.lookup_count; lookup_index++) {
+    if (pool_is_free_index(mm->lookup_pool, lookup_index)) {
+      put_vec(&buf, 0, sizeof(u32));
+      continue;
+    }
+    lookup_entry = pool_elt_at_index(mm->lookup_pool, lookup_index);
+    put_vec(&buf, lookup_entry->rule_indexes, sizeof(u32));
+  }
+
+  fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    error = clib_error_return_unix(0, "open `%s'", filename);
+    goto done;
+  }
+  if (write(fd, buf, vec_len(buf)) != vec_len(buf))
+    error = clib_error_return_unix(0, "write `%s'", filename);
+  close(fd);
+
+done:
+  vec_free(buf);
+  return error;
+}
+
+/************************
+ *   reading
+ ***********************/
+
+static void *get(mmb_compiled_cursor_t *c, uword size) {
+  void *p;
+
+  if (c->offset + size > c->size)
+    return 0;
+
+  p = c->data + c->offset;
+  c->offset += round_pow2(size, MMB_COMPILED_ALIGN);
+  return p;
+}
+
+static int get_u32(mmb_compiled_cursor_t *c, u32 *value) {
+  u32 *p = get(c, sizeof(u32));
+
+  if (p == 0)
+    return -1;
+  *value = *p;
+  return 0;
+}
+
+static int get_vec(mmb_compiled_cursor_t *c, void *result, u32 elt_size) {
+  mmb_compiled_vec_t *header = get(c, sizeof(mmb_compiled_vec_t));
+  void **v = result;
+  void *data;
+
+  *v = 0;
+  if (header == 0 || header->elt_size != elt_size)
+    return -1;
+  if (header->len == 0)
+    return 0;
+
+  data = get(c, (uword) header->len * elt_size);
+  if (data == 0)
+    return -1;
+
+  *v = _vec_resize(0, header->len, (uword) header->len * elt_size, 0, 0);
+  clib_memcpy(*v, data, header->len * elt_size);
+  return 0;
+}
+
+static int get_matches(mmb_compiled_cursor_t *c, mmb_match_t **matches) {
+  mmb_match_t *match;
+
+  if (get_vec(c, matches, sizeof(mmb_match_t)))
+    return -1;
+  vec_foreach(match, *matches) {
+    match->value = 0;
+  }
+  vec_foreach(match, *matches) {
+    if (get_vec(c, &match->value, sizeof(u8)))
+      return -1;
+  }
+  return 0;
+}
+
+static int get_targets(mmb_compiled_cursor_t *c, mmb_target_t **targets) {
+  mmb_target_t *target;
+
+  if (get_vec(c, targets, sizeof(mmb_target_t)))
+    return -1;
+  vec_foreach(target, *targets) {
+    target->value = 0;
+  }
+  vec_foreach(target, *targets) {
+    if (get_vec(c, &target->value, sizeof(u8)))
+      return -1;
+  }
+  return 0;
+}
+
+static int get_deeps(mmb_compiled_cursor_t *c, mmb_deep_t **deeps) {
+  mmb_deep_t *deep;
+
+  if (get_vec(c, deeps, sizeof(mmb_deep_t)))
+    return -1;
+  vec_foreach(deep, *deeps) {
+    deep->value = 0;
+  }
+  vec_foreach(deep, *deeps) {
+    if (get_vec(c, &deep->value, sizeof(u8)))
+      return -1;
+  }
+  return 0;
+}
+
+static int get_rule(mmb_compiled_cursor_t *c, mmb_rule_t *rule) {
+  mmb_rule_t *p = get(c, sizeof(mmb_rule_t));
+  mmb_transport_option_t *opt;
+
+  memset(rule, 0, sizeof(mmb_rule_t));
+  if (p == 0)
+    return -1;
+  *rule = *p;
+  reset_rule_vectors(rule);
+  rule->match_count = 0;
+  rule->classify_table_index = ~0;
+
+  if (get_matches(c, &rule->matches) || get_matches(c, &rule->opt_matches)
+      || get_matches(c, &rule->set_matches)
+      || get_matches(c, &rule->payload_matches)
+      || get_targets(c, &rule->targets)
+      || get_vec(c, &rule->opt_strips, sizeof(uword))
+      || get_targets(c, &rule->opt_mods)
+      || get_vec(c, &rule->opt_adds, sizeof(mmb_transport_option_t)))
+    return -1;
+
+  vec_foreach(opt, rule->opt_adds) {
+    opt->value = 0;
+  }
+  vec_foreach(opt, rule->opt_adds) {
+    if (get_vec(c, &opt->value, sizeof(u8)))
+      return -1;
+  }
+
+  if (get_targets(c, &rule->shuffle_targets)
+      || get_vec(c, &rule->classify_mask, sizeof(u8))
+      || get_vec(c, &rule->classify_key, sizeof(u8))
+      || get_vec(c, &rule->rewrite_mask, sizeof(u8))
+      || get_vec(c, &rule->rewrite_key, sizeof(u8))
+      || get_deeps(c, &rule->deep_matches)
+      || get_deeps(c, &rule->deep_targets))
+    return -1;
+
+  return 0;
+}
+
+static int get_table(mmb_compiled_cursor_t *c, mmb_compiled_table_t *table,
+                     u32 lookup_count) {
+  u32 merged_count, session_count, session_index, index;
+  u8 *key;
+
+  memset(table, 0, sizeof(mmb_compiled_table_t));
+  if (get_vec(c, &table->mask, sizeof(u8)) || get_u32(c, &table->skip)
+      || get_u32(c, &table->match) || get_u32(c, &table->size)
+      || get_u32(c, &merged_count))
+    return -1;
+
+  for (index = 0; index < merged_count; index++) {
+    if (get_vec(c, &key, sizeof(u8)))
+      return -1;
+    vec_add1(table->merged_keys, key);
+  }
+
+  if (get_u32(c, &session_count))
+    return -1;
+
+  for (session_index = 0; session_index < session_count; session_index++) {
+    if (get_vec(c, &key, sizeof(u8)))
+      return -1;
+    vec_add1(table->keys, key);
+  }
+
+  if (get_vec(c, &table->lookup_indexes, sizeof(u32))
+      || get_vec(c, &table->nexts, sizeof(u32))
+      || vec_len(table->lookup_indexes) != session_count
+      || vec_len(table->nexts) != session_count)
+    return -1;
+
+  for (session_index = 0; session_index < session_count; session_index++) {
+    if (table->lookup_indexes[session_index] >= lookup_count)
+      return -1;
+  }
+
+  return 0;
+}
+
+static int check_header(mmb_compiled_header_t *header) {
+  return header->magic == MMB_COMPILED_MAGIC
+      && header->version == MMB_COMPILED_VERSION
+      && header->rule_size == sizeof(mmb_rule_t)
+      && header->match_size == sizeof(mmb_match_t)
+      && header->target_size == sizeof(mmb_target_t)
+      && header->option_size == sizeof(mmb_transport_option_t);
+}
+
+clib_error_t *mmb_compiled_read(char *filename, mmb_compiled_t *compiled) {
+  mmb_compiled_cursor_t cursor;
+  mmb_compiled_header_t *header;
+  mmb_compiled_table_t *table;
+  mmb_rule_t *rule;
+  clib_error_t *error = 0;
+  struct stat st;
+  u32 index, *rule_indexes, *rule_index;
+  int fd;
+
+  memset(compiled, 0, sizeof(mmb_compiled_t));
+  memset(&cursor, 0, sizeof(cursor));
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0)
+    return clib_error_return_unix(0, "open `%s'", filename);
+  if (fstat(fd, &st) < 0) {
+    close(fd);
+    return clib_error_return_unix(0, "stat `%s'", filename);
+  }
+  if (st.st_size == 0) {
+    close(fd);
+    return clib_error_return(0, "%s: empty file", filename);
+  }
+
+  cursor.size = st.st_size;
+  cursor.data = mmap(0, cursor.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (cursor.data == MAP_FAILED)
+    return clib_error_return_unix(0, "mmap `%s'", filename);
+
+  header = get(&cursor, sizeof(mmb_compiled_header_t));
+  if (header == 0 || !check_header(header)) {
+    error = clib_error_return(0, "%s: not a compiled rules file or "
+                                 "incompatible version", filename);
+    goto done;
+  }
+
+  for (index = 0; index < header->rule_count; index++) {
+    vec_add2(compiled->rules, rule, 1);
+    if (get_rule(&cursor, rule))
+      goto corrupted;
+  }
+
+  for (index = 0; index < header->table_count; index++) {
+    vec_add2(compiled->tables, table, 1);
+    if (get_table(&cursor, table, header->lookup_count))
+      goto corrupted;
+  }
+
+  for (index = 0; index < header->lookup_count; index++) {
+    if (get_vec(&cursor, &rule_indexes, sizeof(u32)))
+      goto corrupted;
+    vec_add1(compiled->lookup, rule_indexes);
+    vec_foreach(rule_index, rule_indexes) {
+      if (*rule_index >= header->rule_count)
+        goto corrupted;
+    }
+  }
+  goto done;
+
+corrupted:
+  error = clib_error_return(0, "%s: corrupted at offset %lu", filename,
+                            cursor.offset);
+  vec_foreach(rule, compiled->rules) {
+    mmb_free_rule(rule);
+  }
+  vec_free(compiled->rules);
+  mmb_compiled_free(compiled);
+
+done:
+  munmap(cursor.data, cursor.size);
+  return error;
+}
+
+void mmb_compiled_free(mmb_compiled_t *compiled) {
+  mmb_compiled_table_t *table;
+  u8 **key;
+  u32 **rule_indexes;
+
+  vec_foreach(table, compiled->tables) {
+    vec_free(table->mask);
+    vec_foreach(key, table->merged_keys) {
+      vec_free(*key);
+    }
+    vec_free(table->merged_keys);
+    vec_foreach(key, table->keys) {
+      vec_free(*key);
+    }
+    vec_free(table->keys);
+    vec_free(table->lookup_indexes);
+    vec_free(table->nexts);
+  }
+  vec_free(compiled->tables);
+
+  vec_foreach(rule_indexes, compiled->lookup) {
+    vec_free(*rule_indexes);
+  }
+  vec_free(compiled->lookup);
+}
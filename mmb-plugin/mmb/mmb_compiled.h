@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * compiled rules files.
+ */
+
+#ifndef __included_mmb_compiled_h__
+#define __included_mmb_compiled_h__
+
+#include <vppinfra/error.h>
+#include <mmb/mmb.h>
+
+#define MMB_COMPILED_MAGIC 0x43424d4d /* "MMBC" */
+#define MMB_COMPILED_VERSION 5
+#define MMB_COMPILED_ALIGN 8
+
+/**
+ * File layout, in host byte order, every item padded to MMB_COMPILED_ALIGN:
+ *
+ *  mmb_compiled_header_t
+ *  rule_count x rule: mmb_rule_t, then its vectors (sets by name)
+ *  table_count x table: mask, skip, match, size, merged keys, session keys,
+ *                       session lookup indexes, session next nodes
+ *  lookup_count x rule indexes (empty for free lookup entries)
+ *
+ * A vector is a mmb_compiled_vec_t followed by its elements.
+ */
+typedef struct {
+  u32 magic;
+  u32 version;
+  u32 rule_size; /*! layout check */
+  u32 match_size;
+  u32 target_size;
+  u32 option_size;
+  u32 rule_count;
+  u32 table_count;
+  u32 lookup_count;
+  u32 unused;
+} mmb_compiled_header_t;
+
+typedef struct {
+  u32 len;
+  u32 elt_size;
+} mmb_compiled_vec_t;
+
+typedef struct {
+  u8 *mask;
+  u32 skip;
+  u32 match;
+  u32 size;
+  u8 **merged_keys; /*! hash keys of the tables unified in this one */
+  u8 **keys; /*! session keys */
+  u32 *lookup_indexes; /*! lookup index of each session */
+  u32 *nexts; /*! next node of each session */
+} mmb_compiled_table_t;
+
+typedef struct {
+  mmb_rule_t *rules;
+  mmb_compiled_table_t *tables; /*! in chain order */
+  u32 **lookup; /*! rule indexes by lookup index */
+} mmb_compiled_t;
+
+/**
+ * mmb_compiled_write
+ *
+ * write rules, tables and lookup pool of mmb_main to file
+ */
+clib_error_t *mmb_compiled_write(char *filename, mmb_main_t *mm);
+
+/**
+ * mmb_compiled_read
+ *
+ * read a file written by mmb_compiled_write
+ */
+clib_error_t *mmb_compiled_read(char *filename, mmb_compiled_t *compiled);
+
+/**
+ * mmb_compiled_free
+ *
+ * free tables and lookup of compiled, rules are left to the caller
+ */
+void mmb_compiled_free(mmb_compiled_t *compiled);
+
+#endif /* __included_mmb_compiled_h__ */
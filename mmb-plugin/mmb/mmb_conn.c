@@ -17,9 +17,19 @@
  * Author: Korian Edeline
  */
 
+#include <vlib/threads.h>
+#include <vppinfra/xxhash.h>
+
+/* vnet does not instantiate bihash_40_8. The template instantiates the
+ * bihash header included last, and headers below include other bihash
+ * types, so this comes first */
+#include <vppinfra/bihash_40_8.h>
+#include <vppinfra/bihash_template.c>
+
 #include <mmb/mmb.h>
 #include <mmb/mmb_opts.h>
 #include <mmb/mmb_conn.h>
+#include <mmb/mmb_runtime.h>
 
 #ifdef MMB_DEBUG
 #  define vl_print(handle, ...) vlib_cli_output (handle, __VA_ARGS__)
@@ -53,6 +63,45 @@ static void update_conn_pool_internal(mmb_conn_table_t *mct, u32 rule_index);
  */
 static_always_inline void wait_and_lock_connection_handling(mmb_conn_table_t *mct);
 
+/**
+ * get_rule_set
+ *
+ * intern rule_indexes, taking a reference on its rule set
+ * @return rule set index
+ */
+static u32 get_rule_set(mmb_conn_table_t *mct, u32 *rule_indexes) {
+   mmb_rule_set_t *set;
+   uword *p = hash_get_mem(mct->rule_set_by_rules, rule_indexes);
+
+   if (p) {
+      set = pool_elt_at_index(mct->rule_sets, p[0]);
+      set->refcount++;
+      return p[0];
+   }
+
+   pool_get(mct->rule_sets, set);
+   set->rule_indexes = vec_dup(rule_indexes);
+   set->refcount = 1;
+   hash_set_mem(mct->rule_set_by_rules, set->rule_indexes, 
+                set - mct->rule_sets);
+   return set - mct->rule_sets;
+}
+
+/**
+ * put_rule_set
+ *
+ * drop a reference on a rule set, freed by its last connection
+ */
+static void put_rule_set(mmb_conn_table_t *mct, u32 set_index) {
+   mmb_rule_set_t *set = pool_elt_at_index(mct->rule_sets, set_index);
+
+   if (--set->refcount)
+      return;
+   hash_unset_mem(mct->rule_set_by_rules, set->rule_indexes);
+   vec_free(set->rule_indexes);
+   pool_put(mct->rule_sets, set);
+}
+
 /** 
  * return index of val in vec, ~0 if vec does not contain val
  */
@@ -66,20 +115,187 @@ static_always_inline u32 vec_find(u32 *vec, u32 val) {
    return ~0;
 }
 
-static_always_inline int mmb_del_5tuple(mmb_conn_table_t *mct, clib_bihash_kv_48_8_t *conn_key) {
-  return BV (clib_bihash_add_del) (&mct->conn_hash,
-			    conn_key, 0);
+/* per family keys: addresses then the l4 key */
+static_always_inline void conn_key4(clib_bihash_kv_16_8_t *kv, 
+                                    mmb_5tuple_t *conn_key) {
+  kv->key[0] = (u64) conn_key->addr[0].ip4.as_u32 << 32 
+               | conn_key->addr[1].ip4.as_u32;
+  kv->key[1] = conn_key->l4.as_u64;
+  kv->value = conn_key->kv.value;
+}
+
+static_always_inline void conn_key6(clib_bihash_kv_40_8_t *kv, 
+                                    mmb_5tuple_t *conn_key) {
+  kv->key[0] = conn_key->kv.key[0];
+  kv->key[1] = conn_key->kv.key[1];
+  kv->key[2] = conn_key->kv.key[2];
+  kv->key[3] = conn_key->kv.key[3];
+  kv->key[4] = conn_key->l4.as_u64;
+  kv->value = conn_key->kv.value;
 }
 
-static_always_inline int mmb_add_5tuple(mmb_conn_table_t *mct, clib_bihash_kv_48_8_t *conn_key) {
-  return BV (clib_bihash_add_del) (&mct->conn_hash,
-			    conn_key, 1);
+static_always_inline int mmb_add_del_5tuple(mmb_conn_table_t *mct, 
+                                            mmb_5tuple_t *conn_key, 
+                                            int is_ip6, int is_add) {
+  clib_bihash_kv_16_8_t kv4;
+  clib_bihash_kv_40_8_t kv6;
+
+  if (is_ip6) {
+    conn_key6(&kv6, conn_key);
+    return clib_bihash_add_del_40_8(&mct->conn_hash6, &kv6, is_add);
+  }
+  conn_key4(&kv4, conn_key);
+  return clib_bihash_add_del_16_8(&mct->conn_hash4, &kv4, is_add);
+}
+
+static_always_inline void copy_reverse_5tuple(mmb_5tuple_t *to, 
+                                              mmb_conn_cold_t *from) {
+   to->addr[0] = from->info.addr[1];
+   to->addr[1] = from->info.addr[0];
+   to->l4.port[0] = from->dport ? ntohs(from->dport) : from->info.l4.port[1];
+   to->l4.port[1] = from->sport ? ntohs(from->sport) : from->info.l4.port[0];  
+} 
+
+static_always_inline void copy_forward_5tuple(mmb_5tuple_t *to, 
+                                              mmb_conn_cold_t *from) {
+   to->kv.key[0] = from->info.kv.key[0];
+   to->kv.key[1] = from->info.kv.key[1];
+   to->kv.key[2] = from->info.kv.key[2];
+   to->kv.key[3] = from->info.kv.key[3];
+   to->kv.key[4] = from->info.kv.key[4];
+   to->kv.key[5] = from->info.kv.key[5];
+}
+
+/**
+ * canonical_5tuple
+ *
+ * write the key of a 5tuple, its lower (address, port) endpoint first, so
+ * that both directions of a connection share a key.
+ * @return 1 if the endpoints of from were swapped
+ */
+static_always_inline int canonical_5tuple(mmb_5tuple_t *to, 
+                                          mmb_5tuple_t *from) {
+   int cmp = ip46_address_cmp(&from->addr[0], &from->addr[1]);
+   int swap = cmp > 0 || (cmp == 0 && from->l4.port[0] > from->l4.port[1]);
+
+   to->kv.key[4] = from->kv.key[4];
+   to->kv.key[5] = from->kv.key[5];
+   to->addr[0] = from->addr[swap];
+   to->addr[1] = from->addr[!swap];
+   to->l4.port[0] = from->l4.port[swap];
+   to->l4.port[1] = from->l4.port[!swap];
+   to->kv.value = 0;
+   return swap;
+}
+
+/**
+ * get_conn_keys
+ *
+ * canonical keys of a connection, with the direction of their lower
+ * endpoint in value. A shuffled connection is seen backward with its
+ * mapped ports, under a second key if it differs.
+ * @return number of keys
+ */
+static u32 get_conn_keys(mmb_conn_cold_t *conn, u32 conn_index, 
+                         mmb_5tuple_t keys[2]) {
+   mmb_conn_id_t conn_id;
+   mmb_5tuple_t reverse;
+
+   conn_id.as_u64 = 0;
+   conn_id.conn_index = conn_index;
+   conn_id.dir = canonical_5tuple(&keys[0], &conn->info);
+   keys[0].kv.value = conn_id.as_u64;
+   if (!conn->sport && !conn->dport)
+      return 1;
+
+   copy_forward_5tuple(&reverse, conn);
+   copy_reverse_5tuple(&reverse, conn);
+   conn_id.dir = 1 ^ canonical_5tuple(&keys[1], &reverse);
+   keys[1].kv.value = conn_id.as_u64;
+   if (!memcmp(keys[0].kv.key, keys[1].kv.key, sizeof(keys[0].kv.key)))
+      return 1;
+   return 2;
+}
+
+/* search of a bihash with the hash of the key: vppinfra 18.01 has no
+ * search taking a precomputed hash, pages are searched as in
+ * clib_bihash_search, without its kvp cache */
+#define foreach_conn_hash_type _(16_8) _(40_8)
+
+#define _(t)                                                              \
+static_always_inline int                                                  \
+conn_search_with_hash_##t(clib_bihash_##t##_t *h, u64 hash,               \
+                          clib_bihash_kv_##t##_t *kv) {                   \
+  clib_bihash_bucket_##t##_t b;                                           \
+  clib_bihash_value_##t##_t *v;                                           \
+  int i, limit = ARRAY_LEN(v->kvp);                                       \
+                                                                          \
+  b.as_u64 = h->buckets[hash & (h->nbuckets - 1)].as_u64;                 \
+  if (b.offset == 0)                                                      \
+    return -1;                                                            \
+                                                                          \
+  v = clib_bihash_get_value_##t(h, b.offset);                             \
+  if (b.linear_search)                                                    \
+    limit <<= b.log2_pages;                                               \
+  else                                                                    \
+    v += (hash >> h->log2_nbuckets) & ((1 << b.log2_pages) - 1);          \
+                                                                          \
+  for (i = 0; i < limit; i++) {                                           \
+    if (clib_bihash_key_compare_##t(v->kvp[i].key, kv->key)) {            \
+      kv->value = v->kvp[i].value;                                        \
+      return 0;                                                           \
+    }                                                                     \
+  }                                                                       \
+  return -1;                                                              \
+}
+foreach_conn_hash_type
+#undef _
+
+u64 mmb_prefetch_conn(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple) {
+  mmb_5tuple_t conn_key;
+  clib_bihash_kv_16_8_t kv4;
+  clib_bihash_kv_40_8_t kv6;
+  u64 hash;
+
+  canonical_5tuple(&conn_key, pkt_5tuple);
+  if (pkt_5tuple->pkt_info.is_ip6) {
+     conn_key6(&kv6, &conn_key);
+     hash = clib_bihash_hash_40_8(&kv6);
+     CLIB_PREFETCH(mct->conn_hash6.buckets 
+                   + (hash & (mct->conn_hash6.nbuckets - 1)),
+                   CLIB_CACHE_LINE_BYTES, LOAD);
+  } else {
+     conn_key4(&kv4, &conn_key);
+     hash = clib_bihash_hash_16_8(&kv4);
+     CLIB_PREFETCH(mct->conn_hash4.buckets 
+                   + (hash & (mct->conn_hash4.nbuckets - 1)),
+                   CLIB_CACHE_LINE_BYTES, LOAD);
+  }
+  return hash;
 }
 
 int mmb_find_conn(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple,
-		            clib_bihash_kv_48_8_t *pkt_conn_id) { 
-  return (BV(clib_bihash_search) 
-            (&mct->conn_hash, &pkt_5tuple->kv, pkt_conn_id) == 0);
+                  u64 hash, mmb_conn_id_t *pkt_conn_id) { 
+  mmb_5tuple_t conn_key;
+  int swap = canonical_5tuple(&conn_key, pkt_5tuple);
+  clib_bihash_kv_16_8_t kv4;
+  clib_bihash_kv_40_8_t kv6;
+
+  if (pkt_5tuple->pkt_info.is_ip6) {
+     conn_key6(&kv6, &conn_key);
+     if (conn_search_with_hash_40_8(&mct->conn_hash6, hash, &kv6))
+        return 0;
+     pkt_conn_id->as_u64 = kv6.value;
+  } else {
+     conn_key4(&kv4, &conn_key);
+     if (conn_search_with_hash_16_8(&mct->conn_hash4, hash, &kv4))
+        return 0;
+     pkt_conn_id->as_u64 = kv4.value;
+  }
+
+  /* direction of the packet from the one of the lower endpoint */
+  pkt_conn_id->dir ^= swap;
+  return 1;
 }
 
 u64 get_conn_timeout_time(mmb_conn_table_t *mct, mmb_conn_t *conn) {
@@ -95,19 +311,24 @@ u64 get_conn_timeout_time(mmb_conn_table_t *mct, mmb_conn_t *conn) {
 
 void purge_conn_forced(mmb_conn_table_t *mct) {
 
-  mmb_conn_t *conn;
+  mmb_rule_set_t *set;
 
   wait_and_lock_connection_handling(mct);
 
   /* purge hash */
   mct->conn_hash_is_initialized = 0;
-  BV(clib_bihash_free) (&mct->conn_hash);
+  clib_bihash_free_16_8(&mct->conn_hash4);
+  clib_bihash_free_40_8(&mct->conn_hash6);
 
-  /* purge pool */
-  pool_flush(conn, mct->conn_pool, ({
-      vec_free(conn->rule_indexes);
-  }));
+  /* purge pools */
   pool_free(mct->conn_pool);
+  vec_free(mct->conn_cold);
+  pool_flush(set, mct->rule_sets, ({
+      vec_free(set->rule_indexes);
+  }));
+  pool_free(mct->rule_sets);
+  hash_free(mct->rule_set_by_rules);
+  mct->clock_hand = 0;
 
   mct->currently_handling_connections = 0;
 }
@@ -144,43 +365,82 @@ int purge_conn_expired(mmb_conn_table_t *mct, u64 now) {
    return 1;
 }
 
-static_always_inline void copy_reverse_5tuple(mmb_5tuple_t *to, mmb_conn_t *from) {
-   to->addr[0] = from->info.addr[1];
-   to->addr[1] = from->info.addr[0];
-   to->l4.port[0] = from->dport ? ntohs(from->dport) : from->info.l4.port[1];
-   to->l4.port[1] = from->sport ? ntohs(from->sport) : from->info.l4.port[0];  
-} 
+/**
+ * clock_victim
+ *
+ * move the clock hand over the pool, a connection referenced since the hand
+ * last passed it gets a second chance. Established tcp connections are
+ * never evicted, transient tcp ones are preferred.
+ *
+ * @return connection to evict, ~0 if none was found within 
+ *         MMB_EVICTION_SCAN connections
+ */
+static u32 clock_victim(mmb_conn_table_t *mct, u64 now) {
+   mmb_main_t *mm = &mmb_main;
+   u64 guard = MMB_EVICTION_GUARD_SEC 
+               * mm->vlib_main->clib_time.clocks_per_second;
+   u32 pool_size = vec_len(mct->conn_pool), scanned, conn_index;
+   u32 victim = ~0;
+   mmb_conn_t *conn;
+   int timeout_type;
 
-static_always_inline void copy_forward_5tuple(mmb_5tuple_t *to, mmb_conn_t *from) {
-   to->kv.key[0] = from->info.kv.key[0];
-   to->kv.key[1] = from->info.kv.key[1];
-   to->kv.key[2] = from->info.kv.key[2];
-   to->kv.key[3] = from->info.kv.key[3];
-   to->kv.key[4] = from->info.kv.key[4];
-   to->kv.key[5] = from->info.kv.key[5];
-} 
+   if (pool_size == 0)
+      return ~0;
 
-void purge_conn(mmb_conn_table_t *mct, u32 *purge_indexes) {
+   for (scanned = 0; scanned < MMB_EVICTION_SCAN; scanned++) {
+      conn_index = mct->clock_hand++;
+      if (conn_index >= pool_size)
+         conn_index = mct->clock_hand = 0;
+      if (pool_is_free_index(mct->conn_pool, conn_index))
+         continue;
 
-   mmb_conn_t *conn;
-   mmb_5tuple_t conn_key;
-   u32 *purge_index;
+      conn = pool_elt_at_index(mct->conn_pool, conn_index);
+      timeout_type = get_conn_timeout_type(mct, conn);
+      if (timeout_type == MMB_TIMEOUT_TCP_IDLE)
+         continue;
+      if (conn->referenced) {
+         conn->referenced = 0;
+         continue;
+      }
+      if (conn->last_referenced_time + guard > now)
+         continue;
 
-   vec_foreach(purge_index, purge_indexes) {
+      if (timeout_type == MMB_TIMEOUT_TCP_TRANSIENT)
+         return conn_index;
+      if (victim == ~0)
+         victim = conn_index;
+   }
+   return victim;
+}
 
-      conn = pool_elt_at_index(mct->conn_pool, *purge_index);
+/**
+ * del_conn
+ *
+ * remove connection conn_index from pool and bihash
+ */
+static void del_conn(mmb_conn_table_t *mct, u32 conn_index) {
 
-      /* purge bihash */
-      copy_forward_5tuple(&conn_key, conn);
-      mmb_del_5tuple(mct, &conn_key.kv);
+   mmb_conn_t *conn = pool_elt_at_index(mct->conn_pool, conn_index);
+   mmb_conn_cold_t *cold = vec_elt_at_index(mct->conn_cold, conn_index);
+   mmb_5tuple_t keys[2];
+   u32 key_count, key_index;
 
-      copy_reverse_5tuple(&conn_key, conn);
-      mmb_del_5tuple(mct, &conn_key.kv);
+   /* purge bihash */
+   key_count = get_conn_keys(cold, conn_index, keys);
+   for (key_index = 0; key_index < key_count; key_index++)
+      mmb_add_del_5tuple(mct, &keys[key_index], conn->is_ip6, 0);
 
-      vec_free(conn->rule_indexes);
+   put_rule_set(mct, conn->rule_set);
 
-      pool_put(mct->conn_pool, conn);
-   }
+   pool_put(mct->conn_pool, conn);
+}
+
+void purge_conn(mmb_conn_table_t *mct, u32 *purge_indexes) {
+
+   u32 *purge_index;
+
+   vec_foreach(purge_index, purge_indexes)
+      del_conn(mct, *purge_index);
 }
 
 void wait_and_lock_connection_handling(mmb_conn_table_t *mct) {
@@ -196,31 +456,38 @@ void wait_and_lock_connection_handling(mmb_conn_table_t *mct) {
 void purge_conn_index(mmb_conn_table_t *mct, u32 rule_index) {
 
    mmb_conn_t *conn;
-   u32 *purge_indexes = 0, index_of_index;   
+   u32 *purge_indexes = 0, *rule_indexes = 0, index_of_index, set_index;   
 
    wait_and_lock_connection_handling(mct);
 
    /* remove rule_index from connections */
    pool_foreach(conn, mct->conn_pool, ({
 
-      index_of_index = vec_find(conn->rule_indexes, rule_index);
+      index_of_index = vec_find(mmb_conn_rule_set(mct, conn->rule_set), 
+                                rule_index);
       if (index_of_index == ~0)
          continue;
 
-      if (vec_len(conn->rule_indexes) == 1) {
+      if (vec_len(mmb_conn_rule_set(mct, conn->rule_set)) == 1) {
          vec_add1(purge_indexes, conn - mct->conn_pool);
-         vec_free(conn->rule_indexes);
       } else { /* conn still used by other rules */
-         vec_delete(conn->rule_indexes, 1, index_of_index);
+         vec_reset_length(rule_indexes);
+         vec_append(rule_indexes, mmb_conn_rule_set(mct, conn->rule_set));
+         vec_delete(rule_indexes, 1, index_of_index);
+         set_index = get_rule_set(mct, rule_indexes);
+         put_rule_set(mct, conn->rule_set);
+         conn->rule_set = set_index;
       }
 
    }));
+   vec_free(rule_indexes);
+
+   /* before decrementing, that could make a remaining set equal theirs */
+   purge_conn(mct, purge_indexes);
    
    /* decrement rules with index > rule_index */
    update_conn_pool_internal(mct, rule_index);
 
-   purge_conn(mct, purge_indexes);
-
    mct->currently_handling_connections = 0;
 }
 
@@ -234,14 +501,19 @@ void update_conn_pool(mmb_conn_table_t *mct, u32 rule_index) {
 void update_conn_pool_internal(mmb_conn_table_t *mct, u32 rule_index) {
 
    u32 *current_rule_index;   
-   mmb_conn_t *conn;
+   mmb_rule_set_t *set;
 
-   pool_foreach(conn, mct->conn_pool, ({
+   /* distinct sets without rule_index stay distinct, rehash them */
+   hash_free(mct->rule_set_by_rules);
+   mct->rule_set_by_rules = hash_create_vec(0, sizeof(u32), sizeof(uword));
+   pool_foreach(set, mct->rule_sets, ({
 
-      vec_foreach(current_rule_index, conn->rule_indexes) {
+      vec_foreach(current_rule_index, set->rule_indexes) {
          if (*current_rule_index > rule_index) 
             (*current_rule_index)--;
       }
+      hash_set_mem(mct->rule_set_by_rules, set->rule_indexes, 
+                   set - mct->rule_sets);
    }));
 }
 
@@ -263,7 +535,7 @@ static_always_inline u16 random_bounded_u16(u32 *seed, uword lo, uword hi) {
  * init shuffle mapping offset
  */
 static_always_inline void init_conn_shuffle_seed(mmb_main_t *mm,
-                                                 mmb_conn_t *conn,
+                                                 mmb_conn_cold_t *conn,
                                                  mmb_rule_t *rule) {
    mmb_target_t *target;
 
@@ -310,46 +582,65 @@ static_always_inline void init_conn_shuffle_seed(mmb_main_t *mm,
    }   
 }
 
-void mmb_add_conn(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple, 
-                  u32 *matches_stateful, u32 *matches_shuffle, u64 now) {
+mmb_conn_add_result_t mmb_add_conn(mmb_conn_table_t *mct, 
+                                   mmb_runtime_t *rt,
+                                   mmb_5tuple_t *pkt_5tuple, 
+                                   u32 *matches_stateful, 
+                                   u32 *matches_shuffle, u64 now) {
 
    mmb_main_t *mm = &mmb_main;
    mmb_conn_id_t conn_id;
-   mmb_5tuple_t conn_key;
+   mmb_5tuple_t keys[2];
    mmb_conn_t *conn;
+   mmb_conn_cold_t *cold;
    mmb_rule_t *rule;
-   u32 *match;
+   u32 *match, key_count, key_index;
+   mmb_conn_add_result_t result = MMB_CONN_ADDED;
+
+   if (pool_elts(mct->conn_pool) >= mct->max_connections) {
+      u32 victim = ~0;
+
+      if (mct->eviction == MMB_EVICTION_LRU)
+         victim = clock_victim(mct, now);
+      if (victim == ~0)
+         return MMB_CONN_REFUSED;
+
+      del_conn(mct, victim);
+      result = MMB_CONN_ADDED_EVICTING;
+   }
 
    /* init connection state*/
-   pool_get(mct->conn_pool, conn);
+   pool_get_aligned(mct->conn_pool, conn, sizeof(mmb_conn_t));
    memset(conn, 0, sizeof(*conn));
    conn_id.conn_index = conn - mct->conn_pool;
-   clib_memcpy(conn, pkt_5tuple, sizeof(pkt_5tuple->kv.key));
+   vec_validate(mct->conn_cold, conn_id.conn_index);
+   cold = vec_elt_at_index(mct->conn_cold, conn_id.conn_index);
+   memset(cold, 0, sizeof(*cold));
+   clib_memcpy(&cold->info, pkt_5tuple, sizeof(pkt_5tuple->kv.key));
+   conn->proto = pkt_5tuple->l4.proto;
+   conn->is_ip6 = pkt_5tuple->pkt_info.is_ip6;
    conn->last_active_time = now;
-   conn->rule_indexes = vec_dup(matches_stateful);
+   mmb_reference_conn(conn, now);
+   conn->rule_set = get_rule_set(mct, matches_stateful);
    conn->tcp_flags_seen.as_u16 = 0;
    if (pkt_5tuple->pkt_info.tcp_flags_valid) 
       conn->tcp_flags_seen.as_u8[0] = pkt_5tuple->pkt_info.tcp_flags;
 
    /* init shuffle offset if needed */
    vec_foreach(match, matches_shuffle) {
-      rule = mm->rules + *match;
-      init_conn_shuffle_seed(mm, conn, rule);
+      rule = mmb_runtime_rule(rt, *match);
+      if (rule)
+         init_conn_shuffle_seed(mm, cold, rule);
    }
 
-   /* adding forward 5tuple */
-   copy_forward_5tuple(&conn_key, conn);
-   conn_key.kv.value = conn_id.as_u64; 
-   mmb_add_5tuple(mct, &conn_key.kv);  
-
-   /* adding backward 5tuple */
-   copy_reverse_5tuple(&conn_key, conn);
-   conn_id.dir = 1;
-   conn_key.kv.value = conn_id.as_u64; 
-   mmb_add_5tuple(mct, &conn_key.kv);
+   /* adding canonical 5tuples, one unless shuffled */
+   key_count = get_conn_keys(cold, conn_id.conn_index, keys);
+   for (key_index = 0; key_index < key_count; key_index++)
+      mmb_add_del_5tuple(mct, &keys[key_index], conn->is_ip6, 1);
 
    /* put conn_index in 5tuple for the classify node */
    pkt_5tuple->pkt_info.conn_index = conn_id.conn_index; 
+   return result;
 }
 
 void mmb_track_conn(mmb_conn_t *conn, mmb_5tuple_t *pkt_5tuple, u8 dir, u64 now) {
@@ -361,28 +652,21 @@ void mmb_track_conn(mmb_conn_t *conn, mmb_5tuple_t *pkt_5tuple, u8 dir, u64 now)
   }
 }
 
-static_always_inline int offset_within_packet(vlib_buffer_t *b0, int offset) {
-  /* For the purposes of this code, "within" means we have at least 8 bytes after it */
-  return (offset <= (b0->current_length - 8));
-}
-
-void mmb_fill_5tuple(vlib_buffer_t *b0, u8 *h0, int is_ip6, mmb_5tuple_t *pkt_5tuple) {
+void mmb_fill_5tuple(u8 *h0, mmb_headers_t *hdr0, int is_ip6, 
+                     mmb_5tuple_t *pkt_5tuple) {
 
    int l4_offset;
    u16 ports[2];
    u16 proto;
 
    pkt_5tuple->kv.key[4] = 0;
-   pkt_5tuple->kv.key[5] = 0; /*XXX 48_8*/
+   pkt_5tuple->kv.key[5] = 0;
    pkt_5tuple->kv.value = 0;
+   pkt_5tuple->pkt_info.is_ip6 = is_ip6;
 
    if (is_ip6) {
       clib_memcpy (&pkt_5tuple->addr, h0 + offsetof(ip6_header_t,src_address),
 		             sizeof(pkt_5tuple->addr));
-      proto = *(u8 *) (h0 + offsetof(ip6_header_t, protocol));
-
-      l4_offset = sizeof(ip6_header_t);
-      /* XXX skip extension headers */
    } else { /* ip4 */
       pkt_5tuple->kv.key[0] = 0;
       pkt_5tuple->kv.key[1] = 0;
@@ -392,14 +676,13 @@ void mmb_fill_5tuple(vlib_buffer_t *b0, u8 *h0, int is_ip6, mmb_5tuple_t *pkt_5t
 		             sizeof(pkt_5tuple->addr[0].ip4));
       clib_memcpy(&pkt_5tuple->addr[1].ip4, h0 + offsetof(ip4_header_t,dst_address),
 		             sizeof(pkt_5tuple->addr[1].ip4));
-      proto = *(u8 *)(h0 + offsetof(ip4_header_t,protocol));
-      l4_offset = sizeof(ip4_header_t);
-
-      /** XXX handle nonfirst fragments here */
    }
 
+   /* past extension headers, none for non-first fragments */
+   proto = hdr0->l4_proto;
+   l4_offset = hdr0->l4_offset;
    pkt_5tuple->l4.proto = proto;
-   if (PREDICT_TRUE(offset_within_packet(b0, l4_offset))) {
+   if (PREDICT_TRUE(hdr0->l4_valid)) {
 
       if ((proto == IPPROTO_TCP) || (proto == IPPROTO_UDP)) {
 
@@ -413,24 +696,126 @@ void mmb_fill_5tuple(vlib_buffer_t *b0, u8 *h0, int is_ip6, mmb_5tuple_t *pkt_5t
         pkt_5tuple->pkt_info.l4_valid = 1;
 	   } else if ((proto == IP_PROTOCOL_ICMP) || (proto == IP_PROTOCOL_ICMP6)) {
          
-        /** XXX match quoted packet here */
+        /* errors are tracked by their quoted packet, see mmb_fill_quoted_5tuple */
         pkt_5tuple->l4.port[0] =
            *(u8 *) (h0 + l4_offset + offsetof(icmp46_header_t, type));
         pkt_5tuple->l4.port[1] =
            *(u8 *) (h0 + l4_offset + offsetof(icmp46_header_t, code));
         pkt_5tuple->pkt_info.l4_valid = 1;
-        pkt_5tuple->pkt_info.is_quoted_packet = 1;
+        pkt_5tuple->pkt_info.is_quoted_packet = hdr0->icmp_error;
       }
    }
 }
 
+int mmb_fill_quoted_5tuple(u8 *h0, u32 len0, mmb_headers_t *hdr0, int is_ip6, 
+                           mmb_5tuple_t *pkt_5tuple) {
+
+   u32 offset = hdr0->l4_offset + 8; /* icmp header, unused or mtu */
+   mmb_headers_t quoted_hdr;
+   mmb_5tuple_t quoted;
+
+   if (offset + (is_ip6 ? sizeof(ip6_header_t) : sizeof(ip4_header_t)) > len0)
+      return 0;
+
+   mmb_headers_parse(&quoted_hdr, h0 + offset, len0 - offset, is_ip6);
+   if (quoted_hdr.l4_proto != IP_PROTOCOL_TCP 
+       && quoted_hdr.l4_proto != IP_PROTOCOL_UDP)
+      return 0;
+   mmb_fill_5tuple(h0 + offset, &quoted_hdr, is_ip6, &quoted);
+   if (!quoted.pkt_info.l4_valid)
+      return 0;
+
+   /* the error goes back to the source of the quoted packet */
+   pkt_5tuple->kv.key[4] = 0;
+   pkt_5tuple->kv.key[5] = 0;
+   pkt_5tuple->kv.value = 0;
+   pkt_5tuple->addr[0] = quoted.addr[1];
+   pkt_5tuple->addr[1] = quoted.addr[0];
+   pkt_5tuple->l4.proto = quoted.l4.proto;
+   pkt_5tuple->l4.port[0] = quoted.l4.port[1];
+   pkt_5tuple->l4.port[1] = quoted.l4.port[0];
+   pkt_5tuple->pkt_info.l4_valid = 1;
+   pkt_5tuple->pkt_info.is_quoted_packet = 1;
+   pkt_5tuple->pkt_info.is_ip6 = is_ip6;
+   return 1;
+}
+
+static_always_inline u32 frag_hash(ip4_header_t *ip4) {
+   u64 key = ((u64) ip4->src_address.as_u32 << 32) ^ ip4->dst_address.as_u32
+             ^ ((u64) ip4->fragment_id << 8) ^ ip4->protocol;
+   
+   return clib_xxhash(key) & (MMB_FRAG_CACHE_SIZE - 1);
+}
+
+static_always_inline int frag_is_of(mmb_frag_t *frag, ip4_header_t *ip4) {
+   return frag->addr[0] == ip4->src_address.as_u32
+          && frag->addr[1] == ip4->dst_address.as_u32
+          && frag->id == ip4->fragment_id && frag->proto == ip4->protocol;
+}
+
+void mmb_track_frag(mmb_conn_table_t *mct, u32 thread_index, u8 *h0, 
+                    mmb_5tuple_t *pkt_5tuple, u64 now) {
+
+   mmb_frag_cache_t *cache = vec_elt_at_index(mct->frag_caches, thread_index);
+   ip4_header_t *ip4 = (ip4_header_t*)h0;
+   mmb_frag_t *frag;
+
+   if (PREDICT_TRUE(!ip4_is_fragment(ip4)))
+      return;
+
+   frag = &cache->frags[frag_hash(ip4)];
+   if (ip4_get_fragment_offset(ip4) == 0) { /* first fragment */
+      if (!pkt_5tuple->pkt_info.l4_valid)
+         return;
+      frag->addr[0] = ip4->src_address.as_u32;
+      frag->addr[1] = ip4->dst_address.as_u32;
+      frag->id = ip4->fragment_id;
+      frag->proto = ip4->protocol;
+      frag->port[0] = pkt_5tuple->l4.port[0];
+      frag->port[1] = pkt_5tuple->l4.port[1];
+      frag->expires = now + MMB_FRAG_TIMEOUT_SEC 
+                      * mmb_main.vlib_main->clib_time.clocks_per_second;
+      return;
+   }
+
+   pkt_5tuple->pkt_info.is_nonfirst_fragment = 1;
+   if (frag_is_of(frag, ip4) && frag->expires > now) {
+      pkt_5tuple->l4.port[0] = frag->port[0];
+      pkt_5tuple->l4.port[1] = frag->port[1];
+      pkt_5tuple->pkt_info.l4_valid = 1;
+      cache->hits++;
+   } else
+      cache->misses++;
+}
+
 void mmb_conn_hash_init() {
    mmb_conn_table_t *mct = &mmb_conn_table;
+   vlib_thread_main_t *tm = vlib_get_thread_main();
+   uword kv4_size = sizeof(clib_bihash_kv_16_8_t);
+   uword kv6_size = sizeof(clib_bihash_kv_40_8_t);
+   uword memory4 = mct->conn_memory4, memory6 = mct->conn_memory6;
+   mmb_frag_cache_t *cache;
 
    if (!mct->conn_hash_is_initialized) {
-      BV (clib_bihash_init) (&mct->conn_hash, "MMB plugin conn lookup",
-                             MMB_CONN_TABLE_DEFAULT_HASH_NUM_BUCKETS, 
-                             MMB_CONN_TABLE_DEFAULT_HASH_MEMORY_SIZE);
+      /* conn_memory is shared in proportion to the entry sizes */
+      if (memory4 == 0)
+         memory4 = mct->conn_memory / (kv4_size + kv6_size) * kv4_size;
+      if (memory6 == 0)
+         memory6 = mct->conn_memory / (kv4_size + kv6_size) * kv6_size;
+      clib_bihash_init_16_8(&mct->conn_hash4, "MMB plugin ip4 conn lookup",
+                            mct->conn_buckets, memory4);
+      clib_bihash_init_40_8(&mct->conn_hash6, "MMB plugin ip6 conn lookup",
+                            mct->conn_buckets, memory6);
+      if (!mct->rule_set_by_rules)
+         mct->rule_set_by_rules = hash_create_vec(0, sizeof(u32), 
+                                                  sizeof(uword));
+      vec_validate_aligned(mct->frag_caches, tm->n_vlib_mains - 1,
+                           CLIB_CACHE_LINE_BYTES);
+      vec_foreach(cache, mct->frag_caches)
+         vec_validate_aligned(cache->frags, MMB_FRAG_CACHE_SIZE - 1,
+                              CLIB_CACHE_LINE_BYTES);
+      /* frag caches are ready before nodes see the table */
+      CLIB_MEMORY_BARRIER();
       mct->conn_hash_is_initialized = 1;
    }
 
@@ -445,6 +830,10 @@ clib_error_t *mmb_conn_table_init(vlib_main_t *vm) {
    mct->timeouts_value[MMB_TIMEOUT_TCP_TRANSIENT] = TCP_SESSION_TRANSIENT_TIMEOUT_SEC;
    mct->timeouts_value[MMB_TIMEOUT_TCP_IDLE] = TCP_SESSION_IDLE_TIMEOUT_SEC;
    mct->timeouts_value[MMB_TIMEOUT_UDP_IDLE] = UDP_SESSION_IDLE_TIMEOUT_SEC;
+   mct->conn_buckets = MMB_CONN_TABLE_DEFAULT_HASH_NUM_BUCKETS;
+   mct->conn_memory = MMB_CONN_TABLE_DEFAULT_HASH_MEMORY_SIZE;
+   mct->max_connections = MMB_CONN_TABLE_DEFAULT_MAX_ENTRIES;
+   mct->eviction = MMB_EVICTION_LRU;
 
    return error;
 }
@@ -26,7 +26,13 @@
 
 #include <stddef.h>
 #include <vppinfra/bihash_48_8.h>
+#include <vppinfra/bihash_16_8.h>
+#include <vppinfra/bihash_40_8.h>
 #include <vppinfra/error.h>
+#include <mmb/mmb_headers.h>
+
+/* rule snapshot, see mmb_runtime.h */
+struct mmb_runtime;
 
 /* XXX: add max entries val */
 /**
@@ -48,6 +54,26 @@ enum mmb_timeout_e {
   MMB_N_TIMEOUTS
 };
 
+/* admission of a connection to a full table */
+enum mmb_eviction_e {
+  MMB_EVICTION_NONE = 0, /* refuse it */
+  MMB_EVICTION_LRU, /* evict a transient tcp, else udp, connection not
+                       referenced since the clock hand last passed it */
+};
+
+/* connections examined by the clock hand on admission to a full table */
+#define MMB_EVICTION_SCAN 64
+/* connections referenced more recently are never evicted, packets of
+ * frames still handled by other threads may refer to them */
+#define MMB_EVICTION_GUARD_SEC 0.01
+
+/* mmb_add_conn results */
+typedef enum {
+  MMB_CONN_REFUSED = 0,
+  MMB_CONN_ADDED,
+  MMB_CONN_ADDED_EVICTING,
+} mmb_conn_add_result_t;
+
 typedef union {
   u64 as_u64;
   struct {
@@ -89,14 +115,31 @@ typedef union {
   clib_bihash_kv_48_8_t kv; 
 } mmb_5tuple_t;
 
+/* 
+ * connection state read or written by every tracked packet, 
+ * two per cache line 
+ */
 typedef struct {
-  mmb_5tuple_t info; /* 56 */
-  u64 last_active_time;   /* +8 bytes = 64 */
-  u32 *rule_indexes;  /* +4 = 4 */
+  u64 last_active_time;   /* 8 */
+  u32 rule_set;  /* +4 = 12 */
   union {
     u8 as_u8[2];
     u16 as_u16;
-  } tcp_flags_seen;   /* +2 bytes = 6 */
+  } tcp_flags_seen;   /* +2 bytes = 14 */
+  u8 proto; /* +1 = 15 */
+  u8 is_ip6:1;
+  u8 referenced:1; /* set by packets, cleared by the clock hand */
+  u8 unused1:6; /* +1 = 16 */
+  u64 last_referenced_time; /* quoted icmp errors included */ /* +8 = 24 */
+  u64 unused2; /* +8 = 32 */
+} mmb_conn_t;
+
+/* 
+ * connection state read on add, purge and shuffle only, 
+ * at the index of its connection in the pool 
+ */
+typedef struct {
+  mmb_5tuple_t info; /* 56 */
 
   /* 'shuffle' state */
   u32 tcp_seq_offset;
@@ -105,14 +148,10 @@ typedef struct {
   u16 initial_sport;
   u16 dport;/* in network byte order */
   u16 initial_dport;
-  u32 ip_id; /* +20 = 26 */
+  u32 ip_id; /* +20 = 76 */
   u8 mapped_sack:1;
-
-  u8 unused1:7;/* +1 = 27 */
-  u8 unused2; /* +1 = 28 */
-  u32 unused3; /* +4 = 32 */
-  u64 unused4[4]; /* +32 = 64 */
-} mmb_conn_t;
+  u8 unused1:7; /* +1 = 77 */
+} mmb_conn_cold_t;
 
 typedef struct {
   union {
@@ -125,16 +164,59 @@ typedef struct {
   };
 } mmb_conn_id_t;
 
+/* ports of the first fragment of an ip4 datagram */
+typedef struct {
+  u32 addr[2];
+  u16 id;
+  u8 proto;
+  u8 unused;
+  u16 port[2];
+  u64 expires; /* ticks */
+} mmb_frag_t;
+
+/* per thread, direct mapped on (src, dst, proto, ip-id) */
+typedef struct {
+  mmb_frag_t *frags;
+  u64 hits; /* non-first fragments given ports */
+  u64 misses; /* non-first fragments whose first fragment is unknown */
+} mmb_frag_cache_t;
+
+/* rule indexes shared by the connections that matched the same rules */
+typedef struct {
+  u32 *rule_indexes;
+  u32 refcount; /* connections */
+} mmb_rule_set_t;
+
+#define MMB_FRAG_CACHE_SIZE 1024
+#define MMB_FRAG_TIMEOUT_SEC 2
+
 typedef struct {
   mmb_conn_t *conn_pool;   /* connection pool */
+  mmb_conn_cold_t *conn_cold; /* parallel to conn_pool */
+
+  mmb_rule_set_t *rule_sets; /* rule sets pool */
+  uword *rule_set_by_rules; /* rule_indexes vector -> rule set index */
 
   int conn_hash_is_initialized;   /* bihash for connections index lookup */
-  clib_bihash_48_8_t conn_hash; /* XXX replace with bihash_40_8 */
+  clib_bihash_16_8_t conn_hash4; /* ip4 5tuples */
+  clib_bihash_40_8_t conn_hash6; /* ip6 5tuples */
 
   /* indicates that the connection checking is in progress */
   u32 currently_handling_connections;
 
-  u32 timeouts_value[3];
+  u32 timeouts_value[3]; /* seconds, by timeout type */
+
+  /* sizing, set at startup */
+  u32 conn_buckets;
+  uword conn_memory; /* of both tables, split by key-value size */
+  uword conn_memory4; /* of conn_hash4 if set, else its share */
+  uword conn_memory6; /* of conn_hash6 if set, else its share */
+  u32 max_connections; /* connections refused or evicted beyond */
+  u8 eviction;
+
+  u32 clock_hand; /* next pool index examined for eviction */
+
+  mmb_frag_cache_t *frag_caches; /* per thread */
 
 } mmb_conn_table_t;
 
@@ -146,29 +228,94 @@ mmb_conn_table_t mmb_conn_table;
  *
  * extract 5tuple from packet
  */
-void mmb_fill_5tuple(vlib_buffer_t *b0, u8* h0, int is_ip6, mmb_5tuple_t *pkt_5tuple);
+void mmb_fill_5tuple(u8 *h0, mmb_headers_t *hdr0, int is_ip6, 
+                     mmb_5tuple_t *pkt_5tuple);
+
+
+/**
+ * mmb_fill_quoted_5tuple
+ *
+ * extract the 5tuple of the tcp or udp packet quoted by an icmp error,
+ * reversed so that the error is tracked by the connection of the quoted
+ * packet, in the opposite direction.
+ * @return 0 if the quoted packet is too short or not tcp nor udp
+ */
+int mmb_fill_quoted_5tuple(u8 *h0, u32 len0, mmb_headers_t *hdr0, int is_ip6, 
+                           mmb_5tuple_t *pkt_5tuple);
 
+/**
+ * mmb_track_frag
+ *
+ * remember the ports of first ip4 fragments, and set them in the 5tuple of
+ * the following fragments of the same datagram, so that they are tracked
+ * by the connection of the datagram without reassembly.
+ */
+void mmb_track_frag(mmb_conn_table_t *mct, u32 thread_index, u8 *h0, 
+                    mmb_5tuple_t *pkt_5tuple, u64 now);
 
 /**
  * mmb_add_conn
  *
- * add a connection to connection hash and pool, set timestamp&rule indices to pool
+ * add a connection to connection hash and pool, set timestamp and the rule
+ * set of matches_stateful to pool. A full table evicts a connection found
+ * by the clock hand if eviction is enabled.
  *
+ * @param rt snapshot the packet was classified with, matches index its rules
  * @param matches_stateful contains indexes of all matched stateful openers
  * @param matches_suffle contains indexes of matched stateful openers that require
  *                       random seed.
+ * @return MMB_CONN_REFUSED if the table holds max_connections already and 
+ *         none can be evicted
+ */
+mmb_conn_add_result_t mmb_add_conn(mmb_conn_table_t *mct, 
+                                   struct mmb_runtime *rt,
+                                   mmb_5tuple_t *conn_key, 
+                                   u32 *matches_stateful, 
+                                   u32 *matches_shuffle, u64 now);
+
+/**
+ * mmb_reference_conn
+ *
+ * note that a packet refers to a connection, it is spared by the next pass
+ * of the clock hand. Only the connection is written.
+ */
+static_always_inline void mmb_reference_conn(mmb_conn_t *conn, u64 now) {
+  conn->last_referenced_time = now;
+  if (!conn->referenced)
+    conn->referenced = 1;
+}
+
+/**
+ * mmb_conn_rule_set
+ *
+ * @return rule indexes of rule set set_index, 0 if ~0 or freed
+ */
+static_always_inline u32 *mmb_conn_rule_set(mmb_conn_table_t *mct, 
+                                            u32 set_index) {
+  if (set_index == ~0 || pool_is_free_index(mct->rule_sets, set_index))
+    return 0;
+  return pool_elt_at_index(mct->rule_sets, set_index)->rule_indexes;
+}
+
+/**
+ * mmb_prefetch_conn
+ *
+ * prefetch the bihash bucket of the connection of pkt_5tuple, to be
+ * searched by mmb_find_conn
+ * @return hash of the connection key
  */
-void mmb_add_conn(mmb_conn_table_t *mct, mmb_5tuple_t *conn_key, 
-                  u32 *matches_stateful, u32 *matches_shuffle, u64 now);
+u64 mmb_prefetch_conn(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple);
 
 /**
  * mmb_find_conn
  *
  * lookup connection bihash to find if 5tuple is registered
- * if it is, set value of pkt_conn_id to connection_index
+ * if it is, set value of pkt_conn_id to connection_index and direction of
+ * the packet. Both directions share a key, lower endpoint first.
+ * @param hash hash of the key, returned by mmb_prefetch_conn
  */
 int mmb_find_conn(mmb_conn_table_t *mct, mmb_5tuple_t *pkt_5tuple, 
-                  clib_bihash_kv_48_8_t *pkt_conn_id);
+                  u64 hash, mmb_conn_id_t *pkt_conn_id);
 
 /**
  * mmb_track_conn
@@ -242,7 +389,7 @@ inline int get_conn_timeout_type(mmb_conn_table_t *mct, mmb_conn_t *conn) {
   u16 masked_flags =
     conn->tcp_flags_seen.as_u16 & ((TCP_FLAGS_RSTFINACKSYN << 8) +
 				   TCP_FLAGS_RSTFINACKSYN);
-  switch (conn->info.l4.proto) {
+  switch (conn->proto) {
     case IPPROTO_TCP:
       if (((TCP_FLAGS_ACKSYN << 8) + TCP_FLAGS_ACKSYN) == masked_flags)
 	      return MMB_TIMEOUT_TCP_IDLE;
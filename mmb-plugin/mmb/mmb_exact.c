@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * exact 5-tuple rules.
+ */
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_exact.h>
+
+typedef struct {
+  u8 protocol;
+  u8 saddr;
+  u8 daddr;
+  u8 ports; /*! sport then dport */
+  u8 addr_width;
+} mmb_exact_layout_t;
+
+static const mmb_exact_layout_t exact_layouts[MMB_CLASSIFY_N_TABLES] = {
+  [MMB_CLASSIFY_TABLE_IP4] = { 9, 12, 16, 20, 4 },
+  [MMB_CLASSIFY_TABLE_IP6] = { 6, 8, 24, 40, 16 },
+};
+
+static_always_inline u32 rule_tid(mmb_rule_t *rule) {
+  return rule->l3 == ETHERNET_TYPE_IP6
+         ? MMB_CLASSIFY_TABLE_IP6 : MMB_CLASSIFY_TABLE_IP4;
+}
+
+/**
+ * rule_key
+ *
+ * @return byte of the classifier key of rule at offset of the ip header,
+ *         mask in *mask
+ */
+static_always_inline u8 rule_key(mmb_rule_t *rule, u32 offset, u8 *mask) {
+  u32 skip = rule->classify_skip * sizeof(u32x4);
+
+  if (offset < skip || offset - skip >= vec_len(rule->classify_mask)) {
+    *mask = 0;
+    return 0;
+  }
+  *mask = rule->classify_mask[offset - skip];
+  return rule->classify_key[offset - skip] & *mask;
+}
+
+static_always_inline int in_5tuple(const mmb_exact_layout_t *layout,
+                                   u32 offset) {
+  return offset == layout->protocol
+         || (offset >= layout->saddr && offset < layout->saddr
+                                                 + layout->addr_width)
+         || (offset >= layout->daddr && offset < layout->daddr
+                                                 + layout->addr_width)
+         || (offset >= layout->ports && offset < layout->ports + 4);
+}
+
+int mmb_exact_rule_eligible(mmb_rule_t *rule) {
+  const mmb_exact_layout_t *layout;
+  u32 offset, length;
+  u8 key, mask;
+
+  if (rule->in != ~0 || rule->out != ~0 || vec_len(rule->classify_mask) == 0
+      || (rule->l3 != ETHERNET_TYPE_IP4 && rule->l3 != ETHERNET_TYPE_IP6))
+    return 0;
+
+  layout = &exact_layouts[rule_tid(rule)];
+  key = rule_key(rule, layout->protocol, &mask);
+  if (mask != 0xff || (key != IP_PROTOCOL_TCP && key != IP_PROTOCOL_UDP))
+    return 0;
+
+  length = clib_max(rule->classify_skip * sizeof(u32x4) 
+                    + vec_len(rule->classify_mask), layout->ports + 4);
+  for (offset = 0; offset < length; offset++) {
+    rule_key(rule, offset, &mask);
+    if (in_5tuple(layout, offset)) {
+      if (mask != 0xff)
+        return 0;
+    /* ip version is implied by the node */
+    } else if (mask != 0 && (offset != 0 || (mask & 0x0f) != 0)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * exact_key
+ *
+ * write the 5-tuple of a rule as mmb_fill_5tuple extracts it from packets
+ */
+static void exact_key(mmb_rule_t *rule, clib_bihash_kv_48_8_t *kv) {
+  const mmb_exact_layout_t *layout = &exact_layouts[rule_tid(rule)];
+  mmb_5tuple_t *tuple = (mmb_5tuple_t *) kv;
+  u8 *addr[2], mask;
+  u32 index, port;
+
+  memset(tuple, 0, sizeof(*tuple));
+  if (rule_tid(rule) == MMB_CLASSIFY_TABLE_IP4) {
+    addr[0] = tuple->addr[0].ip4.as_u8;
+    addr[1] = tuple->addr[1].ip4.as_u8;
+  } else {
+    addr[0] = tuple->addr[0].ip6.as_u8;
+    addr[1] = tuple->addr[1].ip6.as_u8;
+  }
+  for (index = 0; index < layout->addr_width; index++) {
+    addr[0][index] = rule_key(rule, layout->saddr + index, &mask);
+    addr[1][index] = rule_key(rule, layout->daddr + index, &mask);
+  }
+
+  tuple->l4.proto = rule_key(rule, layout->protocol, &mask);
+  for (index = 0; index < 2; index++) {
+    port = rule_key(rule, layout->ports + 2 * index, &mask) << 8;
+    port |= rule_key(rule, layout->ports + 2 * index + 1, &mask);
+    tuple->l4.port[index] = port;
+  }
+}
+
+static mmb_exact_t *exact_create(mmb_rule_t *rules, u32 *rule_indexes) {
+  mmb_exact_t *exact = clib_mem_alloc(sizeof(mmb_exact_t));
+  u32 count = vec_len(rule_indexes), *rule_index, *rule_set;
+  clib_bihash_kv_48_8_t kv, value;
+
+  memset(exact, 0, sizeof(mmb_exact_t));
+  clib_bihash_init_48_8(&exact->hash, "mmb exact 5-tuples",
+                        1 << max_log2(clib_max(count / 2, 1)),
+                        clib_max(MMB_EXACT_MIN_MEMORY, 
+                                 count * MMB_EXACT_MEMORY_PER_KEY));
+
+  vec_foreach(rule_index, rule_indexes) {
+    exact_key(&rules[*rule_index], &kv);
+    /* rules of the same 5-tuple share a set */
+    if (clib_bihash_search_48_8(&exact->hash, &kv, &value) == 0) {
+      vec_add1(exact->rule_sets[value.value], *rule_index);
+      continue;
+    }
+    rule_set = 0;
+    vec_add1(rule_set, *rule_index);
+    kv.value = vec_len(exact->rule_sets);
+    vec_add1(exact->rule_sets, rule_set);
+    clib_bihash_add_del_48_8(&exact->hash, &kv, 1);
+  }
+  exact->rule_count = count;
+  return exact;
+}
+
+void mmb_exact_build(mmb_rule_t *rules,
+                     mmb_exact_t *exact[MMB_CLASSIFY_N_TABLES]) {
+  u32 *rule_indexes[MMB_CLASSIFY_N_TABLES];
+  mmb_rule_t *rule;
+  u32 tid;
+
+  memset(rule_indexes, 0, sizeof(rule_indexes));
+  vec_foreach(rule, rules) {
+    if (rule->exact)
+      vec_add1(rule_indexes[rule_tid(rule)], rule - rules);
+  }
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++) {
+    exact[tid] = vec_len(rule_indexes[tid])
+                 ? exact_create(rules, rule_indexes[tid]) : 0;
+    vec_free(rule_indexes[tid]);
+  }
+}
+
+void mmb_exact_free(mmb_exact_t *exact) {
+  u32 **rule_set;
+
+  if (exact == 0)
+    return;
+
+  clib_bihash_free_48_8(&exact->hash);
+  vec_foreach(rule_set, exact->rule_sets) {
+    vec_free(*rule_set);
+  }
+  vec_free(exact->rule_sets);
+  clib_mem_free(exact);
+}
+
+u8 *mmb_format_exact(u8 *s, va_list *args) {
+  mmb_exact_t *exact = va_arg(*args, mmb_exact_t*);
+
+  if (exact == 0)
+    return format(s, "empty");
+
+  return format(s, "%u rules, %u 5-tuples", exact->rule_count,
+                vec_len(exact->rule_sets));
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * exact 5-tuple rules.
+ *
+ * Rules fully specifying protocol (tcp or udp), addresses and ports are
+ * kept out of the classifier chain, in one bihash by address family keyed
+ * like mmb_5tuple_t: the 5-tuple a packet already extracted for the
+ * connection table is looked up as is, with a single probe.
+ */
+
+#ifndef __included_mmb_exact_h__
+#define __included_mmb_exact_h__
+
+#include <vppinfra/vec.h>
+#include <vppinfra/bihash_48_8.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_classify.h>
+#include <mmb/mmb_conn.h>
+
+#define MMB_EXACT_MIN_MEMORY (1<<20)
+#define MMB_EXACT_MEMORY_PER_KEY 256
+
+typedef struct {
+  clib_bihash_48_8_t hash; /*! 5-tuple -> index in rule_sets */
+  u32 **rule_sets; /*! rule indexes of each 5-tuple */
+  u32 rule_count;
+} mmb_exact_t;
+
+/**
+ * mmb_exact_rule_eligible
+ *
+ * @return 1 if the classifier mask of rule covers exactly the 5-tuple of
+ *         a tcp or udp rule
+ */
+int mmb_exact_rule_eligible(mmb_rule_t *rule);
+
+/**
+ * mmb_exact_build
+ *
+ * build 5-tuple tables of rules flagged exact, by address family.
+ */
+void mmb_exact_build(mmb_rule_t *rules,
+                     mmb_exact_t *exact[MMB_CLASSIFY_N_TABLES]);
+
+void mmb_exact_free(mmb_exact_t *exact);
+
+u8 *mmb_format_exact(u8 *s, va_list *args);
+
+/**
+ * mmb_exact_lookup
+ *
+ * @return rule indexes of the 5-tuple of a packet, NULL if none
+ */
+static_always_inline u32 *mmb_exact_lookup(mmb_exact_t *exact,
+                                           mmb_5tuple_t *pkt_5tuple) {
+  clib_bihash_kv_48_8_t value;
+
+  if (!pkt_5tuple->pkt_info.l4_valid)
+    return 0;
+  if (clib_bihash_search_48_8(&exact->hash, &pkt_5tuple->kv, &value))
+    return 0;
+  return exact->rule_sets[value.value];
+}
+
+#endif /* __included_mmb_exact_h__ */
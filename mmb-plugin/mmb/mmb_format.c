@@ -386,6 +386,13 @@ uword mmb_unformat_match(unformat_input_t *input, va_list *args) {
    if (unformat(input, "!"))
      match->reverse = 1;
    
+   /* set name instead of a value */
+   if (unformat(input, "%U in %v", mmb_unformat_field,
+                    &match->field, &match->opt_kind, &match->value)) {
+     match->condition = MMB_COND_IN;
+     return 1;
+   }
+
    if (unformat(input, "%U %U %U", mmb_unformat_field, 
                     &match->field, &match->opt_kind, mmb_unformat_condition, 
                     &match->condition, mmb_unformat_value, &match->value)) 
@@ -403,7 +410,8 @@ uword mmb_unformat_match(unformat_input_t *input, va_list *args) {
    if (resize_value(match->field, &match->value) == 0)
       match->condition = 0;
    else if (!is_fixed_length(match->field) && match->condition != MMB_COND_EQ 
-                                    && match->condition != MMB_COND_NEQ)
+                                    && match->condition != MMB_COND_NEQ
+                                    && match->condition != MMB_COND_CONTAINS)
       return 0;
    return 1;
 }
@@ -608,6 +616,8 @@ u8* mmb_format_rule(u8 *s, va_list *args) {
   uword index=0;
   mmb_match_t *matches = vec_dup(rule->matches);
   vec_append(matches, rule->opt_matches);
+  vec_append(matches, rule->set_matches);
+  vec_append(matches, rule->payload_matches);
   vec_foreach_index(index, matches) {
     s = format(s, "%U%s", mmb_format_match, &matches[index],
                         (index != vec_len(matches)-1) ? " AND ":" ");
@@ -676,6 +686,8 @@ static u8* mmb_format_rule_column(u8 *s, va_list *args) {
   /* merge all matches */
   mmb_match_t *matches = vec_dup(rule->matches);
   vec_append(matches, rule->opt_matches);
+  vec_append(matches, rule->set_matches);
+  vec_append(matches, rule->payload_matches);
 
   /* merge shuffles and opt_mods */
   mmb_target_t *targets = vec_dup(rule->opt_mods);
@@ -795,6 +807,10 @@ static_always_inline u8* mmb_format_value(u8 *s, va_list *args) {
 u8* mmb_format_match(u8 *s, va_list *args) {
 
   mmb_match_t *match = va_arg(*args, mmb_match_t*);
+  if (match->condition == MMB_COND_IN)
+    return format(s, "%s%U in %v", (match->reverse) ? "! ":"",
+                          mmb_format_field, &match->field, &match->opt_kind,
+                          match->value);
   return format(s, "%s%U %U %U", (match->reverse) ? "! ":"",
                           mmb_format_field, &match->field, &match->opt_kind,
                           mmb_format_condition, &match->condition,
@@ -897,11 +913,11 @@ u8* mmb_format_table(u8 *s, va_list *args) {
       u32 session_index = 0;
 
       s = format(s, "\tsessions:\n");
-      vec_foreach_index(session_index, sessions) {
-         session = &sessions[session_index];
+      pool_foreach_index(session_index, sessions, ({
+         session = pool_elt_at_index(sessions, session_index);
          s = format(s, "\t %u:%2s%U\n", session_index, blanks, 
                     mmb_format_session, session);
-      }
+      }));
    }
 
    return s;
@@ -940,6 +956,18 @@ u8* mmb_format_tables(u8 *s, va_list *args) {
    return s;
 }
 
+u8 *mmb_format_conn_limits(u8 *s, va_list *args) {
+   mmb_conn_table_t *mct = va_arg(*args, mmb_conn_table_t*);
+
+   return format(s, "Limits: %u connections, timeouts tcp transient %us "
+                    "tcp idle %us udp idle %us, eviction %s\n", 
+                 mct->max_connections,
+                 mct->timeouts_value[MMB_TIMEOUT_TCP_TRANSIENT],
+                 mct->timeouts_value[MMB_TIMEOUT_TCP_IDLE],
+                 mct->timeouts_value[MMB_TIMEOUT_UDP_IDLE],
+                 mct->eviction == MMB_EVICTION_LRU ? "lru" : "none");
+}
+
 u8 *mmb_format_timeout_type(u8 *s, va_list *args) {
    int timeout_type = va_arg(*args, int);
 
@@ -988,26 +1016,42 @@ u8 *mmb_format_conn_table(u8 *s, va_list *args) {
    mmb_main_t *mm = &mmb_main;
    f64 cps = mm->vlib_main->clib_time.clocks_per_second;
    mmb_conn_t *conn_pool = mct->conn_pool, *conn;
+   mmb_conn_cold_t *cold;
    u32 *rule_index, conn_index;   
-   u64 now_ticks = clib_cpu_time_now();
+   u64 now_ticks = clib_cpu_time_now(), frag_hits = 0, frag_misses = 0;
+   mmb_frag_cache_t *cache;
 
    if (verbose)
-      s = format(s, "%U\n", BV(format_bihash), &mct->conn_hash, verbose);
+      s = format(s, "%U\n%U\n", format_bihash_16_8, &mct->conn_hash4, verbose,
+                 format_bihash_40_8, &mct->conn_hash6, verbose);
 
+   vec_foreach(cache, mct->frag_caches) {
+      frag_hits += cache->hits;
+      frag_misses += cache->misses;
+   }
+   if (frag_hits || frag_misses)
+      s = format(s, "Non-first fragments: %llu tracked, %llu unknown\n", 
+                 frag_hits, frag_misses);
+
+   s = format(s, "%U", mmb_format_conn_limits, mct);
    s = format(s, "Connections pool");
    if (pool_elts(conn_pool) == 0)
       s = format(s, " is empty");
+   else
+      s = format(s, ": %u connections, %u rule sets", pool_elts(conn_pool),
+                 pool_elts(mct->rule_sets));
    s = format(s, "\n");
 
    pool_foreach(conn, conn_pool,({
 
      conn_index = conn - conn_pool;
+     cold = vec_elt_at_index(mct->conn_cold, conn_index);
      s = format(s, "[%u]: %U\n", conn_index+1, mmb_format_timeout_type, 
                      get_conn_timeout_type(mct, conn));
-     s = format(s, " %U\n", mmb_format_5tuple, &conn->info);
+     s = format(s, " %U\n", mmb_format_5tuple, &cold->info);
 
      s = format(s, " rules:");
-     vec_foreach(rule_index, conn->rule_indexes) {
+     vec_foreach(rule_index, mmb_conn_rule_set(mct, conn->rule_set)) {
         s = format(s, " %u", *rule_index);
         if ((count % 20) == 0 && count > 0)
           s = format(s, "\n%7s", blanks);
@@ -1025,22 +1069,22 @@ u8 *mmb_format_conn_table(u8 *s, va_list *args) {
            s = format(s, " tcp-flags-seen forward %02x backward %02x\n", 
                        conn->tcp_flags_seen.as_u8[0], conn->tcp_flags_seen.as_u8[1]);
         
-        if (conn->tcp_seq_offset)
+        if (cold->tcp_seq_offset)
            s = format(s, " tcp-seq-num shuffled by offset %08llx\n", 
-                       conn->tcp_seq_offset);
-        if (conn->tcp_ack_offset)
+                       cold->tcp_seq_offset);
+        if (cold->tcp_ack_offset)
            s = format(s, " tcp-ack-num shuffled by offset %08llx\n", 
-                       conn->tcp_ack_offset);
-        if (conn->sport)
+                       cold->tcp_ack_offset);
+        if (cold->sport)
            s = format(s, " sport mapped to %u\n", 
-                       clib_net_to_host_u16(conn->sport));
-        if (conn->dport)
+                       clib_net_to_host_u16(cold->sport));
+        if (cold->dport)
            s = format(s, " dport mapped to %u\n", 
-                        clib_net_to_host_u16(conn->dport));
-        if (conn->ip_id)
+                        clib_net_to_host_u16(cold->dport));
+        if (cold->ip_id)
            s = format(s, " next ip-id/flow %08llx\n", 
-                        conn->ip_id);
-        if (conn->mapped_sack)
+                        cold->ip_id);
+        if (cold->mapped_sack)
            s = format(s, " SACK-aware\n");
 
         s = format(s, "\n");
@@ -40,6 +40,7 @@ u8 *mmb_format_tables(u8 *s, va_list *args);
 u8 *mmb_format_lookup_table(u8 *s, va_list *args);
 
 u8 *mmb_format_conn_table(u8 *s, va_list *args);
+u8 *mmb_format_conn_limits(u8 *s, va_list *args);
 
 u8* mmb_format_key(u8 *s, va_list *args);
 
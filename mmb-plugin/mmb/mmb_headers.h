@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *
+ * ip headers walker.
+ *
+ * The extension headers of an ip6 packet are walked once, in the classify
+ * node: the offset of each one and of the l4 header are kept for the packet
+ * and used by option matching, connection tracking and rewrite. The l4
+ * header is passed on to the rewrite node in the buffer opaque.
+ */
+
+#ifndef __included_mmb_headers_h__
+#define __included_mmb_headers_h__
+
+#include <vnet/vnet.h>
+#include <vnet/ip/ip.h>
+#include <mmb/mmb_opts.h>
+
+#define MMB_HEADERS_MAX_EH 8
+
+typedef struct {
+  u16 l4_offset; /*! from the ip header */
+  u8 l4_proto; /*! protocol of the header at l4_offset */
+  u8 l4_valid:1; /*! l4 header in the packet, its first 8 bytes at least */
+  u8 fragment:1; /*! non-first fragment, no l4 header */
+  u8 icmp_error:1; /*! icmp error, quoting a packet past its 8 bytes header */
+  u8 eh_count;
+  u8 eh_protos[MMB_HEADERS_MAX_EH]; /*! extension headers, in packet order */
+  u16 eh_offsets[MMB_HEADERS_MAX_EH];
+} mmb_headers_t;
+
+static_always_inline int mmb_headers_is_eh(u8 proto) {
+  switch (proto) {
+#define _(a,b,c) case c:
+   foreach_mmb_ip6_eh
+#undef _
+     return 1;
+   default:
+     return 0;
+  }
+}
+
+static_always_inline int mmb_headers_is_icmp_error(u8 proto, u8 type, 
+                                                   u8 is_ip6) {
+  if (is_ip6)
+    return proto == IP_PROTOCOL_ICMP6 && type < 128;
+  if (proto != IP_PROTOCOL_ICMP)
+    return 0;
+
+  switch (type) {
+    case ICMP4_destination_unreachable:
+    case ICMP4_source_quench:
+    case ICMP4_redirect:
+    case ICMP4_time_exceeded:
+    case ICMP4_parameter_problem:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+/**
+ * mmb_headers_parse
+ *
+ * walk the headers of packet h0, at most MMB_HEADERS_MAX_EH extension
+ * headers.
+ * @param len0 bytes of the packet from h0
+ */
+static_always_inline void mmb_headers_parse(mmb_headers_t *hdr, u8 *h0, 
+                                            u32 len0, u8 is_ip6) {
+  u32 offset, length;
+  u8 proto, *eh;
+
+  hdr->eh_count = 0;
+  hdr->fragment = 0;
+  hdr->icmp_error = 0;
+
+  if (!is_ip6) {
+    ip4_header_t *ip4 = (ip4_header_t*)h0;
+
+    proto = ip4->protocol;
+    offset = ip4_header_bytes(ip4);
+    hdr->fragment = ip4_get_fragment_offset(ip4) != 0;
+  } else {
+    proto = ((ip6_header_t*)h0)->protocol;
+    offset = sizeof(ip6_header_t);
+
+    while (mmb_headers_is_eh(proto) && hdr->eh_count < MMB_HEADERS_MAX_EH
+           && offset + 8 <= len0) {
+      eh = h0 + offset;
+      hdr->eh_protos[hdr->eh_count] = proto;
+      hdr->eh_offsets[hdr->eh_count] = offset;
+      hdr->eh_count++;
+
+      /* encrypted past its header */
+      if (proto == IP_PROTOCOL_IPSEC_ESP)
+        break;
+
+      if (proto == IP_PROTOCOL_IPV6_FRAGMENTATION) {
+        length = 8;
+        if (clib_net_to_host_u16(*(u16*)(eh + 2)) & ~7)
+          hdr->fragment = 1;
+      } else if (proto == IP_PROTOCOL_IPSEC_AH)
+        length = (eh[1] + 2) << 2;
+      else 
+        length = (eh[1] + 1) << 3;
+
+      proto = eh[0];
+      offset += length;
+    }
+  }
+
+  hdr->l4_proto = proto;
+  hdr->l4_offset = offset;
+  hdr->l4_valid = !hdr->fragment && !(is_ip6 && mmb_headers_is_eh(proto))
+                  && offset + 8 <= len0;
+  hdr->icmp_error = hdr->l4_valid 
+                    && mmb_headers_is_icmp_error(proto, h0[offset], is_ip6);
+}
+
+/**
+ * mmb_headers_has_eh
+ *
+ * @param proto extension header protocol, ~0 for any
+ */
+static_always_inline int mmb_headers_has_eh(mmb_headers_t *hdr, u32 proto) {
+  u32 index;
+
+  for (index = 0; index < hdr->eh_count; index++) {
+    if (proto == ~0 || hdr->eh_protos[index] == proto)
+      return 1;
+  }
+  return 0;
+}
+
+/* l4 header to and from the buffer opaque */
+static_always_inline u32 mmb_headers_l4_opaque(mmb_headers_t *hdr) {
+  return hdr->l4_offset | (hdr->l4_proto << 16) | (hdr->l4_valid << 24)
+         | (hdr->icmp_error << 25);
+}
+
+static_always_inline void mmb_headers_l4_from_opaque(mmb_headers_t *hdr, 
+                                                     u32 opaque) {
+  hdr->l4_offset = opaque & 0xffff;
+  hdr->l4_proto = (opaque >> 16) & 0xff;
+  hdr->l4_valid = (opaque >> 24) & 1;
+  hdr->icmp_error = (opaque >> 25) & 1;
+  hdr->eh_count = 0;
+}
+
+#endif /* __included_mmb_headers_h__ */
@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * named address sets.
+ */
+
+#include <vlib/vlib.h>
+#include <vlib/threads.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_ipset.h>
+
+static_always_inline u8 ipset_max_len(mmb_ipset_t *ipset) {
+  return ipset->is_ip6 ? 128 : 32;
+}
+
+static void ipset_add(mmb_ipset_main_t *imp, mmb_ipset_t *ipset,
+                      clib_bihash_kv_24_8_t *kv, u8 len) {
+  clib_bihash_kv_24_8_t value;
+  mmb_ipset_member_t *member;
+  u32 index;
+
+  if (clib_bihash_search_24_8(&imp->member_hash, kv, &value) == 0) {
+    /* existing member, only refreshes its generation */
+    member = vec_elt_at_index(ipset->members, value.value);
+    member->generation = ipset->generation;
+    return;
+  }
+
+  vec_add2(ipset->members, member, 1);
+  clib_memcpy(member->key, kv->key, sizeof(member->key));
+  member->generation = ipset->generation;
+  kv->value = member - ipset->members;
+  clib_bihash_add_del_24_8(&imp->member_hash, kv, 1);
+
+  ipset->member_count++;
+    if (ipset->length_count[len]++ == 0) {
+      for (index = 0; index < ipset->n_lengths; index++) {
+        if (ipset->lengths[index] == len)
+          break;
+      }
+      if (index == ipset->n_lengths) {
+        /* publish the length after it is written */
+        ipset->lengths[index] = len;
+        CLIB_MEMORY_BARRIER();
+        ipset->n_lengths++;
+      }
+    }
+  }
+}
+
+static void ipset_del(mmb_ipset_main_t *imp, mmb_ipset_t *ipset,
+                      clib_bihash_kv_24_8_t *kv, u8 len) {
+  clib_bihash_kv_24_8_t value, moved;
+  u32 index, last;
+
+  if (clib_bihash_search_24_8(&imp->member_hash, kv, &value) != 0)
+    return;
+
+  /* the length stays in use until the set is emptied */
+  clib_bihash_add_del_24_8(&imp->member_hash, kv, 0);
+
+  /* the last member takes the place of the deleted one */
+  index = value.value;
+  last = vec_len(ipset->members) - 1;
+  if (index != last) {
+    ipset->members[index] = ipset->members[last];
+    clib_memcpy(moved.key, ipset->members[index].key, sizeof(moved.key));
+    moved.value = index;
+    clib_bihash_add_del_24_8(&imp->member_hash, &moved, 1);
+  }
+  _vec_len(ipset->members) = last;
+
+  ipset->member_count--;
+  ipset->length_count[len]--;
+}
+
+/**
+ * ipset_del_stale
+ *
+ * remove members of a set whose generation differs from generation,
+ * ~0 removes all members.
+ */
+static void ipset_del_stale(mmb_ipset_main_t *imp, u32 ipset_index,
+                            u32 generation) {
+  mmb_ipset_t *ipset = pool_elt_at_index(imp->ipsets, ipset_index);
+  clib_bihash_kv_24_8_t kv;
+  u32 index = vec_len(ipset->members);
+
+  /* backwards, so that members moved by a removal were already seen */
+  while (index-- > 0) {
+    if (ipset->members[index].generation == generation)
+      continue;
+    clib_memcpy(kv.key, ipset->members[index].key, sizeof(kv.key));
+    ipset_del(imp, ipset, &kv, kv.key[2] & 0xff);
+  }
+
+  if (ipset->member_count == 0) {
+    ipset->n_lengths = 0;
+    memset(ipset->length_count, 0, sizeof(ipset->length_count));
+  }
+}
+
+u32 mmb_ipset_find(u8 *name) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  uword *p;
+
+  if (imp->ipset_by_name == 0)
+    return ~0;
+
+  p = hash_get_mem(imp->ipset_by_name, name);
+  return p ? p[0] : ~0;
+}
+
+int mmb_ipset_create(u8 *name, u8 is_ip6) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  vlib_main_t *vm = vlib_get_main();
+  mmb_ipset_t *ipset;
+
+  if (mmb_ipset_find(name) != ~0)
+    return -1;
+
+  if (!imp->member_hash_is_initialized) {
+    clib_bihash_init_24_8(&imp->member_hash, "mmb ipset members",
+                          MMB_IPSET_HASH_BUCKETS, MMB_IPSET_HASH_MEMORY);
+    imp->ipset_by_name = hash_create_vec(0, sizeof(u8), sizeof(uword));
+    imp->member_hash_is_initialized = 1;
+  }
+
+  /* workers read the pool */
+  vlib_worker_thread_barrier_sync(vm);
+  pool_get(imp->ipsets, ipset);
+  vlib_worker_thread_barrier_release(vm);
+
+  memset(ipset, 0, sizeof(mmb_ipset_t));
+  ipset->name = vec_dup(name);
+  ipset->is_ip6 = is_ip6;
+  hash_set_mem(imp->ipset_by_name, ipset->name, ipset - imp->ipsets);
+  return 0;
+}
+
+int mmb_ipset_delete(u8 *name) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  vlib_main_t *vm = vlib_get_main();
+  u32 ipset_index = mmb_ipset_find(name);
+  mmb_ipset_t *ipset;
+
+  if (ipset_index == ~0)
+    return -1;
+
+  ipset = pool_elt_at_index(imp->ipsets, ipset_index);
+  if (ipset->refcount)
+    return -2;
+
+  ipset_del_stale(imp, ipset_index, ~0);
+  hash_unset_mem(imp->ipset_by_name, ipset->name);
+  vec_free(ipset->name);
+  vec_free(ipset->members);
+
+  vlib_worker_thread_barrier_sync(vm);
+  pool_put(imp->ipsets, ipset);
+  vlib_worker_thread_barrier_release(vm);
+  return 0;
+}
+
+int mmb_ipset_update(u32 ipset_index, mmb_ipset_prefix_t *prefixes,
+                     int is_add, int replace) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  mmb_ipset_t *ipset = pool_elt_at_index(imp->ipsets, ipset_index);
+  mmb_ipset_prefix_t *prefix;
+  clib_bihash_kv_24_8_t kv;
+
+  vec_foreach(prefix, prefixes) {
+    if (prefix->len > ipset_max_len(ipset))
+      return -1;
+  }
+
+  if (replace) {
+    /* members not refreshed by this update are stale */
+    ipset->generation++;
+    if (ipset->generation == ~0)
+      ipset->generation = 0;
+  }
+
+  vec_foreach(prefix, prefixes) {
+    mmb_ipset_key(&kv, ipset_index, prefix->addr, ipset->is_ip6,
+                  prefix->len);
+    if (is_add || replace)
+      ipset_add(imp, ipset, &kv, prefix->len);
+    else
+      ipset_del(imp, ipset, &kv, prefix->len);
+  }
+
+  if (replace)
+    ipset_del_stale(imp, ipset_index, ipset->generation);
+  return 0;
+}
+
+clib_error_t *mmb_ipset_resolve_rule(mmb_rule_t *rule) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  mmb_ipset_match_t *ipset_match;
+  mmb_ipset_t *ipset;
+  mmb_match_t *match;
+  clib_error_t *error;
+  u32 ipset_index;
+  u8 is_ip6;
+
+  vec_foreach(match, rule->set_matches) {
+    switch (match->field) {
+      case MMB_FIELD_IP4_SADDR:
+      case MMB_FIELD_IP4_DADDR:
+        is_ip6 = 0;
+        break;
+      case MMB_FIELD_IP6_SADDR:
+      case MMB_FIELD_IP6_DADDR:
+        is_ip6 = 1;
+        break;
+      default:
+        error = clib_error_return(0, "%s cannot be matched against a set",
+                                  fields[field_toindex(match->field)]);
+        goto error;
+    }
+
+    ipset_index = mmb_ipset_find(match->value);
+    if (ipset_index == ~0) {
+      error = clib_error_return(0, "no ipset named %v", match->value);
+      goto error;
+    }
+    ipset = pool_elt_at_index(imp->ipsets, ipset_index);
+    if (ipset->is_ip6 != is_ip6) {
+      error = clib_error_return(0, "ipset %v does not hold %s addresses",
+                                match->value, is_ip6 ? "ip6" : "ip4");
+      goto error;
+    }
+
+    vec_add2(rule->ipset_matches, ipset_match, 1);
+    ipset_match->ipset_index = ipset_index;
+    ipset_match->field = match->field;
+    ipset_match->reverse = match->reverse;
+    ipset->refcount++;
+  }
+  return 0;
+
+error:
+  mmb_ipset_unref_rule(rule);
+  return error;
+}
+
+void mmb_ipset_unref_rule(mmb_rule_t *rule) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  mmb_ipset_match_t *ipset_match;
+
+  vec_foreach(ipset_match, rule->ipset_matches) {
+    pool_elt_at_index(imp->ipsets, ipset_match->ipset_index)->refcount--;
+  }
+  vec_free(rule->ipset_matches);
+}
+
+u8 *mmb_format_ipsets(u8 *s, va_list *args) {
+  mmb_ipset_main_t *imp = va_arg(*args, mmb_ipset_main_t*);
+  mmb_ipset_t *ipset;
+
+  if (pool_elts(imp->ipsets) == 0)
+    return format(s, "no ipset");
+
+  s = format(s, "%-24s%-6s%-12s%-10s%s", "name", "af", "members",
+             "lengths", "rules");
+  pool_foreach(ipset, imp->ipsets, ({
+    s = format(s, "\n%-24v%-6s%-12u%-10u%u", ipset->name,
+               ipset->is_ip6 ? "ip6" : "ip4", ipset->member_count,
+               ipset->n_lengths, ipset->refcount);
+  }));
+  return s;
+}
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * named address sets, matched by "<addr-field> in <set>".
+ *
+ * Members of every set are stored in one bihash keyed by (set, prefix
+ * length, masked address). A lookup probes each prefix length used by the
+ * set. Members are added and removed without worker barrier: bihash readers
+ * are safe against a single writer, and the prefix lengths of a set only
+ * grow until the set is flushed.
+ *
+ * Each set also keeps a vector of its members, indexed by the value of
+ * their bihash entry, so that a replace or a delete only walks that set.
+ */
+
+#ifndef __included_mmb_ipset_h__
+#define __included_mmb_ipset_h__
+
+#include <vnet/vnet.h>
+#include <vnet/ip/ip.h>
+#include <vppinfra/bihash_24_8.h>
+#include <vppinfra/error.h>
+#include <mmb/mmb.h>
+
+#define MMB_IPSET_HASH_BUCKETS (1<<18)
+#define MMB_IPSET_HASH_MEMORY (256<<20)
+#define MMB_IPSET_MAX_LENGTHS 129
+
+typedef struct {
+  u64 key[3]; /*! bihash key of the member */
+  u32 generation; /*! value of the last replace holding the member */
+} mmb_ipset_member_t;
+
+typedef struct {
+  u8 *name;
+  u8 is_ip6;
+  u32 member_count;
+  u32 refcount; /*! rules matching this set */
+  u32 generation; /*! generation of the last replace */
+  mmb_ipset_member_t *members; /*! members, bihash values index them */
+  u32 length_count[MMB_IPSET_MAX_LENGTHS]; /*! members by prefix length */
+  u8 lengths[MMB_IPSET_MAX_LENGTHS]; /*! prefix lengths in use */
+  volatile u32 n_lengths;
+} mmb_ipset_t;
+
+typedef struct {
+  u8 addr[16]; /*! network order */
+  u8 len;
+} mmb_ipset_prefix_t;
+
+typedef struct {
+  mmb_ipset_t *ipsets; /*! pool of sets */
+  uword *ipset_by_name; /*! name -> index in ipsets */
+  clib_bihash_24_8_t member_hash;
+  u8 member_hash_is_initialized;
+} mmb_ipset_main_t;
+
+mmb_ipset_main_t mmb_ipset_main;
+
+/**
+ * mmb_ipset_create
+ *
+ * @return 0 on success, -1 if a set has this name
+ */
+int mmb_ipset_create(u8 *name, u8 is_ip6);
+
+/**
+ * mmb_ipset_delete
+ *
+ * @return 0 on success, -1 if no set has this name, -2 if rules use it
+ */
+int mmb_ipset_delete(u8 *name);
+
+/**
+ * mmb_ipset_find
+ *
+ * @return index of set with given name, ~0 if none
+ */
+u32 mmb_ipset_find(u8 *name);
+
+/**
+ * mmb_ipset_update
+ *
+ * add or remove prefixes of a set. With replace, prefixes become the only
+ * members of the set: members that stay are never missing during the update.
+ *
+ * @return 0 on success, -1 if a prefix is longer than the set addresses
+ */
+int mmb_ipset_update(u32 ipset_index, mmb_ipset_prefix_t *prefixes,
+                     int is_add, int replace);
+
+/**
+ * mmb_ipset_resolve_rule
+ *
+ * bind set_matches of a rule to their sets, which stay referenced until
+ * mmb_ipset_unref_rule.
+ */
+clib_error_t *mmb_ipset_resolve_rule(mmb_rule_t *rule);
+
+void mmb_ipset_unref_rule(mmb_rule_t *rule);
+
+u8 *mmb_format_ipsets(u8 *s, va_list *args);
+
+static_always_inline void mmb_ipset_key(clib_bihash_kv_24_8_t *kv,
+                                        u32 ipset_index, u8 *addr,
+                                        u8 is_ip6, u8 len) {
+  u8 *key = (u8 *) kv->key;
+  u32 index, bytes = is_ip6 ? 16 : 4;
+
+  kv->key[0] = kv->key[1] = 0;
+  for (index = 0; index < bytes; index++) {
+    if (len >= (index+1) * 8)
+      key[index] = addr[index];
+    else if (len > index * 8)
+      key[index] = addr[index] & (0xff << (8 - (len - index * 8)));
+  }
+  kv->key[2] = ((u64) ipset_index << 8) | len;
+  kv->value = 0;
+}
+
+/**
+ * mmb_ipset_contains
+ *
+ * @return 1 if a prefix of the set covers addr (network order)
+ */
+static_always_inline int mmb_ipset_contains(u32 ipset_index, u8 *addr) {
+  mmb_ipset_main_t *imp = &mmb_ipset_main;
+  mmb_ipset_t *ipset = pool_elt_at_index(imp->ipsets, ipset_index);
+  clib_bihash_kv_24_8_t kv;
+  u32 index, n_lengths = ipset->n_lengths;
+
+  for (index = 0; index < n_lengths; index++) {
+    mmb_ipset_key(&kv, ipset_index, addr, ipset->is_ip6,
+                  ipset->lengths[index]);
+    if (clib_bihash_search_24_8(&imp->member_hash, &kv, &kv) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * mmb_ipset_match
+ *
+ * @return 1 if every "in <set>" match of rule holds for header h0
+ */
+static_always_inline int mmb_ipset_match(mmb_rule_t *rule, u8 *h0) {
+  mmb_ipset_match_t *ipset_match;
+  u8 *addr;
+
+  vec_foreach(ipset_match, rule->ipset_matches) {
+    switch (ipset_match->field) {
+      case MMB_FIELD_IP4_SADDR:
+        addr = ((ip4_header_t *) h0)->src_address.as_u8;
+        break;
+      case MMB_FIELD_IP4_DADDR:
+        addr = ((ip4_header_t *) h0)->dst_address.as_u8;
+        break;
+      case MMB_FIELD_IP6_SADDR:
+        addr = ((ip6_header_t *) h0)->src_address.as_u8;
+        break;
+      default:
+        addr = ((ip6_header_t *) h0)->dst_address.as_u8;
+        break;
+    }
+    if (mmb_ipset_contains(ipset_match->ipset_index, addr)
+        == ipset_match->reverse)
+      return 0;
+  }
+  return 1;
+}
+
+#endif /* __included_mmb_ipset_h__ */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * longest prefix match of address prefix rules.
+ */
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_lpm.h>
+
+typedef struct {
+  u8 *addr; /*! network order */
+  u8 len;
+  u32 rule_index;
+} mmb_lpm_prefix_t;
+
+mmb_lpm_dir_t mmb_lpm_rule_dir(mmb_rule_t *rule) {
+  mmb_match_t *match;
+
+  if (vec_len(rule->matches) != 1 || vec_len(rule->opt_matches) != 0
+      || rule->l4 != IP_PROTOCOL_RESERVED
+      || rule->in != ~0 || rule->out != ~0)
+    return MMB_LPM_N_DIR;
+
+  match = &rule->matches[0];
+  if (match->reverse
+      || (match->condition != 0 && match->condition != MMB_COND_EQ))
+    return MMB_LPM_N_DIR;
+
+  switch (match->field) {
+    case MMB_FIELD_IP4_SADDR:
+    case MMB_FIELD_IP6_SADDR:
+      return MMB_LPM_SRC;
+    case MMB_FIELD_IP4_DADDR:
+    case MMB_FIELD_IP6_DADDR:
+      return MMB_LPM_DST;
+    default:
+      return MMB_LPM_N_DIR;
+  }
+}
+
+/**
+ * lpm_set_add
+ *
+ * @return index of the set made of the rules of set_index and rule_index
+ */
+static u32 lpm_set_add(mmb_lpm_t *lpm, u32 set_index, u32 rule_index) {
+  u32 *rules, index;
+  uword *p;
+
+  rules = vec_dup(lpm->sets[set_index]);
+  if (vec_search(rules, rule_index) != ~0) {
+    vec_free(rules);
+    return set_index;
+  }
+
+  /* rule indexes in ascending order, as in the rules vector */
+  for (index = 0; index < vec_len(rules) && rules[index] < rule_index;
+       index++)
+    ;
+  vec_insert_elts(rules, &rule_index, 1, index);
+
+  p = hash_get_mem(lpm->set_by_rules, rules);
+  if (p) {
+    vec_free(rules);
+    return p[0];
+  }
+
+  vec_add1(lpm->sets, rules);
+  hash_set_mem(lpm->set_by_rules, rules, vec_len(lpm->sets)-1);
+  return vec_len(lpm->sets)-1;
+}
+
+static_always_inline u32 lpm_ply_add(mmb_lpm_t *lpm, u32 leaf) {
+  mmb_lpm_ply_t *ply;
+  u32 index;
+
+  vec_add2(lpm->plies, ply, 1);
+  for (index = 0; index < ARRAY_LEN(ply->slots); index++)
+    ply->slots[index] = leaf;
+  return mmb_lpm_ply(ply - lpm->plies);
+}
+
+/**
+ * lpm_slot_add
+ *
+ * add rule to a slot and, if it is a ply, to all its slots
+ */
+static void lpm_slot_add(mmb_lpm_t *lpm, u32 *slots, u32 slot_index,
+                         u32 rule_index) {
+  u32 slot = slots[slot_index], ply_index, index;
+
+  if (mmb_lpm_is_leaf(slot)) {
+    slots[slot_index] = mmb_lpm_leaf(lpm_set_add(lpm, mmb_lpm_index(slot),
+                                                 rule_index));
+    return;
+  }
+
+  ply_index = mmb_lpm_index(slot);
+  for (index = 0; index < (1 << MMB_LPM_PLY_BITS); index++)
+    lpm_slot_add(lpm, lpm->plies[ply_index].slots, index, rule_index);
+}
+
+static void lpm_add(mmb_lpm_t *lpm, mmb_lpm_prefix_t *prefix) {
+  u32 stride = MMB_LPM_ROOT_BITS, len = prefix->len, byte = 0;
+  u32 first, count, index, slot_index, ply_index = ~0;
+  u32 *slots = lpm->root;
+
+  for (;;) {
+    if (stride == MMB_LPM_ROOT_BITS)
+      slot_index = (prefix->addr[0] << 8) | prefix->addr[1];
+    else
+      slot_index = prefix->addr[byte];
+
+    if (len <= stride) {
+      /* prefix covers a range of slots */
+      count = 1 << (stride - len);
+      first = slot_index & ~(count - 1);
+      for (index = first; index < first + count; index++) {
+        slots = ply_index == ~0 ? lpm->root : lpm->plies[ply_index].slots;
+        lpm_slot_add(lpm, slots, index, prefix->rule_index);
+      }
+      return;
+    }
+
+    if (mmb_lpm_is_leaf(slots[slot_index])) {
+      u32 ply = lpm_ply_add(lpm, slots[slot_index]);
+      /* lpm->plies may have moved */
+      slots = ply_index == ~0 ? lpm->root : lpm->plies[ply_index].slots;
+      slots[slot_index] = ply;
+    }
+
+    byte += stride / 8;
+    len -= stride;
+    stride = MMB_LPM_PLY_BITS;
+    ply_index = mmb_lpm_index(slots[slot_index]);
+    slots = lpm->plies[ply_index].slots;
+  }
+}
+
+static mmb_lpm_t *lpm_create() {
+  mmb_lpm_t *lpm = clib_mem_alloc(sizeof(mmb_lpm_t));
+
+  memset(lpm, 0, sizeof(mmb_lpm_t));
+  vec_validate_init_empty(lpm->root, (1 << MMB_LPM_ROOT_BITS)-1,
+                          mmb_lpm_leaf(0));
+  vec_add1(lpm->sets, 0);
+  lpm->set_by_rules = hash_create_vec(0, sizeof(u32), sizeof(uword));
+  return lpm;
+}
+
+static int lpm_prefix_cmp(void *a, void *b) {
+  mmb_lpm_prefix_t *pa = a, *pb = b;
+
+  if (pa->len != pb->len)
+    return pa->len < pb->len ? -1 : 1;
+  return pa->rule_index < pb->rule_index ? -1 : 1;
+}
+
+void mmb_lpm_build(mmb_rule_t *rules,
+                   mmb_lpm_t *lpm[MMB_CLASSIFY_N_TABLES][MMB_LPM_N_DIR]) {
+  mmb_lpm_prefix_t *prefixes[MMB_CLASSIFY_N_TABLES][MMB_LPM_N_DIR];
+  mmb_lpm_prefix_t *prefix;
+  mmb_rule_t *rule;
+  mmb_lpm_dir_t dir;
+  u32 tid;
+
+  memset(prefixes, 0, sizeof(prefixes));
+  vec_foreach(rule, rules) {
+    if (!rule->lpm)
+      continue;
+
+    dir = mmb_lpm_rule_dir(rule);
+    tid = rule->l3 == ETHERNET_TYPE_IP4
+          ? MMB_CLASSIFY_TABLE_IP4 : MMB_CLASSIFY_TABLE_IP6;
+    vec_add2(prefixes[tid][dir], prefix, 1);
+    prefix->addr = rule->matches[0].value;
+    prefix->len = prefix->addr[tid == MMB_CLASSIFY_TABLE_IP4 ? 4 : 16];
+    prefix->rule_index = rule - rules;
+  }
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++) {
+    for (dir = 0; dir < MMB_LPM_N_DIR; dir++) {
+      lpm[tid][dir] = 0;
+      if (vec_len(prefixes[tid][dir]) == 0)
+        continue;
+
+      /* shorter prefixes first, so that few rules are pushed down */
+      vec_sort_with_function(prefixes[tid][dir], lpm_prefix_cmp);
+      lpm[tid][dir] = lpm_create();
+      vec_foreach(prefix, prefixes[tid][dir]) {
+        lpm_add(lpm[tid][dir], prefix);
+      }
+      lpm[tid][dir]->prefix_count = vec_len(prefixes[tid][dir]);
+      vec_free(prefixes[tid][dir]);
+    }
+  }
+}
+
+void mmb_lpm_free(mmb_lpm_t *lpm) {
+  u32 **set;
+
+  if (lpm == 0)
+    return;
+
+  hash_free(lpm->set_by_rules);
+  vec_foreach(set, lpm->sets) {
+    vec_free(*set);
+  }
+  vec_free(lpm->sets);
+  vec_free(lpm->plies);
+  vec_free(lpm->root);
+  clib_mem_free(lpm);
+}
+
+u8 *mmb_format_lpm(u8 *s, va_list *args) {
+  mmb_lpm_t *lpm = va_arg(*args, mmb_lpm_t*);
+
+  if (lpm == 0)
+    return format(s, "empty");
+
+  return format(s, "%u prefixes, %u plies, %u rule sets, %U",
+                lpm->prefix_count, vec_len(lpm->plies), vec_len(lpm->sets),
+                format_memory_size, vec_bytes(lpm->root)
+                                    + vec_bytes(lpm->plies));
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * longest prefix match of address prefix rules.
+ *
+ * A multibit trie with a 16 bits root and 8 bits plies (16-8-8 for IPv4).
+ * Rules of shorter prefixes are pushed down to the leaves of longer ones, so
+ * a single walk returns every rule whose prefix covers the address: one
+ * memory access up to /16, one more per 8 bits beyond.
+ */
+
+#ifndef __included_mmb_lpm_h__
+#define __included_mmb_lpm_h__
+
+#include <vppinfra/vec.h>
+#include <vppinfra/hash.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_classify.h>
+
+#define MMB_LPM_ROOT_BITS 16
+#define MMB_LPM_PLY_BITS 8
+
+/* a slot is either a leaf, (set index << 1) | 1, or a ply, ply index << 1 */
+#define mmb_lpm_is_leaf(slot) ((slot) & 1)
+#define mmb_lpm_leaf(set_index) (((set_index) << 1) | 1)
+#define mmb_lpm_ply(ply_index) ((ply_index) << 1)
+#define mmb_lpm_index(slot) ((slot) >> 1)
+
+typedef enum {
+  MMB_LPM_SRC=0,
+  MMB_LPM_DST=1,
+  MMB_LPM_N_DIR=2,
+} mmb_lpm_dir_t;
+
+typedef struct {
+  u32 slots[1 << MMB_LPM_PLY_BITS];
+} mmb_lpm_ply_t;
+
+typedef struct {
+  u32 *root; /*! 1 << MMB_LPM_ROOT_BITS slots */
+  mmb_lpm_ply_t *plies; /*! plies vector */
+  u32 **sets; /*! rule indexes by set index, set 0 is empty */
+  uword *set_by_rules; /*! rule indexes -> set index */
+  u32 prefix_count;
+} mmb_lpm_t;
+
+/**
+ * mmb_lpm_rule_dir
+ *
+ * @return direction of the address prefix of a rule matched by lpm,
+ *         MMB_LPM_N_DIR if the rule has other constraints
+ */
+mmb_lpm_dir_t mmb_lpm_rule_dir(mmb_rule_t *rule);
+
+/**
+ * mmb_lpm_build
+ *
+ * build tries of lpm rules, by address family and direction.
+ */
+void mmb_lpm_build(mmb_rule_t *rules,
+                   mmb_lpm_t *lpm[MMB_CLASSIFY_N_TABLES][MMB_LPM_N_DIR]);
+
+void mmb_lpm_free(mmb_lpm_t *lpm);
+
+u8 *mmb_format_lpm(u8 *s, va_list *args);
+
+/**
+ * mmb_lpm_lookup
+ *
+ * @return indexes of the rules whose prefix covers addr, NULL if none
+ */
+static_always_inline u32 *mmb_lpm_lookup(mmb_lpm_t *lpm, u8 *addr) {
+  u32 slot = lpm->root[(addr[0] << 8) | addr[1]];
+  u32 byte = 2;
+
+  while (!mmb_lpm_is_leaf(slot))
+    slot = lpm->plies[mmb_lpm_index(slot)].slots[addr[byte++]];
+
+  return lpm->sets[mmb_lpm_index(slot)];
+}
+
+#endif /* __included_mmb_lpm_h__ */
@@ -29,7 +29,7 @@ _(MMB_FIELD_TCP_OPT_FAST_OPEN , FastOpen  , 34) \
 _(MMB_FIELD_TCP_OPT_MPTCP     , MPTCP     , 30)
 
 /* mmb-const,cli-name,opt-kind */
-#define foreach_mmb_ip6_eh                                                 \
+#define foreach_mmb_ip6_eh_cli                                             \
 _(MMB_FIELD_IP6_EH_HOPBYHOP , "HopByHop", 0)                               \
 _(MMB_FIELD_IP6_EH_ROUTING  , "Routing", 43)                               \
 _(MMB_FIELD_IP6_EH_FRAGMENT , "Fragment", 44)                              \
@@ -38,7 +38,10 @@ _(MMB_FIELD_IP6_EH_AH       , "AuthenticationHeader", 51)                  \
 _(MMB_FIELD_IP6_EH_DESTOPT  , "DestOpt", 60)                               \
 _(MMB_FIELD_IP6_EH_MOBILITY , "MobilityHeader", 135)                       \
 _(MMB_FIELD_IP6_EH_HIP      , "HostIdentityProtocol", 139)                 \
-_(MMB_FIELD_IP6_EH_SHIM6    , "Shim6", 140)                                \
+_(MMB_FIELD_IP6_EH_SHIM6    , "Shim6", 140)
+
+#define foreach_mmb_ip6_eh                                                 \
+foreach_mmb_ip6_eh_cli                                                     \
 _(MMB_FIELD_IP6_EH_EXP1     , "ExpTesting1", 253) /* not in CLI */         \
 _(MMB_FIELD_IP6_EH_EXP2     , "ExpTesting2", 254) /* not in CLI */
 
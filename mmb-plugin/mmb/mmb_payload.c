@@ -0,0 +1,276 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * multi-pattern payload matching.
+ */
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_payload.h>
+
+u32 mmb_payload_field_scope(u8 field) {
+  switch (field) {
+    case MMB_FIELD_IP4_PAYLOAD:
+    case MMB_FIELD_IP6_PAYLOAD:
+      return MMB_PAYLOAD_SCOPE_IP;
+    case MMB_FIELD_ICMP_PAYLOAD:
+    case MMB_FIELD_UDP_PAYLOAD:
+    case MMB_FIELD_TCP_PAYLOAD:
+      return MMB_PAYLOAD_SCOPE_L4;
+    default:
+      return ~0;
+  }
+}
+
+static u32 payload_add_state(mmb_payload_t *payload) {
+  u32 state = vec_len(payload->outputs);
+
+  vec_validate_init_empty(payload->delta, ((state + 1) << 8) - 1, ~0);
+  vec_validate(payload->outputs, state);
+  return state;
+}
+
+static u8 *payload_key(mmb_match_t *match) {
+  u8 *key = 0;
+
+  vec_add1(key, mmb_payload_field_scope(match->field));
+  vec_append(key, match->value);
+  return key;
+}
+
+void mmb_payload_ref_rule(mmb_rule_t *rule) {
+  mmb_payload_main_t *pm = &mmb_payload_main;
+  mmb_match_t *match;
+  u8 *key;
+  u32 id;
+  uword *p;
+
+  if (pm->id_by_key == 0)
+    pm->id_by_key = hash_create_vec(0, sizeof(u8), sizeof(uword));
+
+  vec_foreach(match, rule->payload_matches) {
+    key = payload_key(match);
+    p = hash_get_mem(pm->id_by_key, key);
+    if (p) {
+      id = p[0];
+      vec_free(key);
+    } else {
+      if (vec_len(pm->free_ids)) {
+        id = vec_pop(pm->free_ids);
+        pm->generation_by_id[id]++;
+      } else {
+        id = vec_len(pm->key_by_id);
+        vec_validate(pm->key_by_id, id);
+        vec_validate(pm->refcount_by_id, id);
+        vec_validate(pm->generation_by_id, id);
+      }
+      pm->key_by_id[id] = key;
+      hash_set_mem(pm->id_by_key, key, id);
+    }
+    pm->refcount_by_id[id]++;
+    vec_add1(rule->payload_ids, id);
+  }
+}
+
+void mmb_payload_unref_rule(mmb_rule_t *rule) {
+  mmb_payload_main_t *pm = &mmb_payload_main;
+  u32 *id;
+
+  vec_foreach(id, rule->payload_ids) {
+    if (--pm->refcount_by_id[*id] > 0)
+      continue;
+    /* no snapshot holds the pattern anymore */
+    hash_unset_mem(pm->id_by_key, pm->key_by_id[*id]);
+    vec_free(pm->key_by_id[*id]);
+    vec_add1(pm->free_ids, *id);
+  }
+  vec_free(rule->payload_ids);
+}
+
+static u32 payload_add_pattern(mmb_payload_t *payload, mmb_match_t *match,
+                               u32 id) {
+  mmb_payload_main_t *pm = &mmb_payload_main;
+  mmb_payload_pattern_t *pattern;
+  u8 *key = payload_key(match), *byte;
+  u32 state = 0, next, pattern_index;
+  uword *p;
+
+  p = hash_get_mem(payload->pattern_by_key, key);
+  if (p) {
+    vec_free(key);
+    return p[0];
+  }
+
+  pattern_index = vec_len(payload->patterns);
+  vec_add2(payload->patterns, pattern, 1);
+  pattern->key = key;
+  pattern->length = vec_len(match->value);
+  pattern->scope = key[0];
+  pattern->id = id;
+  pattern->generation = pm->generation_by_id[id];
+  hash_set_mem(payload->pattern_by_key, key, pattern_index);
+
+  /* trie */
+  vec_foreach(byte, match->value) {
+    next = payload->delta[(state << 8) | *byte];
+    if (next == ~0) {
+      next = payload_add_state(payload);
+      payload->delta[(state << 8) | *byte] = next;
+    }
+    state = next;
+  }
+  vec_add1(payload->outputs[state], pattern_index);
+  return pattern_index;
+}
+
+/**
+ * payload_link
+ *
+ * complete the trie into an automaton: breadth first, a missing transition
+ * of a state is the one of its failure state, and a state outputs the 
+ * patterns of its failure state.
+ */
+static void payload_link(mmb_payload_t *payload) {
+  u32 *fail = 0, *queue = 0, head = 0, state, next, byte;
+
+  vec_validate(fail, vec_len(payload->outputs) - 1);
+  for (byte = 0; byte < 256; byte++) {
+    next = payload->delta[byte];
+    if (next == ~0) {
+      payload->delta[byte] = 0;
+      continue;
+    }
+    fail[next] = 0;
+    vec_add1(queue, next);
+  }
+
+  while (head < vec_len(queue)) {
+    state = queue[head++];
+    for (byte = 0; byte < 256; byte++) {
+      next = payload->delta[(state << 8) | byte];
+      if (next == ~0) {
+        payload->delta[(state << 8) | byte] 
+          = payload->delta[(fail[state] << 8) | byte];
+        continue;
+      }
+      fail[next] = payload->delta[(fail[state] << 8) | byte];
+      vec_append(payload->outputs[next], payload->outputs[fail[next]]);
+      vec_add1(queue, next);
+    }
+  }
+
+  vec_free(queue);
+  vec_free(fail);
+}
+
+mmb_payload_t *mmb_payload_build(mmb_rule_t *rules) {
+  mmb_payload_t *payload = 0;
+  mmb_rule_t *rule;
+  u32 rule_index, index;
+
+  vec_foreach_index(rule_index, rules) {
+    rule = &rules[rule_index];
+    if (vec_len(rule->payload_matches) == 0)
+      continue;
+
+    if (payload == 0) {
+      payload = clib_mem_alloc(sizeof(mmb_payload_t));
+      memset(payload, 0, sizeof(mmb_payload_t));
+      payload->pattern_by_key = hash_create_vec(0, sizeof(u8), 
+                                                sizeof(uword));
+      payload_add_state(payload);
+    }
+
+    ASSERT(vec_len(rule->payload_ids) == vec_len(rule->payload_matches));
+    vec_validate(payload->patterns_by_rule, rule_index);
+    vec_foreach_index(index, rule->payload_matches) {
+      vec_add1(payload->patterns_by_rule[rule_index], 
+               payload_add_pattern(payload, &rule->payload_matches[index],
+                                   rule->payload_ids[index]));
+    }
+  }
+
+  if (payload) {
+    payload_link(payload);
+    payload->n_ids = vec_len(mmb_payload_main.key_by_id);
+  }
+  return payload;
+}
+
+void mmb_payload_free(mmb_payload_t *payload) {
+  mmb_payload_pattern_t *pattern;
+  u32 index;
+
+  if (payload == 0)
+    return;
+
+  vec_foreach(pattern, payload->patterns) {
+    vec_free(pattern->key);
+  }
+  vec_foreach_index(index, payload->outputs) {
+    vec_free(payload->outputs[index]);
+  }
+  vec_foreach_index(index, payload->patterns_by_rule) {
+    vec_free(payload->patterns_by_rule[index]);
+  }
+  hash_free(payload->pattern_by_key);
+  vec_free(payload->patterns);
+  vec_free(payload->outputs);
+  vec_free(payload->patterns_by_rule);
+  vec_free(payload->delta);
+  clib_mem_free(payload);
+}
+
+u64 *mmb_payload_sum_hits(mmb_payload_t *payload, 
+                          mmb_payload_hits_t **pattern_hits) {
+  mmb_payload_pattern_t *pattern;
+  mmb_payload_hits_t **thread_hits, *hits;
+  u64 *sums = 0;
+
+  if (payload == 0)
+    return 0;
+
+  vec_validate(sums, vec_len(payload->patterns) - 1);
+  vec_foreach(pattern, payload->patterns) {
+    vec_foreach(thread_hits, pattern_hits) {
+      if (pattern->id >= vec_len(*thread_hits))
+        continue;
+      /* counters of a previous pattern of the id were not reset yet */
+      hits = &(*thread_hits)[pattern->id];
+      if (hits->generation == pattern->generation)
+        sums[pattern - payload->patterns] += hits->count;
+    }
+  }
+  return sums;
+}
+
+u8 *mmb_format_payload(u8 *s, va_list *args) {
+  mmb_payload_t *payload = va_arg(*args, mmb_payload_t*);
+  u64 *hits = va_arg(*args, u64*); /* by pattern index */
+  mmb_payload_pattern_t *pattern;
+
+  if (payload == 0)
+    return format(s, "no pattern");
+
+  s = format(s, "%u patterns, %u states (%U)", vec_len(payload->patterns),
+             vec_len(payload->outputs), format_memory_size, 
+             vec_bytes(payload->delta));
+  vec_foreach(pattern, payload->patterns) {
+    s = format(s, "\n  %s-payload contains %U: %lu hits", 
+               pattern->scope == MMB_PAYLOAD_SCOPE_IP ? "ip" : "l4",
+               format_hex_bytes, pattern->key + 1, pattern->length,
+               hits[pattern - payload->patterns]);
+  }
+  return s;
+}
@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * multi-pattern payload matching.
+ *
+ * "<payload-field> contains <value>" matches are compiled into a single
+ * Aho-Corasick automaton, a full transition table of 256 entries per state,
+ * so that the first MMB_PAYLOAD_SCAN_BYTES bytes past the ip header are
+ * scanned once per packet whatever the number of patterns. A packet is only
+ * scanned once a rule with such matches accepted its headers.
+ *
+ * Patterns keep an id across builds while rules use them, which indexes
+ * the hit counters of each thread. An id is given again to another pattern
+ * once its last rule is freed, with a new generation so that threads reset
+ * its counter on the next hit.
+ */
+
+#ifndef __included_mmb_payload_h__
+#define __included_mmb_payload_h__
+
+#include <vppinfra/vec.h>
+#include <vppinfra/hash.h>
+#include <vppinfra/bitmap.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_classify.h>
+#include <mmb/mmb_headers.h>
+
+#define MMB_PAYLOAD_SCAN_BYTES 512
+
+typedef enum {
+  MMB_PAYLOAD_SCOPE_IP=0, /*! from the end of the ip header */
+  MMB_PAYLOAD_SCOPE_L4=1, /*! from the end of the l4 header */
+} mmb_payload_scope_t;
+
+typedef struct {
+  u8 *key; /*! scope then bytes */
+  u16 length;
+  u8 scope;
+  u32 id; /*! same for the same key across builds, indexes hit counters */
+  u32 generation; /*! of id */
+} mmb_payload_pattern_t;
+
+typedef struct {
+  u32 *delta; /*! state << 8 | byte -> next state */
+  u32 **outputs; /*! patterns ending at each state */
+  mmb_payload_pattern_t *patterns;
+  uword *pattern_by_key;
+  u32 **patterns_by_rule; /*! pattern of each payload match, by rule index */
+  u32 n_ids; /*! hit counters a thread must hold */
+} mmb_payload_t;
+
+typedef struct {
+  u64 count;
+  u32 generation; /*! of the pattern id counted */
+} mmb_payload_hits_t;
+
+typedef struct {
+  u8 scanned;
+  uword *hits; /*! bitmap of patterns found in the packet */
+  mmb_payload_hits_t *pattern_hits; /*! hit counters of the thread, by 
+                                        pattern id */
+} mmb_payload_scan_t;
+
+typedef struct {
+  uword *id_by_key; /*! pattern key -> id */
+  u8 **key_by_id;
+  u32 *refcount_by_id; /*! payload matches of rules using each id */
+  u32 *generation_by_id;
+  u32 *free_ids;
+} mmb_payload_main_t;
+
+mmb_payload_main_t mmb_payload_main;
+
+/**
+ * mmb_payload_field_scope
+ *
+ * @return scope of a payload field, ~0 if field is not a payload
+ */
+u32 mmb_payload_field_scope(u8 field);
+
+/**
+ * mmb_payload_build
+ *
+ * build the automaton of payload matches of rules.
+ * @return NULL if no rule has payload matches
+ */
+mmb_payload_t *mmb_payload_build(mmb_rule_t *rules);
+
+/**
+ * mmb_payload_ref_rule
+ *
+ * give the payload matches of a rule their pattern id, which stay 
+ * referenced until mmb_payload_unref_rule.
+ */
+void mmb_payload_ref_rule(mmb_rule_t *rule);
+
+void mmb_payload_unref_rule(mmb_rule_t *rule);
+
+/**
+ * mmb_payload_sum_hits
+ *
+ * @return hits of each pattern of payload counted by all threads, by
+ *         pattern index
+ */
+u64 *mmb_payload_sum_hits(mmb_payload_t *payload, 
+                          mmb_payload_hits_t **pattern_hits);
+
+void mmb_payload_free(mmb_payload_t *payload);
+
+u8 *mmb_format_payload(u8 *s, va_list *args);
+
+static_always_inline void mmb_payload_scan(mmb_payload_t *payload,
+                                           mmb_payload_scan_t *scan,
+                                           u8 *h0, u32 len0, 
+                                           mmb_headers_t *hdr0, u8 is_ip6) {
+  u32 ip_size, l4_start, end, index, state = 0, *output, start;
+  mmb_payload_pattern_t *pattern;
+  mmb_payload_hits_t *hits;
+
+  scan->scanned = 1;
+  clib_bitmap_zero(scan->hits);
+
+  ip_size = is_ip6 ? sizeof(ip6_header_t) : hdr0->l4_offset;
+  if (ip_size >= len0)
+    return;
+
+  /* start of the l4 payload, from the ip payload */
+  l4_start = hdr0->l4_offset - ip_size;
+  if (!hdr0->l4_valid)
+    l4_start = ~0;
+  else switch (hdr0->l4_proto) {
+    case IP_PROTOCOL_TCP:
+      if (hdr0->l4_offset + sizeof(tcp_header_t) <= len0)
+        l4_start += tcp_doff((tcp_header_t *) (h0 + hdr0->l4_offset)) * 4;
+      else
+        l4_start = ~0;
+      break;
+    case IP_PROTOCOL_UDP:
+      l4_start += sizeof(udp_header_t);
+      break;
+    case IP_PROTOCOL_ICMP:
+    case IP_PROTOCOL_ICMP6:
+      l4_start += sizeof(icmp46_header_t);
+      break;
+    default:
+      break;
+  }
+
+  end = clib_min(len0, ip_size + MMB_PAYLOAD_SCAN_BYTES);
+  for (index = ip_size; index < end; index++) {
+    state = payload->delta[(state << 8) | h0[index]];
+    if (PREDICT_TRUE(payload->outputs[state] == 0))
+      continue;
+
+    vec_foreach(output, payload->outputs[state]) {
+      pattern = &payload->patterns[*output];
+      start = index + 1 - pattern->length - ip_size;
+      if (pattern->scope == MMB_PAYLOAD_SCOPE_L4 && start < l4_start)
+        continue;
+      if (!clib_bitmap_get(scan->hits, *output)) {
+        scan->hits = clib_bitmap_set(scan->hits, *output, 1);
+        if (scan->pattern_hits) {
+          hits = &scan->pattern_hits[pattern->id];
+          if (PREDICT_FALSE(hits->generation != pattern->generation)) {
+            hits->generation = pattern->generation;
+            hits->count = 0;
+          }
+          hits->count++;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * mmb_payload_match
+ *
+ * second stage of rules with payload matches, the packet is scanned on
+ * first use.
+ */
+static_always_inline int mmb_payload_match(mmb_payload_t *payload,
+                                           mmb_rule_t *rule, u32 rule_index,
+                                           mmb_payload_scan_t *scan,
+                                           u8 *h0, u32 len0, 
+                                           mmb_headers_t *hdr0, u8 is_ip6) {
+  u32 *patterns, index;
+
+  if (payload == 0 || rule_index >= vec_len(payload->patterns_by_rule))
+    return 0;
+
+  if (!scan->scanned)
+    mmb_payload_scan(payload, scan, h0, len0, hdr0, is_ip6);
+
+  patterns = payload->patterns_by_rule[rule_index];
+  vec_foreach_index(index, rule->payload_matches) {
+    if (clib_bitmap_get(scan->hits, patterns[index])
+        == rule->payload_matches[index].reverse)
+      return 0;
+  }
+  return 1;
+}
+
+#endif /* __included_mmb_payload_h__ */
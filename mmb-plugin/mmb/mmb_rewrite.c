@@ -24,6 +24,8 @@
 #include <vnet/classify/vnet_classify.h>
 #include <mmb/mmb.h>
 #include <mmb/mmb_opts.h>
+#include <mmb/mmb_headers.h>
+#include <mmb/mmb_runtime.h>
 
 #define foreach_mmb_next_node \
   _(FORWARD, "Forward")     \
@@ -70,8 +72,9 @@ typedef struct {
 } mmb_trace_t;
 
 static u8 mmb_rewrite_tcp_options(vlib_buffer_t *, mmb_tcp_options_t *);
-static void target_tcp_options(vlib_buffer_t *, u8 *, mmb_rule_t *, 
-                               mmb_tcp_options_t *, u8, mmb_conn_t *conn, u32 dir);
+static void target_tcp_options(vlib_buffer_t *, u8 *, tcp_header_t *, 
+                               mmb_rule_t *, mmb_tcp_options_t *, u8, 
+                               mmb_conn_cold_t *conn, u32 dir);
 
 /************************
  *   MMB Node format
@@ -103,6 +106,8 @@ mmb_trace_ip_packet(vlib_main_t * vm, vlib_buffer_t *b, vlib_node_runtime_t * no
   t->next = next;
   t->sw_if_index = sw_if_index;
   t->rule_indexes = vec_dup((u32*)vnet_buffer(b)->l2_classify.hash);
+  vec_append(t->rule_indexes, mmb_conn_rule_set(mmb_main.mmb_conn_table, 
+                                  vnet_buffer(b)->l2_classify.opaque_index));
 
   if (is_ip6) {
     ip6_header_t *iph = (ip6_header_t*)p;
@@ -160,14 +165,6 @@ static_always_inline u8 mmb_memmove(u8 *dst, u8 *from, u8 length)
   return length;
 }
 
-static_always_inline u16 get_ip_protocol(u8 *p, u8 is_ip6)
-{
-  if (is_ip6)
-    return ((ip6_header_t*)p)->protocol;
-
-  return ((ip4_header_t*)p)->protocol;
-}
-
 /************************
  *      TCP options
  ***********************/
@@ -281,9 +278,10 @@ static_always_inline void mmb_target_strip_option(mmb_tcp_options_t *tcp_options
   tcp_options->parsed[idx].is_stripped = 1;
 }
 
-void target_tcp_options(vlib_buffer_t *b, u8 *p, mmb_rule_t *rule, 
+void target_tcp_options(vlib_buffer_t *b, u8 *p, tcp_header_t *tcph, 
+                        mmb_rule_t *rule, 
                         mmb_tcp_options_t *tcp_options, u8 is_ip6,
-                        mmb_conn_t *conn, u32 dir) {
+                        mmb_conn_cold_t *conn, u32 dir) {
 
   u32 i;
   u8 old_opts_len = 0, new_opts_len = 0, opts_modified = 0;
@@ -304,7 +302,6 @@ void target_tcp_options(vlib_buffer_t *b, u8 *p, mmb_rule_t *rule,
   }
 
   /* Rewrite tcp options, if needed */
-  tcp_header_t *tcph = is_ip6 ? ip6_next_header((ip6_header_t*)p) : ip4_next_header((ip4_header_t*)p);
   old_opts_len = (tcp_doff(tcph) << 2) - sizeof(tcp_header_t);
   if (opts_modified)
     new_opts_len = mmb_rewrite_tcp_options(b, tcp_options);
@@ -391,22 +388,18 @@ static_always_inline void tcp_checksum(vlib_main_t *vm, vlib_buffer_t *b,
 }
 
 static_always_inline void mmb_map_sack(mmb_tcp_options_t *tcp_options, u8 is_ip6,
-                                       mmb_conn_t *conn, u32 dir) {
+                                       mmb_conn_cold_t *conn, u32 dir) {
    //TODO
 }
 
-static_always_inline void mmb_map_shuffle(u8 *p, mmb_conn_t *conn, u32 dir, u8 is_ip6) {
-
-  tcp_header_t *tcph;  
+static_always_inline void mmb_map_shuffle(tcp_header_t *tcph, 
+                                          mmb_conn_cold_t *conn, 
+                                          u32 dir, u8 is_ip6) {
 
    if (!is_ip6) {
-      ip4_header_t *iph4 = (ip4_header_t*)p;
-      tcph = ip4_next_header(iph4);
       if(conn->ip_id) 
          conn->ip_id = (conn->ip_id + 1) % 0x00010000;
    } else {
-      ip6_header_t *iph6 = (ip6_header_t*)p;
-      tcph = ip6_next_header(iph6);
       if(conn->ip_id)
          conn->ip_id = (conn->ip_id + 1) % 0x00100000;
    }
@@ -450,10 +443,57 @@ static_always_inline void mmb_map_shuffle(u8 *p, mmb_conn_t *conn, u32 dir, u8 i
    }
 }
 
+/**
+ * mmb_unmap_quoted
+ *
+ * undo the shuffle mapping of the packet quoted by an icmp error, so that
+ * the receiver of the error recognizes the packet it sent.
+ * @param dir direction of the error, the quoted packet went the other way
+ */
+static_always_inline void mmb_unmap_quoted(u8 *p, u32 len, mmb_headers_t *hdr,
+                                           mmb_conn_cold_t *conn, u32 dir, 
+                                           u8 is_ip6) {
+   u32 offset = hdr->l4_offset + 8, seq_delta, ack_delta;
+   mmb_headers_t quoted;
+   tcp_header_t *tcph;
+
+   if (offset + (is_ip6 ? sizeof(ip6_header_t) : sizeof(ip4_header_t)) > len)
+      return;
+   mmb_headers_parse(&quoted, p + offset, len - offset, is_ip6);
+   if (!quoted.l4_valid)
+      return;
+   tcph = (tcp_header_t*)(p + offset + quoted.l4_offset);
+
+   if (dir) { /* quoted packet went forward, it was mapped */
+      if (conn->sport)
+         tcph->src_port = conn->initial_sport;
+      if (conn->dport)
+         tcph->dst_port = conn->initial_dport;
+      seq_delta = -conn->tcp_seq_offset;
+      ack_delta = conn->tcp_ack_offset;
+   } else { /* quoted packet went backward, it was mapped back */
+      if (conn->sport)
+         tcph->dst_port = conn->sport;
+      if (conn->dport)
+         tcph->src_port = conn->dport;
+      seq_delta = -conn->tcp_ack_offset;
+      ack_delta = conn->tcp_seq_offset;
+   }
+
+   if (quoted.l4_proto != IP_PROTOCOL_TCP)
+      return;
+   tcph->seq_number = clib_host_to_net_u32(
+                        clib_net_to_host_u32(tcph->seq_number) + seq_delta);
+   /* icmp4 errors may only quote 8 bytes of tcp */
+   if (offset + quoted.l4_offset + 14 <= len 
+       && !(dir && (tcph->flags & TCP_FLAG_SYN)))
+      tcph->ack_number = clib_host_to_net_u32(
+                           clib_net_to_host_u32(tcph->ack_number) + ack_delta);
+}
 
 static_always_inline 
 u32 mmb_rewrite(mmb_conn_table_t *mct, vlib_main_t *vm, mmb_rule_t *rule, 
-               vlib_buffer_t *b, u8 *p, 
+               vlib_buffer_t *b, u8 *p, mmb_headers_t *hdr,
                u32 next, u8 tcpo, mmb_tcp_options_t *tcp_options, u8 is_ip6) {
 
   /* lb */
@@ -467,6 +507,22 @@ u32 mmb_rewrite(mmb_conn_table_t *mct, vlib_main_t *vm, mmb_rule_t *rule,
     return next;
   }
 
+  u32 conn_index = vnet_buffer(b)->unused[0];
+  u32 conn_dir   = vnet_buffer(b)->unused[1];
+  mmb_conn_cold_t *conn = NULL;
+  void *next_header = p + hdr->l4_offset;
+
+  /* icmp error given the rules of a connection: only its quoted packet is
+     of the connection */
+  if (PREDICT_FALSE(hdr->icmp_error && rule->stateful)) {
+    if (rule->shuffle && !pool_is_free_index(mct->conn_pool, conn_index)) {
+      conn = vec_elt_at_index(mct->conn_cold, conn_index);
+      mmb_unmap_quoted(p, b->current_length, hdr, conn, conn_dir, is_ip6);
+      icmp_checksum(vm, b, p, (icmp46_header_t*) next_header, is_ip6);
+    }
+    return next;
+  }
+
   u32 skip_u64 = rule->rewrite_skip * 2;
   u32 match = rule->rewrite_match;
   u64 *key = (u64 *)rule->rewrite_key;
@@ -497,21 +553,28 @@ u32 mmb_rewrite(mmb_conn_table_t *mct, vlib_main_t *vm, mmb_rule_t *rule,
       break;
   }
 
-  u32 conn_index = vnet_buffer(b)->unused[0];
-  u32 conn_dir   = vnet_buffer(b)->unused[1];
-  mmb_conn_t *conn = NULL;
+  /* payload values past the rewrite mask */
+  mmb_deep_t *deep;
+  u32 deep_offset;
+  vec_foreach(deep, rule->deep_targets) {
+    deep_offset = mmb_deep_offset(deep, hdr, p, b->current_length);
+    if (deep_offset != ~0 
+        && deep_offset + vec_len(deep->value) <= b->current_length)
+      clib_memcpy(p + deep_offset, deep->value, vec_len(deep->value));
+  }
 
-  if (rule->shuffle) {
+  if (rule->shuffle && hdr->l4_valid) {
 
     if (!pool_is_free_index(mct->conn_pool, conn_index)) {/* for safety */
-      conn = pool_elt_at_index(mct->conn_pool, conn_index);
-      mmb_map_shuffle(p, conn, conn_dir, is_ip6);
+      conn = vec_elt_at_index(mct->conn_cold, conn_index);
+      mmb_map_shuffle((tcp_header_t*) next_header, conn, conn_dir, is_ip6);
     }
   }
 
   /* tcp opts */
   if (tcpo)
-    target_tcp_options(b, p, rule, tcp_options, is_ip6, conn, conn_dir);
+    target_tcp_options(b, p, (tcp_header_t*) next_header, rule, tcp_options, 
+                       is_ip6, conn, conn_dir);
  
   /* ip4 checksum */
   if (!is_ip6) {
@@ -519,18 +582,18 @@ u32 mmb_rewrite(mmb_conn_table_t *mct, vlib_main_t *vm, mmb_rule_t *rule,
     iph->checksum = ip4_header_checksum(iph);
   }
 
-  u16 ip_proto = get_ip_protocol(p, is_ip6);
+  u16 ip_proto = hdr->l4_proto;
 
-  /* l4 checksum include pseudoheader */
+  /* l4 checksum include pseudoheader, none without l4 header */
   int compute_l4_checksum;
-  if (rule->l4 == IP_PROTOCOL_RESERVED
+  if (!hdr->l4_valid)
+    compute_l4_checksum = IP_PROTOCOL_RESERVED;
+  else if (rule->l4 == IP_PROTOCOL_RESERVED
        && (ip_proto == IP_PROTOCOL_TCP || ip_proto == IP_PROTOCOL_UDP))
     compute_l4_checksum = ip_proto;
   else 
     compute_l4_checksum = rule->l4;   
 
-  void *next_header = is_ip6 ? 
-      ip6_next_header((ip6_header_t*)p) : ip4_next_header((ip4_header_t*)p);
   switch (compute_l4_checksum) { 
     case IP_PROTOCOL_ICMP: 
     case IP_PROTOCOL_ICMP6:
@@ -552,6 +615,35 @@ u32 mmb_rewrite(mmb_conn_table_t *mct, vlib_main_t *vm, mmb_rule_t *rule,
   return next;
 }
 
+/**
+ * mmb_rewrite_rules
+ *
+ * apply the targets of the rules in rule_indexes
+ * @return next node index
+ */
+static_always_inline 
+u32 mmb_rewrite_rules(mmb_main_t *mm, mmb_runtime_t *rt, vlib_main_t *vm,
+                      u32 *rule_indexes, vlib_buffer_t *b, u8 *p, 
+                      mmb_headers_t *hdr, u32 next, u8 *tcpo, 
+                      mmb_tcp_options_t *tcp_options, u8 is_ip6) {
+  mmb_rule_t *rule;
+  u32 *rule_index;
+
+  vec_foreach(rule_index, rule_indexes) { 
+     rule = mmb_runtime_rule(rt, *rule_index); /** XXX preload? **/
+     if (PREDICT_FALSE(rule == 0))
+        continue;
+     if (rule->opts_in_targets) {
+         if (hdr->l4_valid && hdr->l4_proto == IP_PROTOCOL_TCP)
+           *tcpo = mmb_parse_tcp_options(
+                       (tcp_header_t*)(p + hdr->l4_offset), tcp_options);
+     } 
+     next = mmb_rewrite(mm->mmb_conn_table, vm, rule, b, p, hdr,
+                        next, *tcpo, tcp_options, is_ip6);
+  }
+  return next;
+}
+
 /************************
  *  Node entry function
  ***********************/
@@ -562,7 +654,9 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
             vlib_node_registration_t *mmb_node) {
 
   mmb_main_t *mm = &mmb_main;
-  mmb_rule_t *rules = mm->rules;
+  mmb_conn_table_t *mct = mm->mmb_conn_table;
+  u32 thread_index = vlib_get_thread_index();
+  mmb_runtime_t *rt = mmb_runtime_enter(thread_index);
 
   u32 n_left_from, *from, *to_next;
   mmb_next_t next_index;
@@ -592,6 +686,7 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
       u32 next1 = MMB_NEXT_FORWARD;
       u32 sw_if_index0, sw_if_index1;
       u8 *p0, *p1, tcpo0 = 0, tcpo1 = 0;
+      mmb_headers_t hdr0, hdr1;
 
       /* Prefetch next iteration */
       {
@@ -623,35 +718,25 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
       p0 = vlib_buffer_get_current(b0);
       p1 = vlib_buffer_get_current(b1);  
 
-      /* get matched rules & rewrite */
-      mmb_rule_t *ri0, *ri1;
-      u32 *rule_index0, *rule_index1; 
+      /* l4 headers found by the classify node */
+      mmb_headers_l4_from_opaque(&hdr0, vnet_buffer(b0)->unused[2]);
+      mmb_headers_l4_from_opaque(&hdr1, vnet_buffer(b1)->unused[2]);
+
+      /* get matched rules & rewrite, then the rules of the connection */
       u32 *rule_indexes0 = (u32 *)vnet_buffer(b0)->l2_classify.hash;
       u32 *rule_indexes1 = (u32 *)vnet_buffer(b1)->l2_classify.hash;   /*XXX vec_free */
 
-      vec_foreach(rule_index0, rule_indexes0) { 
-         ri0 = rules+*rule_index0; /** XXX preload? **/
-         if (ri0->opts_in_targets) {// && !tcpo0) {
-             if (is_ip6)
-               tcpo0 = mmb_parse_tcp_options(ip6_next_header((ip6_header_t*)p0), &tcp_options0);
-             else
-               tcpo0 = mmb_parse_tcp_options(ip4_next_header((ip4_header_t*)p0), &tcp_options0);
-         } 
-         next0 = mmb_rewrite(mm->mmb_conn_table, vm, ri0, b0, p0, 
-                             next0, tcpo0, &tcp_options0, is_ip6);
-      }
+      next0 = mmb_rewrite_rules(mm, rt, vm, rule_indexes0, b0, p0, &hdr0,
+                                next0, &tcpo0, &tcp_options0, is_ip6);
+      next0 = mmb_rewrite_rules(mm, rt, vm, 
+                  mmb_conn_rule_set(mct, vnet_buffer(b0)->l2_classify.opaque_index),
+                  b0, p0, &hdr0, next0, &tcpo0, &tcp_options0, is_ip6);
 
-      vec_foreach(rule_index1, rule_indexes1) { 
-         ri1 = rules+*rule_index1;
-         if (ri1->opts_in_targets) { //  && !tcpo1) {
-             if (is_ip6)
-               tcpo1 = mmb_parse_tcp_options(ip6_next_header((ip6_header_t*)p1), &tcp_options1);
-             else
-               tcpo1 = mmb_parse_tcp_options(ip4_next_header((ip4_header_t*)p1), &tcp_options1);
-         } 
-         next1 = mmb_rewrite(mm->mmb_conn_table, vm, ri1, b1, p1, 
-                             next1, tcpo1, &tcp_options1, is_ip6);
-      }
+      next1 = mmb_rewrite_rules(mm, rt, vm, rule_indexes1, b1, p1, &hdr1,
+                                next1, &tcpo1, &tcp_options1, is_ip6);
+      next1 = mmb_rewrite_rules(mm, rt, vm, 
+                  mmb_conn_rule_set(mct, vnet_buffer(b1)->l2_classify.opaque_index),
+                  b1, p1, &hdr1, next1, &tcpo1, &tcp_options1, is_ip6);
 
       /* get incoming interfaces */
       sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
@@ -686,6 +771,7 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
       u32 next0 = MMB_NEXT_FORWARD;
       u32 sw_if_index0;
       u8 *p0, tcpo0 = 0;
+      mmb_headers_t hdr0;
 
       /* speculatively enqueue b0 to the current next frame */
       to_next[0] = bi0 = from[0];
@@ -699,23 +785,16 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
 
       /* get IP header as raw data */
       p0 = vlib_buffer_get_current(b0);
+      mmb_headers_l4_from_opaque(&hdr0, vnet_buffer(b0)->unused[2]);
 
-      /* get matched rule */
-      mmb_rule_t *ri0;
-      u32* rule_index0;
+      /* get matched rules & rewrite, then the rules of the connection */
       u32 *rule_indexes0 = (u32 *)vnet_buffer(b0)->l2_classify.hash;
 
-      vec_foreach(rule_index0, rule_indexes0) { 
-         ri0 = rules+*rule_index0;
-         if (ri0->opts_in_targets) { // && !tcpo0) {
-             if (is_ip6)
-               tcpo0 = mmb_parse_tcp_options(ip6_next_header((ip6_header_t*)p0), &tcp_options0);
-             else
-               tcpo0 = mmb_parse_tcp_options(ip4_next_header((ip4_header_t*)p0), &tcp_options0);
-         } 
-         next0 = mmb_rewrite(mm->mmb_conn_table, vm, ri0, b0, p0, 
-                             next0, tcpo0, &tcp_options0, is_ip6);
-      }
+      next0 = mmb_rewrite_rules(mm, rt, vm, rule_indexes0, b0, p0, &hdr0,
+                                next0, &tcpo0, &tcp_options0, is_ip6);
+      next0 = mmb_rewrite_rules(mm, rt, vm, 
+                  mmb_conn_rule_set(mct, vnet_buffer(b0)->l2_classify.opaque_index),
+                  b0, p0, &hdr0, next0, &tcpo0, &tcp_options0, is_ip6);
 
       /* get incoming interface */
       sw_if_index0 = vnet_buffer(b0)->sw_if_index[VLIB_RX];
@@ -746,6 +825,9 @@ mmb_node_fn(vlib_main_t *vm, vlib_node_runtime_t *node,
   free_tcp_options(&tcp_options0);
   free_tcp_options(&tcp_options1);
 
+  if (rt)
+    mmb_runtime_leave(thread_index, -(i32) frame->n_vectors);
+
   return frame->n_vectors;
 }
 
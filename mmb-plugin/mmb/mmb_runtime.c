@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * rule snapshots published to the data plane.
+ */
+
+#include <vlib/threads.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_runtime.h>
+
+#ifdef MMB_DEBUG
+#  define vl_print(handle, ...) vlib_cli_output (handle, __VA_ARGS__)
+#else
+#  define vl_print(handle, ...)
+#endif
+
+vlib_node_registration_t mmb_runtime_process_node;
+
+static void free_runtime(mmb_runtime_t *rt) {
+  u32 tid, dir;
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++) {
+    if (rt->owned & MMB_RUNTIME_LPM)
+      for (dir = 0; dir < MMB_LPM_N_DIR; dir++)
+        mmb_lpm_free(rt->lpm[tid][dir]);
+    if (rt->owned & MMB_RUNTIME_BV)
+      mmb_bv_free(rt->bv[tid]);
+    if (rt->owned & MMB_RUNTIME_EXACT)
+      mmb_exact_free(rt->exact[tid]);
+  }
+  /* filters are retired by the publication that replaces them */
+  if (rt->owned & MMB_RUNTIME_BLOOM)
+    vec_free(rt->bloom_by_table);
+  if (rt->owned & MMB_RUNTIME_L4)
+    vec_free(rt->l4_by_table);
+  if (rt->owned & MMB_RUNTIME_PAYLOAD)
+    mmb_payload_free(rt->payload);
+  /* rule indexes vectors are retired by the control plane */
+  if (rt->owned & MMB_RUNTIME_LOOKUP)
+    vec_free(rt->lookup);
+  if (rt->owned & MMB_RUNTIME_RULES)
+    vec_free(rt->rules);
+  clib_mem_free(rt);
+}
+
+/**
+ * session_l4_bits
+ *
+ * @return mmb_classify_l4_bit of the packets a session key can match
+ */
+static u8 session_l4_bits(mmb_table_t *table, u8 *key) {
+  static const u8 protocol_offset[MMB_CLASSIFY_N_TABLES] = { 9, 6 };
+  static const u8 ip_version[MMB_CLASSIFY_N_TABLES] = { 4, 6 };
+  u32 skip = table->skip * sizeof(u32x4), offset, tid;
+  u8 *mask = table->mask, bits = 0, version = 0;
+
+  if (skip == 0 && (mask[0] & 0xf0) == 0xf0)
+    version = key[0] >> 4;
+
+  for (tid = 0; tid < MMB_CLASSIFY_N_TABLES; tid++) {
+    if (version && version != ip_version[tid])
+      continue;
+
+    offset = protocol_offset[tid];
+    if (offset >= skip && offset - skip < vec_len(mask)
+        && mask[offset - skip] == 0xff)
+      bits |= mmb_classify_l4_bit(tid, key[offset - skip]);
+    else /* any protocol */
+      bits |= ((1 << MMB_CLASSIFY_N_L4) - 1) << (tid * MMB_CLASSIFY_N_L4);
+  }
+  return bits;
+}
+
+static u8 table_l4_bits(mmb_table_t *table) {
+  mmb_session_t *session;
+  u8 bits = 0;
+
+  pool_foreach(session, table->sessions, ({
+    bits |= session_l4_bits(table, session->key);
+  }));
+  return bits;
+}
+
+/**
+ * build_l4_by_table
+ *
+ * split the chain by address family and protocol class: a packet skips
+ * the tables whose sessions all match other protocols.
+ */
+static u8 *build_l4_by_table(mmb_main_t *mm) {
+  vnet_classify_main_t *vcm = mm->mmb_classify_main->vnet_classify_main;
+  mmb_table_t *table;
+  u8 *l4_by_table = 0;
+
+  vec_foreach(table, mm->tables) {
+    if (table->index == ~0 || pool_is_free_index(vcm->tables, table->index))
+      continue;
+
+    /* tables not in the snapshot match any packet */
+    vec_validate_init_empty(l4_by_table, table->index, 0xff);
+    l4_by_table[table->index] = table_l4_bits(table);
+  }
+  return l4_by_table;
+}
+
+/**
+ * rule_table
+ *
+ * @return table of a classifier rule, NULL if none
+ */
+static mmb_table_t *rule_table(mmb_main_t *mm, mmb_rule_t *rule) {
+  uword *p;
+
+  if (!in_classifier(rule))
+    return 0;
+  p = hash_get(mm->table_by_index, rule->classify_table_index);
+  return p ? vec_elt_at_index(mm->tables, p[0]) : 0;
+}
+
+/**
+ * publish_rules
+ *
+ * copy mmb_main rules to rt, rules from first on are written past the
+ * rules of the snapshots sharing the storage.
+ *
+ * @return MMB_RUNTIME_RULES if the storage was copied
+ */
+static u32 publish_rules(mmb_main_t *mm, mmb_runtime_t *rt, u32 first) {
+  u32 count = vec_len(mm->rules), replaced = 0;
+
+  if (count > vec_len(rt->rules) || first == 0) {
+    rt->rules = 0;
+    vec_validate(rt->rules, clib_max(2 * count, MMB_RUNTIME_MIN_CAPACITY) - 1);
+    first = 0;
+    replaced = MMB_RUNTIME_RULES;
+  }
+  if (count > first)
+    clib_memcpy(&rt->rules[first], &mm->rules[first],
+                (count - first) * sizeof(mmb_rule_t));
+  rt->n_rules = count;
+  return replaced;
+}
+
+/**
+ * publish_lookup
+ *
+ * copy mmb_main lookup pool to rt, only the entries of rules from first on
+ * if the storage is large enough. Entries are set in place: the rules they
+ * gained are past the rules of the snapshots sharing the storage.
+ *
+ * @return MMB_RUNTIME_LOOKUP if the storage was copied
+ */
+static u32 publish_lookup(mmb_main_t *mm, mmb_runtime_t *rt, u32 first) {
+  u32 count = vec_len(mm->lookup_pool), lookup_index;
+  mmb_lookup_entry_t *lookup_entry;
+  mmb_rule_t *rule;
+
+  if (count > vec_len(rt->lookup) || first == 0) {
+    rt->lookup = 0;
+    vec_validate(rt->lookup, 
+                 clib_max(2 * count, MMB_RUNTIME_MIN_CAPACITY) - 1);
+    pool_foreach_index(lookup_index, mm->lookup_pool, ({
+      lookup_entry = pool_elt_at_index(mm->lookup_pool, lookup_index);
+      rt->lookup[lookup_index].rule_indexes = lookup_entry->rule_indexes;
+    }));
+    return MMB_RUNTIME_LOOKUP;
+  }
+
+  for (rule = &mm->rules[first]; rule < vec_end(mm->rules); rule++) {
+    if (!in_classifier(rule))
+      continue;
+    lookup_entry = pool_elt_at_index(mm->lookup_pool, rule->lookup_index);
+    rt->lookup[rule->lookup_index].rule_indexes = lookup_entry->rule_indexes;
+  }
+  return 0;
+}
+
+/**
+ * retire_blooms
+ *
+ * retire the filters of a filter vector replaced by a new one.
+ */
+static void retire_blooms(mmb_runtime_main_t *mrm, mmb_bloom_t **blooms) {
+  mmb_bloom_t **bloom;
+
+  vec_foreach(bloom, blooms) {
+    if (*bloom)
+      vec_add1(mrm->deleted_blooms, *bloom);
+  }
+}
+
+/**
+ * grow_by_table
+ *
+ * make room for table_index in a vector of rt indexed by classifier table,
+ * copied the first time it grows so that older snapshots keep theirs, part
+ * is then set in replaced.
+ */
+#define grow_by_table(v, table_index, init, part, replaced)             \
+do {                                                                    \
+  if ((table_index) >= vec_len(v)) {                                    \
+    if (!((replaced) & (part)))                                         \
+      (v) = vec_dup(v);                                                 \
+    vec_validate_init_empty((v), (table_index), (init));                \
+    (replaced) |= (part);                                               \
+  }                                                                     \
+} while (0)
+
+/**
+ * publish_moves
+ *
+ * move filters and protocol classes of tables replaced since last
+ * publication to the index of their new classifier table.
+ *
+ * @param parts MMB_RUNTIME_BLOOM and/or MMB_RUNTIME_L4, parts to update
+ * @param replaced parts whose vector was copied
+ */
+static void publish_moves(mmb_runtime_main_t *mrm, mmb_runtime_t *rt,
+                          u32 parts, u32 *replaced) {
+  u32 index, old_index, new_index;
+  mmb_bloom_t *bloom;
+  u8 bits;
+
+  for (index = 0; index + 1 < vec_len(mrm->moved_tables); index += 2) {
+    old_index = mrm->moved_tables[index];
+    new_index = mrm->moved_tables[index + 1];
+
+    /* same mask, same hashes: the filter is still valid */
+    if (parts & MMB_RUNTIME_BLOOM) {
+      bloom = mmb_runtime_bloom(rt, old_index);
+      grow_by_table(rt->bloom_by_table, new_index, 0, MMB_RUNTIME_BLOOM,
+                    *replaced);
+      rt->bloom_by_table[new_index] = bloom;
+      if (old_index < vec_len(rt->bloom_by_table))
+        rt->bloom_by_table[old_index] = 0;
+    }
+
+    if (parts & MMB_RUNTIME_L4) {
+      bits = old_index < vec_len(rt->l4_by_table)
+             ? rt->l4_by_table[old_index] : 0xff;
+      grow_by_table(rt->l4_by_table, new_index, 0xff, MMB_RUNTIME_L4,
+                    *replaced);
+      rt->l4_by_table[new_index] = bits;
+      if (old_index < vec_len(rt->l4_by_table))
+        rt->l4_by_table[old_index] = 0xff;
+    }
+  }
+}
+
+/**
+ * publish_sessions
+ *
+ * add the sessions of rules from first on to the filters and protocol
+ * classes of their table. A table the snapshot has no filter for gets its
+ * protocol classes and filter built from all its sessions.
+ *
+ * @param parts MMB_RUNTIME_BLOOM and/or MMB_RUNTIME_L4, parts to extend
+ * @param replaced parts whose vector was copied
+ */
+static void publish_sessions(mmb_main_t *mm, mmb_runtime_main_t *mrm,
+                             mmb_runtime_t *rt, u32 first, u32 parts,
+                             u32 *replaced) {
+  mmb_lookup_entry_t *lookup_entry;
+  mmb_bloom_t *bloom;
+  mmb_table_t *table;
+  mmb_rule_t *rule;
+  u32 rule_index, table_index;
+
+  for (rule_index = first; rule_index < vec_len(mm->rules); rule_index++) {
+    rule = &mm->rules[rule_index];
+    table = rule_table(mm, rule);
+    if (table == 0)
+      continue;
+
+    /* sessions are added by their first rule */
+    lookup_entry = pool_elt_at_index(mm->lookup_pool, rule->lookup_index);
+    if (lookup_entry->rule_indexes[0] != rule_index)
+      continue;
+
+    table_index = table->index;
+    bloom = mmb_runtime_bloom(rt, table_index);
+
+    if (parts & MMB_RUNTIME_L4) {
+      grow_by_table(rt->l4_by_table, table_index, 0xff, MMB_RUNTIME_L4,
+                    *replaced);
+      if (bloom)
+        rt->l4_by_table[table_index] |= session_l4_bits(table,
+                                                        rule->classify_key);
+      else
+        rt->l4_by_table[table_index] = table_l4_bits(table);
+    }
+
+    if (!(parts & MMB_RUNTIME_BLOOM) 
+        || (bloom && mmb_bloom_add_key(mm, bloom, table, rule->classify_key)))
+      continue;
+
+    /* new table or full filter */
+    bloom = mmb_bloom_build_table(mm, table);
+    if (bloom == 0)
+      continue;
+    grow_by_table(rt->bloom_by_table, table_index, 0, MMB_RUNTIME_BLOOM,
+                  *replaced);
+    if (rt->bloom_by_table[table_index])
+      vec_add1(mrm->deleted_blooms, rt->bloom_by_table[table_index]);
+    /* filter must be complete before threads see it */
+    CLIB_MEMORY_BARRIER();
+    rt->bloom_by_table[table_index] = bloom;
+  }
+}
+
+/**
+ * is_quiescent
+ *
+ * @return 1 if no thread can use a snapshot of given epoch anymore
+ */
+static int is_quiescent(mmb_runtime_main_t *mrm, u64 epoch) {
+  mmb_runtime_thread_t *pt;
+
+  vec_foreach(pt, mrm->per_thread) {
+    if (pt->epoch > epoch)
+      continue;
+    if (!pt->active && pt->in_flight == 0)
+      continue;
+    return 0;
+  }
+  return 1;
+}
+
+static void reclaim(mmb_runtime_main_t *mrm) {
+  mmb_runtime_retired_t *retired;
+  mmb_bloom_t **bloom;
+  mmb_rule_t *rule;
+  u32 **rule_indexes;
+  u32 index = 0;
+
+  /* retired snapshots are in epoch order */
+  vec_foreach(retired, mrm->retired) {
+    if (!is_quiescent(mrm, retired->runtime->epoch))
+      break;
+
+    vl_print(vlib_get_main(), "reclaiming runtime epoch %lu",
+             retired->runtime->epoch);
+    free_runtime(retired->runtime);
+    vec_foreach(rule, retired->rules) {
+      mmb_free_rule(rule);
+    }
+    vec_free(retired->rules);
+    vec_foreach(rule_indexes, retired->rule_indexes) {
+      vec_free(*rule_indexes);
+    }
+    vec_free(retired->rule_indexes);
+    vec_foreach(bloom, retired->blooms) {
+      mmb_bloom_free(*bloom);
+    }
+    vec_free(retired->blooms);
+    index++;
+  }
+
+  if (index)
+    vec_delete(mrm->retired, index, 0);
+}
+
+void mmb_runtime_publish(mmb_main_t *mm) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  vlib_thread_main_t *tm = vlib_get_thread_main();
+  mmb_runtime_t *rt, *old = mrm->current;
+  mmb_runtime_retired_t *retired;
+  u32 parts = mrm->dirty & MMB_RUNTIME_ALL, extended = mrm->appended;
+  u32 replaced, first = old ? old->n_rules : 0;
+
+  /* rule indexes moved, appended rules are not the last ones anymore */
+  if (parts & MMB_RUNTIME_RULES)
+    parts |= extended;
+  parts |= extended & ~MMB_RUNTIME_APPENDABLE;
+  if (old == 0)
+    parts = MMB_RUNTIME_ALL;
+  else if (parts == 0 && extended == 0 && !(mrm->dirty & MMB_RUNTIME_TABLES))
+    return;
+  extended &= ~parts;
+
+  if (mrm->per_thread == 0)
+    vec_validate_aligned(mrm->per_thread, tm->n_vlib_mains - 1,
+                         CLIB_CACHE_LINE_BYTES);
+
+  /* unchanged and extended parts are shared with the previous snapshot */
+  rt = clib_mem_alloc(sizeof(mmb_runtime_t));
+  if (old)
+    clib_memcpy(rt, old, sizeof(mmb_runtime_t));
+  else
+    memset(rt, 0, sizeof(mmb_runtime_t));
+  replaced = parts;
+
+  if (parts & MMB_RUNTIME_RULES)
+    publish_rules(mm, rt, 0);
+  else if (extended & MMB_RUNTIME_RULES)
+    replaced |= publish_rules(mm, rt, first);
+  if (parts & MMB_RUNTIME_LOOKUP)
+    publish_lookup(mm, rt, 0);
+  else if (extended & MMB_RUNTIME_LOOKUP)
+    replaced |= publish_lookup(mm, rt, first);
+  if (parts & MMB_RUNTIME_LPM)
+    mmb_lpm_build(mm->rules, rt->lpm);
+  if (parts & MMB_RUNTIME_BV)
+    mmb_bv_build(mm->rules, 0, rt->bv);
+  if (parts & MMB_RUNTIME_EXACT)
+    mmb_exact_build(mm->rules, rt->exact);
+  if (parts & MMB_RUNTIME_PAYLOAD)
+    rt->payload = mmb_payload_build(mm->rules);
+  if (parts & MMB_RUNTIME_BLOOM) {
+    retire_blooms(mrm, rt->bloom_by_table);
+    rt->bloom_by_table = mmb_bloom_build(mm);
+  }
+  if (parts & MMB_RUNTIME_L4)
+    rt->l4_by_table = build_l4_by_table(mm);
+  if (mrm->dirty & MMB_RUNTIME_TABLES)
+    publish_moves(mrm, rt, ~parts & (MMB_RUNTIME_BLOOM | MMB_RUNTIME_L4),
+                  &replaced);
+  if (extended & (MMB_RUNTIME_BLOOM | MMB_RUNTIME_L4))
+    publish_sessions(mm, mrm, rt, first, extended, &replaced);
+  rt->owned = MMB_RUNTIME_ALL;
+  rt->epoch = ++mrm->epoch;
+
+  /* snapshot must be complete before it becomes visible */
+  CLIB_MEMORY_BARRIER();
+  mrm->current = rt;
+  CLIB_MEMORY_BARRIER();
+  mrm->dirty = mrm->appended = 0;
+  vec_reset_length(mrm->moved_tables);
+
+  /* rules, vectors and filters deleted since last publication are 
+   * referenced by old only, old keeps the parts that were copied */
+  if (old) {
+    old->owned = replaced;
+    vec_add2(mrm->retired, retired, 1);
+    retired->runtime = old;
+    retired->rules = mrm->deleted_rules;
+    retired->rule_indexes = mrm->deleted_rule_indexes;
+    retired->blooms = mrm->deleted_blooms;
+    mrm->deleted_rules = 0;
+    mrm->deleted_rule_indexes = 0;
+    mrm->deleted_blooms = 0;
+  }
+
+  reclaim(mrm);
+}
+
+void mmb_runtime_publish_pending(mmb_main_t *mm) {
+  mmb_runtime_sync_counters(mm);
+  mmb_runtime_publish(mm);
+}
+
+void mmb_runtime_publish_later(mmb_main_t *mm) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+
+  if (mrm->current == 0 || (mrm->dirty & MMB_RUNTIME_TABLES)) {
+    mmb_runtime_publish(mm);
+    return;
+  }
+  if ((mrm->dirty | mrm->appended) == 0 || mrm->publish_pending)
+    return;
+
+  mrm->publish_pending = 1;
+  vlib_process_signal_event(mm->vlib_main, mmb_runtime_process_node.index,
+                            0, 0);
+}
+
+void mmb_runtime_move_table(u32 old_index, u32 new_index) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+
+  vec_add1(mrm->moved_tables, old_index);
+  vec_add1(mrm->moved_tables, new_index);
+  mrm->dirty |= MMB_RUNTIME_TABLES;
+}
+
+void mmb_runtime_retire_rule(mmb_rule_t *rule) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+
+  if (mrm->current == 0) {
+    mmb_free_rule(rule);
+    return;
+  }
+  vec_add1(mrm->deleted_rules, *rule);
+}
+
+void mmb_runtime_retire_rule_indexes(u32 *rule_indexes) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+
+  if (mrm->current == 0) {
+    vec_free(rule_indexes);
+    return;
+  }
+  if (rule_indexes)
+    vec_add1(mrm->deleted_rule_indexes, rule_indexes);
+}
+
+void mmb_runtime_sync_counters(mmb_main_t *mm) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  mmb_runtime_t *rt = mrm->current;
+  u32 rule_index;
+
+  /* rules deletions are published at once, pending changes are appends */
+  if (rt == 0 || rt->n_rules > vec_len(mm->rules))
+    return;
+
+  for (rule_index = 0; rule_index < rt->n_rules; rule_index++)
+    mm->rules[rule_index].match_count = rt->rules[rule_index].match_count;
+}
+
+/**
+ * mmb_runtime_process
+ *
+ * publish changes marked outside a batch once the burst is over.
+ */
+static uword mmb_runtime_process(vlib_main_t *vm, vlib_node_runtime_t *rt,
+                                 vlib_frame_t *f) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  uword *event_data = 0;
+
+  while (1) {
+    vlib_process_wait_for_event(vm);
+    vlib_process_get_events(vm, &event_data);
+    vec_reset_length(event_data);
+
+    vlib_process_suspend(vm, MMB_RUNTIME_PUBLISH_DELAY);
+    mrm->publish_pending = 0;
+    mmb_runtime_publish_pending(&mmb_main);
+  }
+  return 0;
+}
+
+VLIB_REGISTER_NODE(mmb_runtime_process_node) = {
+  .function = mmb_runtime_process,
+  .type = VLIB_NODE_TYPE_PROCESS,
+  .name = "mmb-runtime-process",
+};
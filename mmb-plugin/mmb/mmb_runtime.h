@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2015 Cisco and/or its affiliates.
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at:
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * rule snapshots published to the data plane.
+ *
+ * Changes of mmb_main.rules or mmb_main.lookup_pool mark the parts of the
+ * snapshot they affect, the next publication builds these parts again and
+ * shares the others with the previous snapshot, which is retired. A retired
+ * snapshot is freed once every thread either uses a newer epoch or is
+ * outside the mmb nodes with no buffer classified against it still waiting
+ * for rewrite.
+ *
+ * Rules appended to mmb_main.rules are published in place: rules and lookup
+ * entries are stored with spare capacity, a snapshot only sees the rules
+ * below its own rule count, and session filters and protocol classes only
+ * gain bits. Storage is copied when it has to grow, and every part is built
+ * again when rules are deleted.
+ *
+ * Rule indexes vectors of the lookup pool and session filters are shared
+ * with the snapshots: the control plane replaces them instead of modifying
+ * them and retires the old ones.
+ */
+
+#ifndef __included_mmb_runtime_h__
+#define __included_mmb_runtime_h__
+
+#include <vlib/vlib.h>
+#include <mmb/mmb.h>
+#include <mmb/mmb_lpm.h>
+#include <mmb/mmb_bloom.h>
+#include <mmb/mmb_bitvector.h>
+#include <mmb/mmb_exact.h>
+#include <mmb/mmb_payload.h>
+
+/* parts of a snapshot */
+#define MMB_RUNTIME_RULES   (1 << 0)
+#define MMB_RUNTIME_LOOKUP  (1 << 1)
+#define MMB_RUNTIME_LPM     (1 << 2)
+#define MMB_RUNTIME_BV      (1 << 3)
+#define MMB_RUNTIME_EXACT   (1 << 4)
+#define MMB_RUNTIME_PAYLOAD (1 << 5)
+#define MMB_RUNTIME_BLOOM   (1 << 6)
+#define MMB_RUNTIME_L4      (1 << 7)
+#define MMB_RUNTIME_ALL     ((1 << 8) - 1)
+/* parts extended in place by appended rules, others are built again */
+#define MMB_RUNTIME_APPENDABLE \
+  (MMB_RUNTIME_RULES | MMB_RUNTIME_LOOKUP | MMB_RUNTIME_BLOOM | MMB_RUNTIME_L4)
+/* classifier tables moved: a table index in the snapshot may be reused by
+ * another table, filters are published at once */
+#define MMB_RUNTIME_TABLES  (1 << 8)
+
+/* initial capacity of rule and lookup storage */
+#define MMB_RUNTIME_MIN_CAPACITY 64
+
+/* delay before changes outside a batch are published, in seconds */
+#define MMB_RUNTIME_PUBLISH_DELAY 1e-3
+
+typedef struct mmb_runtime {
+  mmb_rule_t *rules; /*! copy of mmb_main.rules, storage may be shared
+                         with newer snapshots holding more rules */
+  u32 n_rules; /*! rules of this snapshot */
+  mmb_lookup_entry_t *lookup; /*! mmb_main.lookup_pool as a vector, free
+                                  entries have no rule_indexes, entries of
+                                  later sessions may be set in place */
+  mmb_lpm_t *lpm[MMB_CLASSIFY_N_TABLES][MMB_LPM_N_DIR]; /*! prefix rules */
+  mmb_bloom_t **bloom_by_table; /*! session filters by classifier table,
+                                    set in place by later sessions */
+  u8 *l4_by_table; /*! mmb_classify_l4_bit of the packets the sessions of
+                       each classifier table can match, 0xff if the table
+                       is not in the snapshot */
+  mmb_bv_t *bv[MMB_CLASSIFY_N_TABLES]; /*! bit vector rules */
+  mmb_exact_t *exact[MMB_CLASSIFY_N_TABLES]; /*! exact 5-tuple rules */
+  mmb_payload_t *payload; /*! payload patterns */
+  u32 owned; /*! parts freed with this snapshot, others are shared with
+                 the next one */
+  u64 epoch;
+} mmb_runtime_t;
+
+typedef struct {
+  CLIB_CACHE_LINE_ALIGN_MARK(cacheline0);
+  mmb_runtime_t *runtime; /*! snapshot used by this thread */
+  volatile u64 epoch; /*! epoch of runtime */
+  volatile u32 active; /*! thread is running a mmb node */
+  volatile u32 in_flight; /*! buffers classified, not rewritten yet */
+  u64 bloom_negatives; /*! table lookups skipped by a filter */
+  u64 bloom_false_positives; /*! filter hits that missed the table */
+  mmb_payload_hits_t *pattern_hits; /*! payload pattern hits, by pattern 
+                                        id, grown by the thread */
+  u32 *bv_rule_indexes; /*! bit vector lookup scratch of the thread */
+} mmb_runtime_thread_t;
+
+typedef struct {
+  mmb_runtime_t *runtime;
+  mmb_rule_t *rules; /*! deleted rules still referenced by runtime */
+  u32 **rule_indexes; /*! replaced lookup vectors still referenced by
+                          runtime */
+  mmb_bloom_t **blooms; /*! replaced session filters still referenced by
+                            runtime */
+} mmb_runtime_retired_t;
+
+typedef struct {
+  mmb_runtime_t * volatile current; /*! last published snapshot */
+  u64 epoch; /*! epoch of current */
+  mmb_runtime_thread_t *per_thread; /*! per thread state */
+  mmb_runtime_retired_t *retired; /*! snapshots waiting for reclaim */
+  mmb_rule_t *deleted_rules; /*! rules deleted since last publication */
+  u32 **deleted_rule_indexes; /*! lookup vectors replaced since last
+                                  publication */
+  mmb_bloom_t **deleted_blooms; /*! filters replaced since last
+                                    publication */
+  u32 *moved_tables; /*! old and new index of the classifier tables
+                         moved since last publication */
+  u32 dirty; /*! MMB_RUNTIME_* parts changed since last publication */
+  u32 appended; /*! MMB_RUNTIME_* parts holding rules appended since last
+                    publication */
+  u8 publish_pending; /*! publication scheduled */
+} mmb_runtime_main_t;
+
+mmb_runtime_main_t mmb_runtime_main;
+
+/**
+ * mmb_runtime_mark
+ *
+ * mark parts of the snapshot changed by the control plane, they are built
+ * again on publication.
+ */
+static_always_inline void mmb_runtime_mark(u32 parts) {
+  mmb_runtime_main.dirty |= parts;
+}
+
+/**
+ * mmb_runtime_mark_append
+ *
+ * mark parts of the snapshot holding a rule appended to mmb_main.rules,
+ * parts of MMB_RUNTIME_APPENDABLE are extended in place on publication.
+ */
+static_always_inline void mmb_runtime_mark_append(u32 parts) {
+  mmb_runtime_main.appended |= parts;
+}
+
+/**
+ * mmb_runtime_move_table
+ *
+ * record that a classifier table was replaced by a table of same mask at
+ * new_index, its filter and protocol classes follow it.
+ */
+void mmb_runtime_move_table(u32 old_index, u32 new_index);
+
+/**
+ * mmb_runtime_publish
+ *
+ * publish a snapshot with the marked parts built again or extended from
+ * mmb_main, retire the previous one and reclaim retired snapshots no thread
+ * can use anymore. Nothing is published if no part is marked.
+ */
+void mmb_runtime_publish(mmb_main_t *mm);
+
+/**
+ * mmb_runtime_publish_pending
+ *
+ * publish changes made outside a batch now, with the counters of the rules
+ * of the current snapshot.
+ */
+void mmb_runtime_publish_pending(mmb_main_t *mm);
+
+/**
+ * mmb_runtime_publish_later
+ *
+ * publish marked parts after MMB_RUNTIME_PUBLISH_DELAY, so that a burst of
+ * changes is published once. Published at once if tables changed.
+ */
+void mmb_runtime_publish_later(mmb_main_t *mm);
+
+/**
+ * mmb_runtime_retire_rule
+ *
+ * free rule once no published snapshot references it.
+ */
+void mmb_runtime_retire_rule(mmb_rule_t *rule);
+
+/**
+ * mmb_runtime_retire_rule_indexes
+ *
+ * free a lookup vector once no published snapshot references it.
+ */
+void mmb_runtime_retire_rule_indexes(u32 *rule_indexes);
+
+/**
+ * mmb_runtime_sync_counters
+ *
+ * copy data plane counters of the current snapshot to mmb_main rules,
+ * must be called before mmb_main rules are modified. Rules added since
+ * the last publication are appended, others keep their index.
+ */
+void mmb_runtime_sync_counters(mmb_main_t *mm);
+
+/**
+ * mmb_runtime_enter
+ *
+ * get the snapshot to use in a mmb node. The snapshot is refreshed only
+ * if no buffer classified with the previous one is waiting for rewrite.
+ *
+ * @return snapshot, NULL if none was published yet
+ */
+static_always_inline mmb_runtime_t *mmb_runtime_enter(u32 thread_index) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  mmb_runtime_thread_t *pt;
+
+  if (PREDICT_FALSE(mrm->current == 0))
+    return 0;
+
+  pt = vec_elt_at_index(mrm->per_thread, thread_index);
+  pt->active = 1;
+  CLIB_MEMORY_BARRIER();
+
+  if (pt->in_flight == 0 || pt->runtime == 0) {
+    pt->runtime = mrm->current;
+    pt->epoch = pt->runtime->epoch;
+  }
+
+  return pt->runtime;
+}
+
+/**
+ * mmb_runtime_leave
+ *
+ * leave a mmb node.
+ * @param in_flight number of buffers sent to (>0) or received from (<0)
+ *                  the rewrite node
+ */
+static_always_inline void mmb_runtime_leave(u32 thread_index,
+                                            i32 in_flight) {
+  mmb_runtime_main_t *mrm = &mmb_runtime_main;
+  mmb_runtime_thread_t *pt = vec_elt_at_index(mrm->per_thread, thread_index);
+
+  if (in_flight < 0 && pt->in_flight < -in_flight)
+    pt->in_flight = 0;
+  else
+    pt->in_flight += in_flight;
+
+  CLIB_MEMORY_BARRIER();
+  pt->active = 0;
+}
+
+/**
+ * mmb_runtime_lookup
+ *
+ * @return rule indexes of a classifier session, NULL if the session was
+ *         added after the snapshot was published
+ */
+static_always_inline u32 *mmb_runtime_lookup(mmb_runtime_t *rt,
+                                             u32 lookup_index) {
+  if (rt == 0 || lookup_index >= vec_len(rt->lookup))
+    return 0;
+  return rt->lookup[lookup_index].rule_indexes;
+}
+
+/**
+ * mmb_runtime_bloom
+ *
+ * @return filter of a classifier table, NULL if the table is not in the
+ *         snapshot
+ */
+static_always_inline mmb_bloom_t *mmb_runtime_bloom(mmb_runtime_t *rt,
+                                                    u32 table_index) {
+  if (rt == 0 || table_index >= vec_len(rt->bloom_by_table))
+    return 0;
+  return rt->bloom_by_table[table_index];
+}
+
+/**
+ * mmb_runtime_l4_maybe
+ *
+ * @return 0 if no session of a classifier table can match packets of the
+ *         family and protocol class l4_bit, 1 otherwise or if the table is
+ *         not in the snapshot
+ */
+static_always_inline int mmb_runtime_l4_maybe(mmb_runtime_t *rt,
+                                              u32 table_index, u8 l4_bit) {
+  if (rt == 0 || table_index >= vec_len(rt->l4_by_table))
+    return 1;
+  return (rt->l4_by_table[table_index] & l4_bit) != 0;
+}
+
+/**
+ * mmb_runtime_rule
+ *
+ * @return rule at rule_index, NULL if not in the snapshot
+ */
+static_always_inline mmb_rule_t *
+mmb_runtime_rule(mmb_runtime_t *rt, u32 rule_index) {
+  if (rt == 0 || rule_index >= rt->n_rules)
+    return 0;
+  return vec_elt_at_index(rt->rules, rule_index);
+}
+
+#endif /* __included_mmb_runtime_h__ */
@@ -65,7 +65,15 @@ mmb_test_main_t mmb_test_main;
 
 #define foreach_standard_reply_retval_handler  \
 _(mmb_table_flush_reply)                       \
-_(mmb_remove_rule_reply)
+_(mmb_remove_rule_reply)                       \
+_(mmb_batch_begin_reply)                       \
+_(mmb_batch_commit_reply)                      \
+_(mmb_batch_abort_reply)                       \
+_(mmb_load_reply)                              \
+_(mmb_conn_limits_set_reply)                   \
+_(mmb_ipset_create_reply)                      \
+_(mmb_ipset_delete_reply)                      \
+_(mmb_ipset_add_del_reply)
 
 #define _(n)                                            \
     static void vl_api_##n##_t_handler                  \
@@ -89,7 +97,15 @@ foreach_standard_reply_retval_handler;
  */
 #define foreach_vpe_api_reply_msg                \
 _(MMB_TABLE_FLUSH_REPLY, mmb_table_flush_reply)  \
-_(MMB_REMOVE_RULE_REPLY, mmb_remove_rule_reply)
+_(MMB_REMOVE_RULE_REPLY, mmb_remove_rule_reply)  \
+_(MMB_BATCH_BEGIN_REPLY, mmb_batch_begin_reply)  \
+_(MMB_BATCH_COMMIT_REPLY, mmb_batch_commit_reply)  \
+_(MMB_BATCH_ABORT_REPLY, mmb_batch_abort_reply)  \
+_(MMB_LOAD_REPLY, mmb_load_reply)  \
+_(MMB_CONN_LIMITS_SET_REPLY, mmb_conn_limits_set_reply)  \
+_(MMB_IPSET_CREATE_REPLY, mmb_ipset_create_reply)  \
+_(MMB_IPSET_DELETE_REPLY, mmb_ipset_delete_reply)  \
+_(MMB_IPSET_ADD_DEL_REPLY, mmb_ipset_add_del_reply)
 
 
 static int api_mmb_table_flush(vat_main_t *vam)
@@ -133,13 +149,269 @@ static int api_mmb_remove_rule(vat_main_t *vam)
   return ret;
 }
 
+static int api_mmb_batch_begin(vat_main_t *vam)
+{
+  vl_api_mmb_batch_begin_t *mp;
+  int ret = 0;
+
+  /* Construct the API message */
+  M(MMB_BATCH_BEGIN, mp);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_batch_commit(vat_main_t *vam)
+{
+  vl_api_mmb_batch_commit_t *mp;
+  int ret = 0;
+
+  /* Construct the API message */
+  M(MMB_BATCH_COMMIT, mp);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_batch_abort(vat_main_t *vam)
+{
+  vl_api_mmb_batch_abort_t *mp;
+  int ret = 0;
+
+  /* Construct the API message */
+  M(MMB_BATCH_ABORT, mp);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_load(vat_main_t *vam)
+{
+  unformat_input_t *i = vam->input;
+  vl_api_mmb_load_t *mp;
+  u8 *filename = 0;
+  int ret = 0;
+
+  if (!unformat(i, "%s", &filename))
+  {
+    errmsg ("missing file name\n");
+    return -1;
+  }
+  if (vec_len(filename) >= sizeof(mp->filename))
+  {
+    errmsg ("file name too long\n");
+    vec_free(filename);
+    return -1;
+  }
+
+  /* Construct the API message */
+  M(MMB_LOAD, mp);
+  clib_memcpy(mp->filename, filename, vec_len(filename));
+  vec_free(filename);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int unformat_ipset_name(vat_main_t *vam, u8 **name, u32 max_len)
+{
+  if (!unformat(vam->input, "%s", name))
+  {
+    errmsg ("missing set name\n");
+    return -1;
+  }
+  if (vec_len(*name) >= max_len)
+  {
+    errmsg ("set name too long\n");
+    vec_free(*name);
+    return -1;
+  }
+  return 0;
+}
+
+static int api_mmb_conn_limits_set(vat_main_t *vam)
+{
+  unformat_input_t *i = vam->input;
+  vl_api_mmb_conn_limits_set_t *mp;
+  u32 max_connections = 0, tcp_transient = 0, tcp_idle = 0, udp_idle = 0;
+  u8 eviction = 0;
+  int ret = 0;
+
+  while (unformat_check_input(i) != UNFORMAT_END_OF_INPUT)
+  {
+    if (unformat(i, "max-connections %u", &max_connections))
+      ;
+    else if (unformat(i, "tcp-transient-timeout %u", &tcp_transient))
+      ;
+    else if (unformat(i, "tcp-idle-timeout %u", &tcp_idle))
+      ;
+    else if (unformat(i, "udp-idle-timeout %u", &udp_idle))
+      ;
+    else if (unformat(i, "eviction none"))
+      eviction = 1;
+    else if (unformat(i, "eviction lru"))
+      eviction = 2;
+    else
+    {
+      errmsg ("unknown input `%U'\n", format_unformat_error, i);
+      return -1;
+    }
+  }
+
+  /* Construct the API message */
+  M(MMB_CONN_LIMITS_SET, mp);
+  mp->max_connections = htonl(max_connections);
+  mp->tcp_transient_timeout = htonl(tcp_transient);
+  mp->tcp_idle_timeout = htonl(tcp_idle);
+  mp->udp_idle_timeout = htonl(udp_idle);
+  mp->eviction = eviction;
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_ipset_create(vat_main_t *vam)
+{
+  vl_api_mmb_ipset_create_t *mp;
+  u8 *name = 0;
+  int ret = 0;
+
+  if (unformat_ipset_name(vam, &name, sizeof(mp->name)))
+    return -1;
+
+  /* Construct the API message */
+  M(MMB_IPSET_CREATE, mp);
+  clib_memcpy(mp->name, name, vec_len(name));
+  mp->is_ip6 = unformat(vam->input, "ip6");
+  vec_free(name);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_ipset_delete(vat_main_t *vam)
+{
+  vl_api_mmb_ipset_delete_t *mp;
+  u8 *name = 0;
+  int ret = 0;
+
+  if (unformat_ipset_name(vam, &name, sizeof(mp->name)))
+    return -1;
+
+  /* Construct the API message */
+  M(MMB_IPSET_DELETE, mp);
+  clib_memcpy(mp->name, name, vec_len(name));
+  vec_free(name);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
+static int api_mmb_ipset_add_del(vat_main_t *vam)
+{
+  unformat_input_t *i = vam->input;
+  vl_api_mmb_ipset_add_del_t *mp;
+  vl_api_mmb_ipset_prefix_t *prefixes = 0, prefix;
+  u8 *name = 0, is_add = 1, replace = 0;
+  u32 len;
+  int ret = 0;
+
+  if (unformat_ipset_name(vam, &name, sizeof(mp->name)))
+    return -1;
+
+  while (unformat_check_input(i) != UNFORMAT_END_OF_INPUT)
+  {
+    memset(&prefix, 0, sizeof(prefix));
+    if (unformat(i, "del"))
+      is_add = 0;
+    else if (unformat(i, "replace"))
+      replace = 1;
+    else if (unformat(i, "%U", unformat_ip4_address, prefix.address))
+    {
+      len = 32;
+      unformat(i, "/%u", &len);
+      prefix.length = len;
+      vec_add1(prefixes, prefix);
+    }
+    else if (unformat(i, "%U", unformat_ip6_address, prefix.address))
+    {
+      len = 128;
+      unformat(i, "/%u", &len);
+      prefix.length = len;
+      vec_add1(prefixes, prefix);
+    }
+    else
+    {
+      errmsg ("invalid prefix '%U'\n", format_unformat_error, i);
+      vec_free(prefixes);
+      vec_free(name);
+      return -1;
+    }
+  }
+
+  /* Construct the API message */
+  M2(MMB_IPSET_ADD_DEL, mp, vec_bytes(prefixes));
+  clib_memcpy(mp->name, name, vec_len(name));
+  mp->is_add = is_add;
+  mp->replace = replace;
+  mp->count = htonl(vec_len(prefixes));
+  clib_memcpy(mp->prefixes, prefixes, vec_bytes(prefixes));
+  vec_free(prefixes);
+  vec_free(name);
+
+  /* send it... */
+  S(mp);
+
+  /* Wait for a reply... */
+  W(ret);
+  return ret;
+}
+
 /* 
  * List of messages that the api test plugin sends,
  * and that the data plane plugin processes
  */
 #define foreach_vpe_api_msg         \
 _(mmb_table_flush, "")              \
-_(mmb_remove_rule, "<rule_index>")
+_(mmb_remove_rule, "<rule_index>")  \
+_(mmb_batch_begin, "")              \
+_(mmb_batch_commit, "")             \
+_(mmb_batch_abort, "")              \
+_(mmb_load, "<file>")                \
+_(mmb_conn_limits_set, "[max-connections <n>] [tcp-transient-timeout <sec>] " \
+                       "[tcp-idle-timeout <sec>] [udp-idle-timeout <sec>] " \
+                       "[eviction lru|none]") \
+_(mmb_ipset_create, "<name> [ip6]") \
+_(mmb_ipset_delete, "<name>")       \
+_(mmb_ipset_add_del, "<name> [del|replace] <prefix>...")
 
 static void mmb_api_hookup (vat_main_t *vam)
 {
@@ -1,6 +1,7 @@
 #!/usr/bin/env python
 
 from __future__ import print_function
+import socket
 from vpp_papi import VPP
 
 vpp = VPP(['/usr/share/vpp/api/vpe.api.json', '/home/vagrant/vpp-mb/mmb-plugin/mmb/mmb.api.json'])
@@ -49,6 +50,64 @@ for rule in vpp.mmb_table_dump():
   print(' rule num ', rule.rule_num)
 print('================\n')
 
+print('Committing an empty batch...')
+r = vpp.mmb_batch_begin()
+print('return status = ', r.retval)
+r = vpp.mmb_batch_commit()
+print('return status = ', r.retval, '\n')
+
+print('Committing with no open batch (fails)...')
+r = vpp.mmb_batch_commit()
+print('return status = ', r.retval, '\n')
+
+print('Aborting a batch...')
+r = vpp.mmb_batch_begin()
+print('return status = ', r.retval)
+r = vpp.mmb_batch_abort()
+print('return status = ', r.retval, '\n')
+
+print('Loading rules of /tmp/mmb_api_rules.txt (see api_test.sh)...')
+r = vpp.mmb_load(filename=b'/tmp/mmb_api_rules.txt')
+print('return status = ', r.retval, '\n')
+
+print('MMB table rules:')
+print('================')
+for rule in vpp.mmb_table_dump():
+  print(' rule num ', rule.rule_num)
+print('================\n')
+
+print('Creating ipset api-set...')
+r = vpp.mmb_ipset_create(name=b'api-set', is_ip6=0)
+print('return status = ', r.retval, '\n')
+
+print('Adding 10.0.0.0/8 and 192.168.1.1/32 to api-set...')
+prefixes = [{'address': socket.inet_pton(socket.AF_INET, '10.0.0.0')
+                        + b'\x00' * 12, 'length': 8},
+            {'address': socket.inet_pton(socket.AF_INET, '192.168.1.1')
+                        + b'\x00' * 12, 'length': 32}]
+r = vpp.mmb_ipset_add_del(name=b'api-set', is_add=1, replace=0,
+                          count=len(prefixes), prefixes=prefixes)
+print('return status = ', r.retval, '\n')
+
+print('Removing 192.168.1.1/32 from api-set...')
+r = vpp.mmb_ipset_add_del(name=b'api-set', is_add=0, replace=0,
+                          count=1, prefixes=prefixes[1:])
+print('return status = ', r.retval, '\n')
+
+print('Deleting ipset api-set...')
+r = vpp.mmb_ipset_delete(name=b'api-set')
+print('return status = ', r.retval, '\n')
+
+print('Setting connection limits...')
+r = vpp.mmb_conn_limits_set(max_connections=100000, tcp_transient_timeout=0,
+                            tcp_idle_timeout=0, udp_idle_timeout=300,
+                            eviction=2)
+print('return status = ', r.retval, '\n')
+
+print('Flushing MMB table...')
+r = vpp.mmb_table_flush();
+print('return status = ', r.retval, '\n')
+
 r = vpp.disconnect()
 #print(r)
 
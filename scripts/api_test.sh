@@ -7,3 +7,27 @@ sudo vppctl -s /run/vpp/cli-vpp1.sock mmb add ip-dscp 1 mod ip-dscp 1234
 sudo vppctl -s /run/vpp/cli-vpp1.sock mmb add tcp-dport 80 mod tcp-dport 8000
 sudo vppctl -s /run/vpp/cli-vpp1.sock mmb add udp-dport 80 mod udp-dport 8000
 
+# rules file read by mmb load, here and by api_test.py
+cat > /tmp/mmb_api_rules.txt <<EOF
+# loaded by api_test
+tcp-dport 443 mod tcp-dport 4430
+add-stateless udp-dport 53 drop
+EOF
+
+# batch
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb begin
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb add tcp-sport 22 drop
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb commit
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb begin
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb add tcp-sport 23 drop
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb abort
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb load /tmp/mmb_api_rules.txt
+
+# address sets
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb ipset create blocked
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb ipset add blocked 10.0.0.0/8 192.168.1.1/32
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb ipset del blocked 192.168.1.1/32
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb ipset delete blocked
+
+# connection table
+sudo vppctl -s /run/vpp/cli-vpp1.sock mmb set connections max-connections 100000 eviction lru